@@ -0,0 +1,1720 @@
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "ethsnarks.hpp"
+#include "snasma.hpp"
+#include "txfile.hpp"
+#include "compact.hpp"
+#include "store.hpp"
+#include "mempool.hpp"
+#include "txgroup.hpp"
+#include "verify.hpp"
+#include "preflight.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+
+#include <errno.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using std::string;
+using std::vector;
+
+using namespace ethsnarks;
+
+typedef std::chrono::steady_clock ClockT;
+
+
+static double seconds_since( const ClockT::time_point& start )
+{
+	return std::chrono::duration<double>(ClockT::now() - start).count();
+}
+
+
+/**
+* Accounts used by the benchmarks, each with a balance of 1000000 and a
+* random public key, so their signatures can't be made or checked
+*/
+static const vector<snasma::AccountState> random_accounts( size_t n )
+{
+	vector<snasma::AccountState> result;
+	result.reserve(n);
+	for( size_t i = 0; i < n; i++ )
+	{
+		const jubjub::EdwardsPoint pubkey(FieldT::random_element(), FieldT::random_element());
+		result.emplace_back(pubkey, FieldT(1000000));
+	}
+	return result;
+}
+
+
+/**
+* As `random_accounts`, but each has a key pair, the secret keys are
+* appended to `secrets` to sign with `snasma::eddsa_sign`
+*/
+static const vector<snasma::AccountState> keyed_accounts( size_t n, const jubjub::Params& params, vector<FieldT>& secrets )
+{
+	vector<snasma::AccountState> result;
+	result.reserve(n);
+	for( size_t i = 0; i < n; i++ )
+	{
+		secrets.emplace_back(FieldT::random_element());
+		result.emplace_back(snasma::eddsa_public_key(params, secrets.back()), FieldT(1000000));
+	}
+	return result;
+}
+
+
+/**
+* Append each account to a tree or store, in order
+*/
+template<typename TreeT>
+static void append_accounts( TreeT& tree, const vector<snasma::AccountState>& accounts )
+{
+	for( const auto& state : accounts ) {
+		tree.append(state);
+	}
+}
+
+
+/**
+* Measures the rate at which transactions can be applied to the account tree,
+* only the tree updates and proof extraction are measured, signatures are not.
+*/
+int bench_tree( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: tree <n_accounts> <n_transactions>" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	if( arg_accounts < 1 ) {
+		cerr << "Error: need at least 1 account" << endl;
+		return 1;
+	}
+
+	snasma::AccountTree tree(arg_accounts);
+
+	const auto accounts = random_accounts(arg_accounts);
+	auto start = ClockT::now();
+	append_accounts(tree, accounts);
+	const auto append_time = seconds_since(start);
+
+	cout << "append: " << arg_accounts << " accounts in " << append_time << "s ("
+		 << (arg_accounts / append_time) << " accounts/sec)" << endl;
+
+	snasma::TxProof proof;
+	start = ClockT::now();
+	for( size_t i = 0; i < arg_transactions; i++ )
+	{
+		const auto from_idx = uint32_t(rand() % arg_accounts);
+		const auto to_idx = uint32_t(rand() % arg_accounts);
+		const snasma::OnchainTransaction tx(from_idx, to_idx, 1);
+		const snasma::SignedTransaction stx(snasma::Signature(), tx, tree.account(from_idx).nonce);
+
+		if( ! tree.apply(stx, proof) ) {
+			cerr << "Error: transaction " << i << " failed" << endl;
+			return 2;
+		}
+	}
+	const auto apply_time = seconds_since(start);
+
+	cout << "apply: " << arg_transactions << " transactions in " << apply_time << "s ("
+		 << (arg_transactions / apply_time) << " tx/sec)" << endl;
+
+	return 0;
+}
+
+
+/**
+* Applies the same transactions to a dense and a sparse tree, verifying that
+* the roots and paths are identical, and reports the memory used by each.
+*
+* Accounts are allocated sequentially, which is the best case for the dense
+* tree; with scattered indices its storage grows towards `2^TREE_DEPTH`
+* leaves, whereas the sparse tree only grows with the number of accounts.
+*/
+int bench_sparse( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: sparse <n_accounts> <n_transactions>" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	if( arg_accounts < 1 || arg_accounts > (1u << snasma::TREE_DEPTH) ) {
+		cerr << "Error: number of accounts out of range" << endl;
+		return 1;
+	}
+
+	snasma::AccountTree dense(arg_accounts);
+	snasma::SparseAccountTree sparse;
+
+	const auto accounts = random_accounts(arg_accounts);
+	append_accounts(dense, accounts);
+	append_accounts(sparse, accounts);
+
+	if( dense.root() != sparse.root() ) {
+		cerr << "Error: roots differ after append" << endl;
+		return 2;
+	}
+
+	snasma::TxProof dense_proof;
+	snasma::TxProof sparse_proof;
+	for( size_t i = 0; i < arg_transactions; i++ )
+	{
+		const auto from_idx = uint32_t(rand() % arg_accounts);
+		const auto to_idx = uint32_t(rand() % arg_accounts);
+		const snasma::OnchainTransaction tx(from_idx, to_idx, 1);
+		const snasma::SignedTransaction stx(snasma::Signature(), tx, dense.account(from_idx).nonce);
+
+		if( ! dense.apply(stx, dense_proof) || ! sparse.apply(stx, sparse_proof) ) {
+			cerr << "Error: transaction " << i << " failed" << endl;
+			return 2;
+		}
+
+		if( dense_proof.merkle_root != sparse_proof.merkle_root
+		 || dense_proof.before_from != sparse_proof.before_from
+		 || dense_proof.before_to != sparse_proof.before_to )
+		{
+			cerr << "Error: proofs differ for transaction " << i << endl;
+			return 2;
+		}
+	}
+
+	if( dense.root() != sparse.root() ) {
+		cerr << "Error: roots differ after transactions" << endl;
+		return 2;
+	}
+
+	cout << "roots and paths identical" << endl;
+	cout << "dense: " << dense.m_store.num_nodes() << " nodes, " << dense.m_store.memory_usage() << " bytes" << endl;
+	cout << "sparse: " << sparse.m_store.num_nodes() << " nodes, " << sparse.m_store.memory_usage() << " bytes" << endl;
+
+	return 0;
+}
+
+
+/**
+* Replays the transactions written by `test_snasma.py` on a dense and a
+* sparse tree, each must record the same merkle root and paths as the
+* Python `MerkleTree` did for every transaction.
+*
+* The initial state of each account is its state the first time it is
+* seen, the accounts must be numbered from zero without gaps.
+*/
+int check_sparse( int argc, char **argv )
+{
+	if( argc < 1 ) {
+		cerr << "Usage: check-sparse <transactions.txt>" << endl;
+		return 1;
+	}
+
+	std::ifstream infile(argv[0]);
+	if( ! infile.is_open() ) {
+		cerr << "Error: cannot open input file - " << argv[0] << endl;
+		return 2;
+	}
+
+	vector<snasma::TxProof> items;
+	string line;
+	while( std::getline(infile, line) )
+	{
+		if( line.empty() || line[0] == '#' ) {
+			continue;
+		}
+
+		snasma::TxProof item;
+		if( ! (std::istringstream(line) >> item) || ! item.is_valid() ) {
+			cerr << "Error: cannot parse line " << items.size() << endl;
+			return 2;
+		}
+		items.emplace_back(item);
+	}
+
+	if( items.empty() ) {
+		cerr << "Error: no transactions" << endl;
+		return 2;
+	}
+
+	std::map<uint32_t, snasma::AccountState> initial;
+	for( const auto& item : items )
+	{
+		initial.emplace(item.stx.tx.from_idx, item.state_from);
+		if( item.stx.tx.to_idx != item.stx.tx.from_idx ) {
+			initial.emplace(item.stx.tx.to_idx, item.state_to);
+		}
+	}
+
+	if( initial.rbegin()->first + size_t(1) != initial.size() ) {
+		cerr << "Error: accounts aren't numbered from zero without gaps" << endl;
+		return 2;
+	}
+
+	vector<snasma::AccountState> accounts;
+	for( const auto& it : initial ) {
+		accounts.emplace_back(it.second);
+	}
+
+	snasma::AccountTree dense(accounts.size());
+	snasma::SparseAccountTree sparse;
+	append_accounts(dense, accounts);
+	append_accounts(sparse, accounts);
+
+	snasma::TxProof dense_proof;
+	snasma::TxProof sparse_proof;
+	for( size_t i = 0; i < items.size(); i++ )
+	{
+		const auto& expected = items[i];
+		if( ! dense.apply(expected.stx, dense_proof) || ! sparse.apply(expected.stx, sparse_proof) ) {
+			cerr << "Error: transaction " << i << " failed" << endl;
+			return 2;
+		}
+
+		for( const auto* proof : {&dense_proof, &sparse_proof} )
+		{
+			if( proof->merkle_root != expected.merkle_root
+			 || proof->before_from != expected.before_from
+			 || proof->before_to != expected.before_to )
+			{
+				cerr << "Error: " << (proof == &dense_proof ? "dense" : "sparse") << " tree doesn't match transaction " << i << endl;
+				return 2;
+			}
+		}
+	}
+
+	cout << "sparse: " << items.size() << " transactions, roots and paths match the Python tree" << endl;
+
+	return 0;
+}
+
+
+/**
+* Compares per-leaf updates against bulk updates, which rehash each modified
+* node once, for creating accounts and for applying transactions. The same
+* changes are made to two trees, whose roots must match. The proofs taken
+* after the bulk update must match those recorded by `apply`.
+*/
+int bench_bulk( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: bulk <n_accounts> <n_transactions> [n_threads]" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	const auto arg_threads = argc > 2 ? size_t(atol(argv[2])) : size_t(0);
+	if( arg_accounts < 1 ) {
+		cerr << "Error: need at least 1 account" << endl;
+		return 1;
+	}
+
+	vector<std::pair<size_t, snasma::AccountState>> accounts;
+	accounts.reserve(arg_accounts);
+	for( const auto& state : random_accounts(arg_accounts) ) {
+		accounts.emplace_back(accounts.size(), state);
+	}
+
+	vector<snasma::SignedTransaction> stxs;
+	stxs.reserve(arg_transactions);
+	vector<uint32_t> nonces(arg_accounts, 0);
+	for( size_t i = 0; i < arg_transactions; i++ )
+	{
+		const auto from_idx = uint32_t(rand() % arg_accounts);
+		const auto to_idx = uint32_t(rand() % arg_accounts);
+		const snasma::OnchainTransaction tx(from_idx, to_idx, 1);
+		stxs.emplace_back(snasma::Signature(), tx, nonces[from_idx]++);
+	}
+
+	snasma::AccountTree leaf_tree(arg_accounts);
+	snasma::AccountTree bulk_tree(arg_accounts);
+
+	auto start = ClockT::now();
+	for( const auto& it : accounts ) {
+		leaf_tree.update(it.first, it.second);
+	}
+	const auto leaf_accounts_time = seconds_since(start);
+
+	start = ClockT::now();
+	bulk_tree.update_many(accounts, arg_threads);
+	const auto bulk_accounts_time = seconds_since(start);
+
+	cout << "accounts: " << arg_accounts << " per-leaf " << leaf_accounts_time << "s, bulk " << bulk_accounts_time << "s ("
+		 << (leaf_accounts_time / bulk_accounts_time) << "x)" << endl;
+
+	if( leaf_tree.root() != bulk_tree.root() ) {
+		cerr << "Error: roots differ after creating accounts" << endl;
+		return 2;
+	}
+
+	vector<snasma::TxProof> leaf_proofs(stxs.size());
+	start = ClockT::now();
+	for( size_t i = 0; i < stxs.size(); i++ )
+	{
+		if( ! leaf_tree.apply(stxs[i], leaf_proofs[i]) ) {
+			cerr << "Error: transaction " << i << " failed" << endl;
+			return 2;
+		}
+	}
+	const auto leaf_apply_time = seconds_since(start);
+
+	snasma::BulkRecord record;
+	start = ClockT::now();
+	const auto n_applied = bulk_tree.apply_many(stxs, record, arg_threads);
+	const auto bulk_apply_time = seconds_since(start);
+
+	cout << "transactions: " << arg_transactions << " per-leaf " << leaf_apply_time << "s, bulk " << bulk_apply_time << "s ("
+		 << (leaf_apply_time / bulk_apply_time) << "x)" << endl;
+
+	if( n_applied != stxs.size() ) {
+		cerr << "Error: bulk transaction " << n_applied << " failed" << endl;
+		return 2;
+	}
+
+	if( leaf_tree.root() != bulk_tree.root() ) {
+		cerr << "Error: roots differ after applying transactions" << endl;
+		return 2;
+	}
+
+	cout << "final roots identical" << endl;
+
+	vector<snasma::TxProof> bulk_proofs;
+	start = ClockT::now();
+	if( ! bulk_tree.bulk_proofs(record, bulk_proofs) ) {
+		return 2;
+	}
+	const auto proofs_time = seconds_since(start);
+
+	cout << "proofs after bulk: " << bulk_proofs.size() << " in " << proofs_time << "s" << endl;
+
+	for( size_t i = 0; i < stxs.size(); i++ )
+	{
+		const auto& a = leaf_proofs[i];
+		const auto& b = bulk_proofs[i];
+		if( a.merkle_root != b.merkle_root
+		 || a.state_from.nonce != b.state_from.nonce || a.state_from.balance != b.state_from.balance
+		 || a.state_to.nonce != b.state_to.nonce || a.state_to.balance != b.state_to.balance
+		 || a.before_from != b.before_from || a.before_to != b.before_to ) {
+			cerr << "Error: proof of transaction " << i << " differs after bulk" << endl;
+			return 2;
+		}
+	}
+
+	cout << "proofs identical" << endl;
+
+	return 0;
+}
+
+
+/**
+* Random field elements, and each printed as a decimal integer by GMP
+*/
+static void random_decimals( size_t n, vector<FieldT>& values, vector<string>& decimal )
+{
+	for( size_t i = 0; i < n; i++ )
+	{
+		values.emplace_back(FieldT::random_element());
+		std::ostringstream os;
+		os << values.back().as_bigint();
+		decimal.emplace_back(os.str());
+	}
+}
+
+
+/**
+* Compares parsing and printing field elements with `fieldio.hpp` against
+* the GMP conversions, `check-fieldio` verifies their results.
+*/
+int bench_fieldio( int argc, char **argv )
+{
+	const auto arg_n = argc > 0 ? size_t(atol(argv[0])) : size_t(100000);
+
+	vector<FieldT> values;
+	vector<string> decimal;
+	random_decimals(arg_n, values, decimal);
+
+	auto start = ClockT::now();
+	vector<FieldT> gmp_parsed;
+	gmp_parsed.reserve(arg_n);
+	for( const auto& str : decimal ) {
+		gmp_parsed.emplace_back(str.c_str());
+	}
+	const auto gmp_parse_time = seconds_since(start);
+
+	FieldT parsed;
+	size_t n_parsed = 0;
+	start = ClockT::now();
+	for( const auto& str : decimal ) {
+		n_parsed += snasma::parse_field_dec(str.c_str(), str.size(), parsed) ? 1 : 0;
+	}
+	const auto dec_parse_time = seconds_since(start);
+
+	size_t gmp_bytes = 0;
+	start = ClockT::now();
+	for( const auto& x : values )
+	{
+		std::ostringstream os;
+		os << x.as_bigint();
+		gmp_bytes += os.str().size();
+	}
+	const auto gmp_print_time = seconds_since(start);
+
+	char buf[snasma::FIELD_TEXT_MAX];
+	size_t dec_bytes = 0;
+	start = ClockT::now();
+	for( const auto& x : values ) {
+		dec_bytes += snasma::format_field_dec(buf, x);
+	}
+	const auto dec_print_time = seconds_since(start);
+
+	size_t n_hex = 0;
+	start = ClockT::now();
+	for( const auto& x : values ) {
+		n_hex += snasma::parse_field_hex(buf, snasma::format_field_hex(buf, x), parsed) ? 1 : 0;
+	}
+	const auto hex_time = seconds_since(start);
+
+	if( n_parsed != arg_n || n_hex != arg_n ) {
+		cerr << "Error: conversions failed, run check-fieldio" << endl;
+		return 2;
+	}
+
+	const auto n = double(arg_n);
+	cout << "gmp parse: " << (n / gmp_parse_time) << " elements/sec" << endl;
+	cout << "decimal parse: " << (n / dec_parse_time) << " elements/sec (" << (gmp_parse_time / dec_parse_time) << "x)" << endl;
+	cout << "gmp print: " << (n / gmp_print_time) << " elements/sec, " << (gmp_bytes / arg_n) << " bytes each" << endl;
+	cout << "decimal print: " << (n / dec_print_time) << " elements/sec (" << (gmp_print_time / dec_print_time) << "x), " << (dec_bytes / arg_n) << " bytes each" << endl;
+	cout << "hex print and parse: " << (n / hex_time) << " elements/sec" << endl;
+
+	return 0;
+}
+
+
+/**
+* Checks the `fieldio.hpp` conversions: both ends of the range, rejecting
+* the modulus, and that `n` random elements parse and print the same as
+* GMP and round-trip through hexadecimal.
+*/
+int check_fieldio( int argc, char **argv )
+{
+	const auto arg_n = argc > 0 ? size_t(atol(argv[0])) : size_t(10000);
+
+	// Both ends of the range, and the modulus itself which must be rejected
+	FieldT parsed;
+	const auto max = FieldT::zero() - FieldT::one();
+	std::ostringstream max_os, mod_os;
+	max_os << max.as_bigint();
+	mod_os << FieldT::mod;
+	const auto max_str = max_os.str();
+	const auto mod_str = mod_os.str();
+	if( ! snasma::parse_field_dec("0", 1, parsed) || parsed != FieldT::zero()
+	 || ! snasma::parse_field_dec(max_str.c_str(), max_str.size(), parsed) || parsed != max
+	 || snasma::parse_field_dec(mod_str.c_str(), mod_str.size(), parsed) ) {
+		cerr << "Error: boundary values not handled" << endl;
+		return 2;
+	}
+
+	vector<FieldT> values;
+	vector<string> decimal;
+	random_decimals(arg_n, values, decimal);
+
+	char buf[snasma::FIELD_TEXT_MAX];
+	for( size_t i = 0; i < arg_n; i++ )
+	{
+		if( ! snasma::parse_field_dec(decimal[i].c_str(), decimal[i].size(), parsed) || parsed != values[i] || FieldT(decimal[i].c_str()) != values[i] ) {
+			cerr << "Error: decimal " << i << " parsed incorrectly" << endl;
+			return 2;
+		}
+
+		auto length = snasma::format_field_dec(buf, values[i]);
+		if( decimal[i].compare(0, string::npos, buf, length) != 0 ) {
+			cerr << "Error: decimal " << i << " printed incorrectly" << endl;
+			return 2;
+		}
+
+		length = snasma::format_field_hex(buf, values[i]);
+		if( ! snasma::parse_field_hex(buf, length, parsed) || parsed != values[i] ) {
+			cerr << "Error: hex " << i << " doesn't round-trip" << endl;
+			return 2;
+		}
+	}
+
+	cout << "fieldio: " << arg_n << " elements round-trip" << endl;
+
+	return 0;
+}
+
+
+/**
+* Converts a text transactions file to the binary format, then compares
+* the time taken to parse the text against decoding the memory mapped file.
+*/
+int bench_format( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: format <transactions.txt> <out.bin> [rounds]" << endl;
+		return 1;
+	}
+
+	const auto arg_rounds = argc > 2 ? size_t(atol(argv[2])) : size_t(10);
+
+	std::ifstream infile(argv[0]);
+	if( ! infile.is_open() ) {
+		cerr << "Error: cannot open input file - " << argv[0] << endl;
+		return 2;
+	}
+
+	vector<string> lines;
+	string line;
+	while( std::getline(infile, line) )
+	{
+		if( ! line.empty() && line[0] != '#' ) {
+			lines.emplace_back(line);
+		}
+	}
+
+	vector<snasma::TxProof> items(lines.size());
+	size_t text_bytes = 0;
+	auto start = ClockT::now();
+	for( size_t r = 0; r < arg_rounds; r++ )
+	{
+		for( size_t i = 0; i < lines.size(); i++ )
+		{
+			snasma::TxProof item;
+			if( ! (std::istringstream(lines[i]) >> item) || ! item.is_valid() ) {
+				cerr << "Error: cannot parse line " << i << endl;
+				return 2;
+			}
+			items[i] = item;
+			text_bytes += lines[i].size() + 1;
+		}
+	}
+	const auto text_time = seconds_since(start);
+
+	{
+		std::ofstream outfile(argv[1], std::ios::binary);
+		if( ! snasma::write_txfile(outfile, items) ) {
+			cerr << "Error: cannot write output file - " << argv[1] << endl;
+			return 2;
+		}
+	}
+
+	snasma::MappedTxFile txfile;
+	if( ! txfile.open(argv[1]) ) {
+		return 2;
+	}
+
+	snasma::TxProof item;
+	start = ClockT::now();
+	for( size_t r = 0; r < arg_rounds; r++ )
+	{
+		for( size_t i = 0; i < txfile.size(); i++ )
+		{
+			if( ! txfile.decode(i, item) || item.merkle_root != items[i].merkle_root || item.before_to != items[i].before_to ) {
+				cerr << "Error: record " << i << " doesn't match the text" << endl;
+				return 2;
+			}
+		}
+	}
+	const auto binary_time = seconds_since(start);
+
+	const auto n = double(lines.size() * arg_rounds);
+	cout << "text: " << (text_bytes / arg_rounds) << " bytes, " << (n / text_time) << " tx/sec" << endl;
+	cout << "binary: " << txfile.m_length << " bytes, " << (n / binary_time) << " tx/sec" << endl;
+
+	return 0;
+}
+
+
+/**
+* Proofs of `n_transactions` random transfers between `n_accounts` accounts
+*/
+static bool random_proofs( size_t n_accounts, size_t n_transactions, vector<snasma::TxProof>& items )
+{
+	snasma::AccountTree tree(n_accounts);
+	append_accounts(tree, random_accounts(n_accounts));
+
+	items.resize(n_transactions);
+	for( size_t i = 0; i < n_transactions; i++ )
+	{
+		const auto from_idx = uint32_t(rand() % n_accounts);
+		const auto to_idx = uint32_t(rand() % n_accounts);
+		const snasma::OnchainTransaction tx(from_idx, to_idx, 1);
+		const snasma::SignedTransaction stx(snasma::Signature(), tx, tree.account(from_idx).nonce);
+
+		if( ! tree.apply(stx, items[i]) ) {
+			cerr << "Error: transaction " << i << " failed" << endl;
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/**
+* Applies random transactions to a tree, then compares the size and decode
+* rate of the batch as text, as the binary format and as a compact batch,
+* `check-compact` verifies the decoded transactions.
+*
+* With few accounts the paths overlap more, and the compact batch is smaller.
+*/
+int bench_compact( int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: compact <n_accounts> <n_transactions> <out.batch>" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	if( arg_accounts < 1 || arg_transactions < 1 ) {
+		cerr << "Error: need at least 1 account and 1 transaction" << endl;
+		return 1;
+	}
+
+	vector<snasma::TxProof> items;
+	if( ! random_proofs(arg_accounts, arg_transactions, items) ) {
+		return 2;
+	}
+
+	vector<string> lines;
+	size_t text_bytes = 0;
+	for( const auto& item : items )
+	{
+		std::ostringstream os;
+		os << item;
+		lines.emplace_back(os.str());
+		text_bytes += lines.back().size() + 1;
+	}
+
+	auto start = ClockT::now();
+	snasma::TxProof item;
+	for( const auto& line : lines )
+	{
+		if( ! (std::istringstream(line) >> item) ) {
+			cerr << "Error: cannot parse text" << endl;
+			return 2;
+		}
+	}
+	const auto text_time = seconds_since(start);
+
+	{
+		std::ofstream outfile(argv[2], std::ios::binary);
+		if( ! snasma::write_compact_batch(outfile, items) ) {
+			cerr << "Error: cannot write output file - " << argv[2] << endl;
+			return 2;
+		}
+	}
+
+	start = ClockT::now();
+	snasma::MappedCompactBatch batch;
+	if( ! batch.open(argv[2]) ) {
+		return 2;
+	}
+
+	for( size_t i = 0; i < batch.size(); i++ )
+	{
+		if( ! batch.decode_next(item) ) {
+			cerr << "Error: cannot decode compact record " << i << endl;
+			return 2;
+		}
+	}
+	const auto compact_time = seconds_since(start);
+
+	const auto binary_bytes = snasma::TXFILE_HEADER_SIZE + (items.size() * snasma::TXFILE_RECORD_SIZE);
+	const auto n = double(items.size());
+	const auto records_bytes = batch.m_length - size_t(batch.m_records - batch.m_data);
+	cout << "text: " << text_bytes << " bytes (" << (text_bytes / n) << " per tx), " << (n / text_time) << " tx/sec" << endl;
+	cout << "binary: " << binary_bytes << " bytes (" << (binary_bytes / n) << " per tx)" << endl;
+	cout << "compact: " << batch.m_length << " bytes (" << (batch.m_length / n) << " per tx), "
+		 << batch.m_nodes.size() << " distinct nodes, records " << (records_bytes / n) << " bytes per tx, "
+		 << (n / compact_time) << " tx/sec" << endl;
+	cout << "compact is " << (double(text_bytes) / batch.m_length) << "x smaller than text, "
+		 << (text_time / compact_time) << "x faster to decode" << endl;
+
+	return 0;
+}
+
+
+/**
+* Writes random transactions as a compact batch, every transaction decoded
+* from it must match the original.
+*/
+int check_compact( int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: check-compact <n_accounts> <n_transactions> <out.batch>" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	if( arg_accounts < 1 || arg_transactions < 1 ) {
+		cerr << "Error: need at least 1 account and 1 transaction" << endl;
+		return 1;
+	}
+
+	vector<snasma::TxProof> items;
+	if( ! random_proofs(arg_accounts, arg_transactions, items) ) {
+		return 2;
+	}
+
+	{
+		std::ofstream outfile(argv[2], std::ios::binary);
+		if( ! snasma::write_compact_batch(outfile, items) ) {
+			cerr << "Error: cannot write output file - " << argv[2] << endl;
+			return 2;
+		}
+	}
+
+	snasma::MappedCompactBatch batch;
+	if( ! batch.open(argv[2]) ) {
+		return 2;
+	}
+
+	if( batch.size() != items.size() ) {
+		cerr << "Error: compact batch has " << batch.size() << " transactions, expected " << items.size() << endl;
+		return 2;
+	}
+
+	snasma::TxProof item;
+	for( size_t i = 0; i < batch.size(); i++ )
+	{
+		if( ! batch.decode_next(item) ) {
+			cerr << "Error: cannot decode compact record " << i << endl;
+			return 2;
+		}
+
+		const auto& expected = items[i];
+		if( item.merkle_root != expected.merkle_root
+		 || item.before_from != expected.before_from
+		 || item.before_to != expected.before_to
+		 || ! snasma::account_state_equal(item.state_from, expected.state_from)
+		 || ! snasma::account_state_equal(item.state_to, expected.state_to)
+		 || item.stx.nonce != expected.stx.nonce
+		 || item.stx.tx.to_idx != expected.stx.tx.to_idx
+		 || item.stx.sig.s != expected.stx.sig.s ) {
+			cerr << "Error: compact record " << i << " doesn't match" << endl;
+			return 2;
+		}
+	}
+
+	cout << "compact: " << batch.size() << " transactions decoded identically" << endl;
+
+	return 0;
+}
+
+
+/**
+* Creates a chain of `n` transaction circuits, as `setup_circuits` does
+*/
+template<typename CircuitT>
+static void setup_chain( ProtoboardT& pb, const jubjub::Params& params, vector<CircuitT>& tx_gadgets, size_t n, bool reserve = true )
+{
+	const VariableT merkle_root = make_variable(pb, "merkle_root");
+	const auto IVs = snasma::shared_merkle_tree_IVs(pb, "IVs");
+
+	if( reserve ) {
+		tx_gadgets.reserve(n);
+	}
+	for( size_t i = 0; i < n; i++ )
+	{
+		const auto root = i ? tx_gadgets.back().result() : merkle_root;
+		tx_gadgets.emplace_back(pb, params, IVs, root, FMT("tx", "[%zu]", i));
+		tx_gadgets.back().generate_r1cs_constraints();
+	}
+}
+
+
+/**
+* Compares the size of `n` transactions with their own signatures against
+* `n / k` groups of `k` transactions with one signature each, then applies
+* the same transactions to both and checks their final roots match the tree.
+*
+* Each group is from one random sender, the last group is made of no-ops.
+* Every account has a secret key, each transaction and group is signed, and
+* both circuits must be satisfied. The first group is then given an invalid
+* signature, and one by the wrong key, each of which must be rejected by the
+* circuit and by `preflight_groups`.
+*
+* The groups, except the no-ops, are written to `groups.txt` if given, for
+* `snasmad check-group`.
+*/
+int bench_group( int argc, char **argv )
+{
+	if( argc < 1 ) {
+		cerr << "Usage: group <k> [n_groups] [groups.txt]" << endl;
+		return 1;
+	}
+
+	const auto arg_k = size_t(atol(argv[0]));
+	const auto arg_groups = argc > 1 ? size_t(atol(argv[1])) : size_t(4);
+	if( arg_k < 1 || arg_groups < 2 ) {
+		cerr << "Error: need at least 1 transaction per group and 2 groups" << endl;
+		return 1;
+	}
+
+	if( arg_k > snasma::MAX_GROUP_SIZE ) {
+		cerr << "Error: at most " << snasma::MAX_GROUP_SIZE << " transactions per group" << endl;
+		return 1;
+	}
+
+	const auto n = arg_k * arg_groups;
+	const size_t n_accounts = 100;
+	const jubjub::Params params;
+	snasma::BatchVerifier verifier(params);
+
+	ProtoboardT pb;
+	vector<snasma::TxCircuit> tx_gadgets;
+	setup_chain(pb, params, tx_gadgets, n);
+
+	ProtoboardT group_pb;
+	vector<snasma::TxGroupCircuit> group_gadgets;
+	const VariableT merkle_root = make_variable(group_pb, "merkle_root");
+	const auto IVs = snasma::shared_merkle_tree_IVs(group_pb, "IVs");
+	group_gadgets.reserve(arg_groups);
+	for( size_t i = 0; i < arg_groups; i++ )
+	{
+		const auto root = i ? group_gadgets.back().result() : merkle_root;
+		group_gadgets.emplace_back(group_pb, params, IVs, root, arg_k, FMT("group", "[%zu]", i));
+		group_gadgets.back().generate_r1cs_constraints();
+	}
+
+	cout << "single: " << pb.num_constraints() << " constraints (" << (pb.num_constraints() / n) << " avg/tx)" << endl;
+	cout << "group of " << arg_k << ": " << group_pb.num_constraints() << " constraints (" << (group_pb.num_constraints() / n) << " avg/tx)" << endl;
+
+	snasma::AccountTree tree(n_accounts);
+	vector<FieldT> secrets;
+	append_accounts(tree, keyed_accounts(n_accounts, params, secrets));
+
+	vector<snasma::TxGroupProof> groups(arg_groups);
+	vector<uint32_t> senders;
+	for( size_t g = 0; g < arg_groups - 1; g++ )
+	{
+		const auto from_idx = uint32_t(rand() % n_accounts);
+		senders.emplace_back(from_idx);
+
+		vector<snasma::OnchainTransaction> txs;
+		for( size_t i = 0; i < arg_k; i++ ) {
+			txs.emplace_back(from_idx, uint32_t(rand() % n_accounts), 1);
+		}
+		const snasma::SignedTransactionGroup group(snasma::Signature(), txs, tree.account(from_idx).nonce);
+
+		auto& record = groups[g];
+		record.txs.resize(arg_k);
+		for( size_t i = 0; i < arg_k; i++ )
+		{
+			auto stx = group.transaction(i);
+			const auto msg = stx.message();
+			stx.sig = snasma::eddsa_sign(verifier.challenge(msg.size()), params, secrets[from_idx], msg);
+
+			if( ! tree.apply(stx, record.txs[i]) ) {
+				cerr << "Error: transaction " << i << " of group " << g << " failed" << endl;
+				return 2;
+			}
+			tx_gadgets[(g * arg_k) + i].generate_r1cs_witness(record.txs[i]);
+		}
+
+		const auto msg = record.message();
+		record.sig = snasma::eddsa_sign(verifier.challenge(msg.size()), params, secrets[from_idx], msg);
+		group_gadgets[g].generate_r1cs_witness(record.txs, record.sig);
+	}
+
+	auto& noops = groups.back();
+	noops.txs.resize(arg_k);
+	for( size_t i = 0; i < arg_k; i++ )
+	{
+		noops.txs[i] = snasma::make_noop(i ? noops.txs[i - 1] : groups[arg_groups - 2].txs.back(), tree.m_hasher, params);
+		tx_gadgets[((arg_groups - 1) * arg_k) + i].generate_r1cs_witness(noops.txs[i]);
+	}
+	noops.sig = noops.txs[0].stx.sig;
+	group_gadgets.back().generate_r1cs_witness(noops.txs, noops.sig);
+
+	for( size_t g = 0; g < arg_groups; g++ )
+	{
+		if( pb.val(tx_gadgets[((g + 1) * arg_k) - 1].result()) != group_pb.val(group_gadgets[g].result()) ) {
+			cerr << "Error: roots differ after group " << g << endl;
+			return 2;
+		}
+	}
+
+	if( group_pb.val(group_gadgets.back().result()) != tree.root() ) {
+		cerr << "Error: final root doesn't match the tree" << endl;
+		return 2;
+	}
+
+	size_t bad_group, bad_index;
+	if( ! pb.is_satisfied() || ! group_pb.is_satisfied()
+	 || snasma::preflight_groups(verifier, groups, bad_group, bad_index) != snasma::PREFLIGHT_OK ) {
+		cerr << "Error: signed groups not valid" << endl;
+		return 2;
+	}
+
+	cout << "final roots identical, both circuits satisfied" << endl;
+
+	// Neither a corrupted signature nor one by another key may be accepted
+	auto& first = groups[0];
+	const auto valid_sig = first.sig;
+	const auto msg = first.message();
+	const auto other_key = secrets[(senders[0] + 1) % n_accounts];
+	for( const auto& sig : {snasma::Signature(valid_sig.R, valid_sig.s + FieldT::one()),
+							snasma::eddsa_sign(verifier.challenge(msg.size()), params, other_key, msg)} )
+	{
+		first.sig = sig;
+		group_gadgets[0].generate_r1cs_witness(first.txs, first.sig);
+		if( group_pb.is_satisfied()
+		 || snasma::preflight_groups(verifier, groups, bad_group, bad_index) != snasma::PREFLIGHT_SIGNATURE
+		 || bad_group != 0 ) {
+			cerr << "Error: invalid group signature accepted" << endl;
+			return 2;
+		}
+	}
+
+	first.sig = valid_sig;
+	group_gadgets[0].generate_r1cs_witness(first.txs, first.sig);
+	if( ! group_pb.is_satisfied() ) {
+		cerr << "Error: group not satisfied after restoring its signature" << endl;
+		return 2;
+	}
+
+	cout << "invalid group signatures rejected" << endl;
+
+	if( argc > 2 )
+	{
+		std::ofstream out(argv[2]);
+		for( size_t g = 0; g < arg_groups - 1; g++ ) {
+			out << groups[g] << endl;
+		}
+		out.close();
+		if( ! out ) {
+			cerr << "Error: failed to write " << argv[2] << endl;
+			return 2;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+* Measures the time and peak memory to setup the circuit for each `n`, with
+* the gadget vector reserved up-front and grown by `emplace_back` alone.
+*
+* Each measurement is made in a separate process, so peak RSS isn't carried
+* over. To compare allocators run this with each build, see `ALLOCATOR` in
+* CMakeLists.txt.
+*/
+int bench_setup( int argc, char **argv )
+{
+	if( argc < 1 ) {
+		cerr << "Usage: setup <n> [n ...]" << endl;
+		return 1;
+	}
+
+	for( int i = 0; i < argc; i++ )
+	{
+		const auto n = size_t(atol(argv[i]));
+		if( n < 1 ) {
+			cerr << "Error: n must be at least 1" << endl;
+			return 1;
+		}
+
+		for( const auto reserve : {false, true} )
+		{
+			cout.flush();
+			const auto pid = fork();
+			if( pid < 0 ) {
+				cerr << "Error: cannot fork - " << strerror(errno) << endl;
+				return 2;
+			}
+
+			if( pid == 0 )
+			{
+				const jubjub::Params params;
+				const auto start = ClockT::now();
+				ProtoboardT pb;
+				vector<snasma::TxCircuit> tx_gadgets;
+				setup_chain(pb, params, tx_gadgets, n, reserve);
+				const auto setup_time = seconds_since(start);
+
+				struct rusage usage;
+				getrusage(RUSAGE_SELF, &usage);
+
+				cout << "n=" << n << (reserve ? " reserve" : " grow") << ": "
+					 << pb.num_constraints() << " constraints"
+					 << ", setup " << setup_time << "s"
+					 << ", peak RSS " << (usage.ru_maxrss / 1024) << "MB" << endl;
+				cout.flush();
+				_exit(0);
+			}
+
+			int status;
+			if( waitpid(pid, &status, 0) < 0 || ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+				cerr << "Error: setup failed for n=" << n << endl;
+				return 2;
+			}
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+* Measures native signature verification of the transactions in a file,
+* as a batch against one by one, then corrupts a signature in the middle
+* and measures how long it takes to find it.
+*/
+int bench_sigs( int argc, char **argv )
+{
+	if( argc < 1 ) {
+		cerr << "Usage: sigs <transactions.txt>" << endl;
+		return 1;
+	}
+
+	std::ifstream infile(argv[0]);
+	if( ! infile.is_open() ) {
+		cerr << "Error: cannot open input file - " << argv[0] << endl;
+		return 2;
+	}
+
+	vector<snasma::TxProof> items;
+	string line;
+	while( std::getline(infile, line) )
+	{
+		snasma::TxProof item;
+		if( ! line.empty() && line[0] != '#' && (std::istringstream(line) >> item) ) {
+			items.emplace_back(item);
+		}
+	}
+
+	if( items.empty() ) {
+		cerr << "Error: no transactions" << endl;
+		return 2;
+	}
+
+	const jubjub::Params params;
+	snasma::BatchVerifier verifier(params);
+
+	auto start = ClockT::now();
+	for( const auto& item : items ) {
+		verifier.add(item);
+	}
+	const auto hash_time = seconds_since(start);
+
+	size_t bad_index;
+	start = ClockT::now();
+	const auto batch_ok = verifier.verify(bad_index);
+	const auto batch_time = seconds_since(start);
+
+	start = ClockT::now();
+	bool single_ok = true;
+	for( size_t i = 0; i < verifier.size(); i++ ) {
+		single_ok = verifier.verify_one(i) && single_ok;
+	}
+	const auto single_time = seconds_since(start);
+
+	if( ! batch_ok || ! single_ok ) {
+		cerr << "Error: signatures not valid" << endl;
+		return 2;
+	}
+
+	const auto bad = items.size() / 2;
+	verifier.m_entries[bad].s += FieldT::one();
+	start = ClockT::now();
+	const auto found = ! verifier.verify(bad_index) && bad_index == bad;
+	const auto find_time = seconds_since(start);
+
+	cout << "hash: " << items.size() << " signatures in " << (hash_time * 1000) << "ms" << endl;
+	cout << "batch: " << (batch_time * 1000) << "ms" << endl;
+	cout << "single: " << (single_time * 1000) << "ms" << endl;
+	cout << "find invalid: " << (find_time * 1000) << "ms" << (found ? "" : " (NOT FOUND)") << endl;
+
+	return found ? 0 : 2;
+}
+
+
+/**
+* Compares multiplying the EdDSA base point with double-and-add against the
+* precomputed window table, for random scalars.
+*/
+int bench_fixedbase( int argc, char **argv )
+{
+	const auto arg_n = argc > 0 ? size_t(atol(argv[0])) : size_t(1000);
+
+	const jubjub::Params params;
+	const snasma::ExtendedPoint base(jubjub::EdwardsPoint(params.Gx, params.Gy));
+
+	auto start = ClockT::now();
+	const auto& table = snasma::eddsa_base_table(params);
+	const auto table_time = seconds_since(start);
+
+	vector<FieldT> scalars;
+	for( size_t i = 0; i < arg_n; i++ ) {
+		scalars.emplace_back(FieldT::random_element());
+	}
+
+	vector<snasma::ExtendedPoint> expected;
+	start = ClockT::now();
+	for( const auto& k : scalars ) {
+		expected.emplace_back(snasma::scalar_mul(base, k.as_bigint(), params));
+	}
+	const auto double_add_time = seconds_since(start);
+
+	vector<snasma::ExtendedPoint> results;
+	start = ClockT::now();
+	for( const auto& k : scalars ) {
+		results.emplace_back(table.mul(k.as_bigint(), params));
+	}
+	const auto fixed_time = seconds_since(start);
+
+	for( size_t i = 0; i < arg_n; i++ )
+	{
+		if( ! (results[i] == expected[i]) ) {
+			cerr << "Error: results differ for scalar " << i << endl;
+			return 2;
+		}
+	}
+
+	cout << "table: " << table.m_table.size() << " points in " << (table_time * 1000) << "ms" << endl;
+	cout << "double-and-add: " << arg_n << " in " << (double_add_time * 1000) << "ms" << endl;
+	cout << "fixed-base: " << arg_n << " in " << (fixed_time * 1000) << "ms ("
+		 << (double_add_time / fixed_time) << "x)" << endl;
+
+	return 0;
+}
+
+
+/**
+* Random signed transactions between `n_accounts` keyed accounts, appended
+* to `tree`, with duplicates, conflicting transactions for the same nonce,
+* nonce gaps and forgeries (the next nonce of a sender, signed by another
+* key) mixed in. Every forgery is submitted before the real transaction.
+*
+* @return Number of forgeries
+*/
+static size_t mempool_submissions( const jubjub::Params& params, snasma::AccountTree& tree, size_t n_accounts, size_t n_transactions, vector<snasma::SignedTransaction>& submissions )
+{
+	snasma::BatchVerifier signer(params);
+	auto& challenge = signer.challenge((3 * snasma::TREE_DEPTH) + snasma::AMOUNT_BITS);
+
+	vector<FieldT> secrets;
+	append_accounts(tree, keyed_accounts(n_accounts, params, secrets));
+
+	const auto sign = [&]( uint32_t from_idx, uint32_t to_idx, uint32_t amount, uint32_t nonce, const FieldT& secret ) {
+		snasma::SignedTransaction stx(snasma::Signature(), snasma::OnchainTransaction(from_idx, to_idx, amount), nonce);
+		stx.sig = snasma::eddsa_sign(challenge, params, secret, stx.message());
+		return stx;
+	};
+
+	submissions.reserve(n_transactions + (n_transactions / 4));
+	vector<size_t> genuine;
+	vector<uint32_t> nonces(n_accounts, 0);
+	size_t n_forged = 0;
+	for( size_t i = 0; i < n_transactions; i++ )
+	{
+		const auto from_idx = uint32_t(rand() % n_accounts);
+		const auto to_idx = uint32_t(rand() % n_accounts);
+
+		if( i % 64 == 0 ) {
+			submissions.emplace_back(sign(from_idx, to_idx, 1, nonces[from_idx], secrets[(from_idx + 1) % n_accounts]));
+			n_forged++;
+		}
+
+		genuine.emplace_back(submissions.size());
+		submissions.emplace_back(sign(from_idx, to_idx, 1, nonces[from_idx], secrets[from_idx]));
+		nonces[from_idx]++;
+
+		auto previous = submissions[genuine[rand() % genuine.size()]];
+		if( i % 8 == 0 ) {
+			submissions.emplace_back(previous);
+		}
+		if( i % 16 == 0 ) {
+			previous.tx.amount += 1;
+			submissions.emplace_back(previous);
+		}
+		if( i % 32 == 0 ) {
+			submissions.emplace_back(sign(from_idx, to_idx, 1, nonces[from_idx] + 5, secrets[from_idx]));
+		}
+	}
+
+	return n_forged;
+}
+
+
+/**
+* Submit one at a time with `submit`, counting each status
+*/
+static void submit_each( snasma::Mempool& mempool, const vector<snasma::SignedTransaction>& submissions, vector<size_t>& counts )
+{
+	for( const auto& stx : submissions ) {
+		counts[mempool.submit(stx)]++;
+	}
+}
+
+
+/**
+* Submit in chunks of `chunk_size` with `submit_many`, counting each status
+*/
+static void submit_chunks( snasma::Mempool& mempool, const vector<snasma::SignedTransaction>& submissions, size_t chunk_size, vector<size_t>& counts )
+{
+	vector<snasma::SignedTransaction> chunk;
+	vector<snasma::MempoolStatus> statuses;
+	for( size_t begin = 0; begin < submissions.size(); begin += chunk_size )
+	{
+		chunk.assign(submissions.begin() + begin, submissions.begin() + std::min(begin + chunk_size, submissions.size()));
+		mempool.submit_many(chunk, statuses);
+		for( const auto status : statuses ) {
+			counts[status]++;
+		}
+	}
+}
+
+
+/**
+* Schedules every transaction in the mempool into batches of the ladder
+*
+* @return Number of transactions scheduled, excluding padding
+*/
+static size_t schedule_all( snasma::Mempool& mempool, const snasma::CircuitLadder& ladder, const jubjub::Params& params, size_t& n_batches )
+{
+	vector<snasma::TxProof> batch;
+	size_t n_scheduled = 0;
+	while( mempool.next_batch(ladder, params, batch) != ladder.size() )
+	{
+		n_batches++;
+		for( const auto& item : batch ) {
+			n_scheduled += item.is_noop ? 0 : 1;
+		}
+	}
+	return n_scheduled;
+}
+
+
+/**
+* Submits the transactions of `mempool_submissions` one at a time, with
+* `submit`, then in chunks of 1024 with `submit_many`, into two mempools
+* over the same tree, then schedules the second into batches of `n`, which
+* applies each transaction to the tree, so it is measured separately.
+* `check-mempool` verifies the accounting.
+*/
+int bench_mempool( int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: mempool <n_accounts> <n_transactions> <n>" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	const auto arg_n = size_t(atol(argv[2]));
+	if( arg_accounts < 2 || arg_transactions < 1 || arg_n < 1 ) {
+		cerr << "Error: need at least 2 accounts, 1 transaction and n of 1" << endl;
+		return 1;
+	}
+
+	const jubjub::Params params;
+	snasma::AccountTree tree(arg_accounts);
+	vector<snasma::SignedTransaction> submissions;
+	mempool_submissions(params, tree, arg_accounts, arg_transactions, submissions);
+
+	snasma::Mempool single_mempool(tree, params, submissions.size());
+	vector<size_t> single_counts(snasma::MEMPOOL_FULL + 1, 0);
+	auto start = ClockT::now();
+	submit_each(single_mempool, submissions, single_counts);
+	const auto single_time = seconds_since(start);
+
+	snasma::Mempool mempool(tree, params, submissions.size());
+	vector<size_t> counts(snasma::MEMPOOL_FULL + 1, 0);
+	start = ClockT::now();
+	submit_chunks(mempool, submissions, 1024, counts);
+	const auto submit_time = seconds_since(start);
+
+	cout << "submit: " << submissions.size() << " transactions in " << single_time << "s ("
+		 << (submissions.size() / single_time) << " tx/sec)" << endl;
+	cout << "submit_many: " << submissions.size() << " transactions in " << submit_time << "s ("
+		 << (submissions.size() / submit_time) << " tx/sec)" << endl;
+	for( size_t i = 0; i < counts.size(); i++ )
+	{
+		if( counts[i] || single_counts[i] ) {
+			cout << "\t" << snasma::mempool_status_string(snasma::MempoolStatus(i)) << ": " << single_counts[i] << ", " << counts[i] << endl;
+		}
+	}
+
+	const snasma::CircuitLadder ladder(vector<size_t>{arg_n});
+	size_t n_batches = 0;
+	start = ClockT::now();
+	const auto n_scheduled = schedule_all(mempool, ladder, params, n_batches);
+	const auto schedule_time = seconds_since(start);
+
+	cout << "schedule: " << n_scheduled << " transactions in " << n_batches << " batches, " << schedule_time << "s ("
+		 << (n_scheduled / schedule_time) << " tx/sec)" << endl;
+
+	return 0;
+}
+
+
+/**
+* Submits the transactions of `mempool_submissions` as `mempool` does. Both
+* mempools must accept every genuine transaction and reject every forgery,
+* then all must be scheduled into batches of `n`.
+*/
+int check_mempool( int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: check-mempool <n_accounts> <n_transactions> <n>" << endl;
+		return 1;
+	}
+
+	const auto arg_accounts = size_t(atol(argv[0]));
+	const auto arg_transactions = size_t(atol(argv[1]));
+	const auto arg_n = size_t(atol(argv[2]));
+	if( arg_accounts < 2 || arg_transactions < 1 || arg_n < 1 ) {
+		cerr << "Error: need at least 2 accounts, 1 transaction and n of 1" << endl;
+		return 1;
+	}
+
+	const jubjub::Params params;
+	snasma::AccountTree tree(arg_accounts);
+	vector<snasma::SignedTransaction> submissions;
+	const auto n_forged = mempool_submissions(params, tree, arg_accounts, arg_transactions, submissions);
+
+	snasma::Mempool single_mempool(tree, params, submissions.size());
+	vector<size_t> single_counts(snasma::MEMPOOL_FULL + 1, 0);
+	submit_each(single_mempool, submissions, single_counts);
+
+	snasma::Mempool mempool(tree, params, submissions.size());
+	vector<size_t> counts(snasma::MEMPOOL_FULL + 1, 0);
+	submit_chunks(mempool, submissions, 1024, counts);
+
+	// Changing the amount of a copy invalidates its signature, `submit` finds
+	// the conflict before checking it
+	if( single_counts[snasma::MEMPOOL_ACCEPTED] != arg_transactions
+	 || counts[snasma::MEMPOOL_ACCEPTED] != arg_transactions
+	 || single_counts[snasma::MEMPOOL_BAD_SIGNATURE] != n_forged
+	 || counts[snasma::MEMPOOL_BAD_SIGNATURE] != n_forged + single_counts[snasma::MEMPOOL_CONFLICT] ) {
+		cerr << "Error: accepted " << single_counts[snasma::MEMPOOL_ACCEPTED] << " and " << counts[snasma::MEMPOOL_ACCEPTED]
+			 << " transactions, expected " << arg_transactions << ", with all " << n_forged << " forgeries rejected" << endl;
+		return 2;
+	}
+
+	const snasma::CircuitLadder ladder(vector<size_t>{arg_n});
+	size_t n_batches = 0;
+	const auto n_scheduled = schedule_all(mempool, ladder, params, n_batches);
+	if( n_scheduled != arg_transactions || mempool.size() != 0 ) {
+		cerr << "Error: scheduled " << n_scheduled << " of " << arg_transactions << " transactions" << endl;
+		return 2;
+	}
+
+	cout << "mempool: " << arg_transactions << " accepted, " << n_forged << " forgeries rejected, "
+		 << n_scheduled << " scheduled in " << n_batches << " batches" << endl;
+
+	return 0;
+}
+
+
+/**
+* Builds a persistent store in an empty directory, applying transactions in
+* batches of 100 with a commit after each and a snapshot half way, then 50
+* more transactions which are left uncommitted.
+*
+* @param committed_root Root of the last commit
+*/
+static bool fill_store( snasma::PersistentAccountStore& store, const string& dir, size_t n_accounts, size_t n_transactions, FieldT& committed_root )
+{
+	if( mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST ) {
+		cerr << "Error: cannot create directory " << dir << endl;
+		return false;
+	}
+
+	if( ! store.open(dir) ) {
+		return false;
+	}
+
+	if( store.m_tree.size() != 0 ) {
+		cerr << "Error: directory isn't empty - " << dir << endl;
+		return false;
+	}
+
+	append_accounts(store, random_accounts(n_accounts));
+
+	if( ! store.commit() || ! store.snapshot() ) {
+		return false;
+	}
+	committed_root = store.root();
+
+	const size_t batch_size = 100;
+	snasma::TxProof proof;
+	for( size_t i = 0; i < n_transactions + (batch_size / 2); i++ )
+	{
+		const auto from_idx = uint32_t(rand() % n_accounts);
+		const auto to_idx = uint32_t(rand() % n_accounts);
+		const snasma::OnchainTransaction tx(from_idx, to_idx, 1);
+		const snasma::SignedTransaction stx(snasma::Signature(), tx, store.m_tree.account(from_idx).nonce);
+
+		if( ! store.apply(stx, proof) ) {
+			cerr << "Error: transaction " << i << " failed" << endl;
+			return false;
+		}
+
+		// Transactions after the last full batch are never committed
+		if( i < n_transactions && (i + 1) % batch_size == 0 )
+		{
+			if( ! store.commit() ) {
+				return false;
+			}
+			committed_root = store.root();
+			if( i + 1 == (n_transactions / batch_size / 2) * batch_size && ! store.snapshot() ) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+
+/**
+* Measures building a persistent store with `fill_store`, then re-opening
+* it, which loads the snapshot and replays the log since. `check-store`
+* verifies the recovery.
+*/
+int bench_store( int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: store <dir> <n_accounts> <n_transactions>" << endl;
+		return 1;
+	}
+
+	const string arg_dir(argv[0]);
+	const auto arg_accounts = size_t(atol(argv[1]));
+	const auto arg_transactions = size_t(atol(argv[2]));
+	if( arg_accounts < 1 ) {
+		cerr << "Error: need at least 1 account" << endl;
+		return 1;
+	}
+
+	FieldT committed_root;
+	auto start = ClockT::now();
+	{
+		snasma::PersistentAccountStore store;
+		if( ! fill_store(store, arg_dir, arg_accounts, arg_transactions, committed_root) ) {
+			return 2;
+		}
+	}
+	const auto write_time = seconds_since(start);
+
+	cout << "write: " << arg_accounts << " accounts, " << arg_transactions << " transactions in " << write_time << "s" << endl;
+
+	start = ClockT::now();
+	snasma::PersistentAccountStore recovered;
+	if( ! recovered.open(arg_dir) ) {
+		cerr << "Error: recovery failed" << endl;
+		return 2;
+	}
+	const auto recover_time = seconds_since(start);
+
+	cout << "recover: " << recovered.m_tree.size() << " accounts in " << recover_time << "s" << endl;
+
+	return 0;
+}
+
+
+/**
+* Builds a persistent store with `fill_store`, then makes committing the
+* uncommitted transactions fail part way through writing them, by limiting
+* the file size. The log must be truncated back to the last commit and the
+* store must refuse further changes.
+*
+* A torn record is then left at the end of the log, and the store must
+* recover to the root of the last commit when re-opened.
+*/
+int check_store( int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: check-store <dir> <n_accounts> <n_transactions>" << endl;
+		return 1;
+	}
+
+	const string arg_dir(argv[0]);
+	const auto arg_accounts = size_t(atol(argv[1]));
+	const auto arg_transactions = size_t(atol(argv[2]));
+	if( arg_accounts < 1 ) {
+		cerr << "Error: need at least 1 account" << endl;
+		return 1;
+	}
+
+	FieldT committed_root;
+	size_t committed_accounts = 0;
+	{
+		snasma::PersistentAccountStore store;
+		if( ! fill_store(store, arg_dir, arg_accounts, arg_transactions, committed_root) ) {
+			return 2;
+		}
+
+		committed_accounts = store.m_tree.size();
+
+		struct stat st;
+		if( fstat(store.m_log_fd, &st) != 0 ) {
+			cerr << "Error: cannot stat the log" << endl;
+			return 2;
+		}
+
+		// Room for only some of the records, so the write is partial
+		struct rlimit old_limit, limit;
+		getrlimit(RLIMIT_FSIZE, &old_limit);
+		limit = old_limit;
+		limit.rlim_cur = rlim_t(st.st_size) + (snasma::WAL_RECORD_SIZE * 10) + (snasma::WAL_RECORD_SIZE / 2);
+		const auto old_handler = signal(SIGXFSZ, SIG_IGN);
+		setrlimit(RLIMIT_FSIZE, &limit);
+		const auto commit_ok = store.commit();
+		setrlimit(RLIMIT_FSIZE, &old_limit);
+		signal(SIGXFSZ, old_handler);
+
+		struct stat after;
+		snasma::TxProof unused;
+		if( commit_ok || ! store.failed() || fstat(store.m_log_fd, &after) != 0 || after.st_size != st.st_size ) {
+			cerr << "Error: failed commit not rolled back from the log" << endl;
+			return 2;
+		}
+
+		if( store.apply(snasma::SignedTransaction(snasma::Signature(), snasma::OnchainTransaction(0, 0, 1), store.m_tree.account(0).nonce), unused) || store.commit() ) {
+			cerr << "Error: store accepted changes after a failed commit" << endl;
+			return 2;
+		}
+
+		cout << "failed commit rolled back from the log" << endl;
+	}
+
+	// Half of a record, as if the process died while writing it
+	{
+		std::ofstream log((arg_dir + "/log").c_str(), std::ios::binary | std::ios::app);
+		const vector<char> torn(snasma::WAL_RECORD_SIZE / 2, 'x');
+		log.write(torn.data(), torn.size());
+	}
+
+	snasma::PersistentAccountStore recovered;
+	if( ! recovered.open(arg_dir) ) {
+		cerr << "Error: recovery failed" << endl;
+		return 2;
+	}
+
+	if( recovered.root() != committed_root ) {
+		cerr << "Error: recovered root doesn't match the last commit" << endl;
+		return 2;
+	}
+
+	if( recovered.m_tree.size() != committed_accounts ) {
+		cerr << "Error: recovered " << recovered.m_tree.size() << " accounts, expected " << committed_accounts << endl;
+		return 2;
+	}
+
+	cout << "recovered root identical to the last commit" << endl;
+
+	return 0;
+}
+
+
+int main( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << argv[0] << " <benchmark> [args...]" << endl;
+		cerr << endl;
+		cerr << "Benchmarks:" << endl;
+		cerr << "\ttree <n_accounts> <n_transactions>" << endl;
+		cerr << "\tsparse <n_accounts> <n_transactions>" << endl;
+		cerr << "\tbulk <n_accounts> <n_transactions> [n_threads]" << endl;
+		cerr << "\tfieldio [n]" << endl;
+		cerr << "\tformat <transactions.txt> <out.bin> [rounds]" << endl;
+		cerr << "\tcompact <n_accounts> <n_transactions> <out.batch>" << endl;
+		cerr << "\tgroup <k> [n_groups] [groups.txt]" << endl;
+		cerr << "\tsigs <transactions.txt>" << endl;
+		cerr << "\tfixedbase [n]" << endl;
+		cerr << "\tsetup <n> [n ...]" << endl;
+		cerr << "\tmempool <n_accounts> <n_transactions> <n>" << endl;
+		cerr << "\tstore <dir> <n_accounts> <n_transactions>" << endl;
+		cerr << endl;
+		cerr << "Checks:" << endl;
+		cerr << "\tcheck-sparse <transactions.txt>" << endl;
+		cerr << "\tcheck-fieldio [n]" << endl;
+		cerr << "\tcheck-compact <n_accounts> <n_transactions> <out.batch>" << endl;
+		cerr << "\tcheck-mempool <n_accounts> <n_transactions> <n>" << endl;
+		cerr << "\tcheck-store <dir> <n_accounts> <n_transactions>" << endl;
+		return 1;
+	}
+
+	ppT::init_public_params();
+
+	const string arg_mode(argv[1]);
+	if( arg_mode == "tree" ) {
+		return bench_tree(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "sparse" ) {
+		return bench_sparse(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "bulk" ) {
+		return bench_bulk(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "fieldio" ) {
+		return bench_fieldio(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "format" ) {
+		return bench_format(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "compact" ) {
+		return bench_compact(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "group" ) {
+		return bench_group(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "sigs" ) {
+		return bench_sigs(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "fixedbase" ) {
+		return bench_fixedbase(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "setup" ) {
+		return bench_setup(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "mempool" ) {
+		return bench_mempool(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "store" ) {
+		return bench_store(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-sparse" ) {
+		return check_sparse(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-fieldio" ) {
+		return check_fieldio(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-compact" ) {
+		return check_compact(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-mempool" ) {
+		return check_mempool(argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-store" ) {
+		return check_store(argc - 2, argv + 2);
+	}
+
+	cerr << "Error: unknown benchmark - " << arg_mode << endl;
+	return 1;
+}
@@ -18,6 +18,56 @@ using namespace ethsnarks;
 using jubjub::VariablePointT;
 
 
+/**
+* Sub-gadgets of a transaction circuit, see `TxCircuitHook`
+*/
+enum TxStep
+{
+    TX_STEP_AMOUNT = 0,
+    TX_STEP_SIG_NONCE,
+    TX_STEP_SIG,
+    TX_STEP_BALANCE,
+    TX_STEP_LEAF_BEFORE_FROM,
+    TX_STEP_LEAF_AFTER_FROM,
+    TX_STEP_LEAF_BEFORE_TO,
+    TX_STEP_LEAF_AFTER_TO,
+    TX_STEP_PATH_BEFORE_FROM,
+    TX_STEP_PATH_AFTER_FROM,
+    TX_STEP_PATH_BEFORE_TO,
+    TX_STEP_PATH_AFTER_TO,
+    TX_STEP_OTHER,
+    TX_STEP_COUNT
+};
+
+
+/**
+* Optional callback for profiling a transaction circuit, see `TxCircuitProfile`
+*
+* `step` is called before each sub-gadget is created, has its constraints
+* added, or has its witness generated, and with `TX_STEP_OTHER` after it,
+* so the work between two calls belongs to the step of the first.
+*/
+class TxCircuitHook
+{
+public:
+    virtual ~TxCircuitHook() { }
+
+    virtual void step( TxStep next ) = 0;
+};
+
+
+/**
+* Calls the hook, if any, then returns `pb`, for use in member initialisers
+*/
+static inline ProtoboardT& hook_step( ProtoboardT& pb, TxCircuitHook* hook, TxStep next )
+{
+    if( hook ) {
+        hook->step(next);
+    }
+    return pb;
+}
+
+
 /**
 * Applies a transaction to a merkle tree
 *
@@ -62,12 +112,17 @@ using jubjub::VariablePointT;
 * each field in the account state is passed as an input to the compression
 * function one-by-one.
 *
+* No-op transactions are used to pad a batch to the size of the circuit.
+* When `is_noop` is set the amount must be zero and the nonce isn't
+* incremented, so the merkle root is unchanged, and the signature is checked
+* against the identity point instead of the `from` public key, so it can be
+* satisfied without a secret key (e.g. R = G, s = 1).
+*
 */
-class TxCircuit : public GadgetT
+class TxTransferBase : public GadgetT
 {
 public:
-    typedef markle_path_compute<LongsightL12p5_MP_gadget> MerklePathT;
-    typedef merkle_path_authenticator<LongsightL12p5_MP_gadget> MerklePathCheckT;
+    TxCircuitHook* const m_hook;
 
     const VariableT merkle_root;
 
@@ -85,52 +140,45 @@ public:
     const VariableT to_balance;
     const VariableT to_nonce;
 
-    // variables for signature
-    const VariablePointT sig_R;
-    const VariableArrayT sig_s;
+    // padding transaction, doesn't modify the tree
+    const VariableT is_noop;
+
+    // signed message
     libsnark::dual_variable_gadget<FieldT> sig_nonce;
     const VariableArrayT sig_m;
-    // gadgets for signature
-    jubjub::PureEdDSA_Verify m_sig;
 
     // apply transaction balance transfer
     subadd_gadget m_balance;
 
-    // Prove `from` leaf exists in tree
+    // Leaves of `from` and `to`, before and after the transfer
     LongsightL12p5_MP_gadget m_leaf_before_from;
-    const VariableArrayT proof_before_from;
-    MerklePathCheckT path_before_from;
-
-    // Calculate new leaf for updated `from`, create new merkle-root
     LongsightL12p5_MP_gadget m_leaf_after_from;
-    MerklePathT path_after_from;
-
-    // Prove (against merkle root from `path_after_from`) that `to` leaf exists
     LongsightL12p5_MP_gadget m_leaf_before_to;
-    const VariableArrayT proof_before_to;
-    MerklePathCheckT path_before_to;
-
-    // Calculate new leaf with update `to`, creates resulting merkle-root
     LongsightL12p5_MP_gadget m_leaf_after_to;
-    MerklePathT path_after_to;
 
-    TxCircuit(
+    // Merkle paths, as recorded by `AccountTree::apply`
+    const VariableArrayT proof_before_from;
+    const VariableArrayT proof_before_to;
+
+    TxTransferBase(
         ProtoboardT& pb,
-        const jubjub::Params& params,
         const VariableT& in_merkle_root,
-        const std::string& annotation_prefix
+        const std::string& annotation_prefix,
+        TxCircuitHook* in_hook = nullptr
     ) :
         GadgetT(pb, annotation_prefix),
 
+        m_hook(in_hook),
+
         merkle_root(in_merkle_root),
 
         // on-chain transaction spec
         tx_from_idx(make_var_array(pb, snasma::TREE_DEPTH, FMT(annotation_prefix, ".from_idx"))),
         tx_to_idx(make_var_array(pb, snasma::TREE_DEPTH, FMT(annotation_prefix, ".to_idx"))),
-        tx_amount(pb, AMOUNT_BITS, FMT(annotation_prefix, ".amount")),
+        tx_amount(snasma::hook_step(pb, in_hook, TX_STEP_AMOUNT), AMOUNT_BITS, FMT(annotation_prefix, ".amount")),
 
         // variables to store from account state
-        from_pubkey(pb, FMT(annotation_prefix, ".from_pubkey")),
+        from_pubkey(snasma::hook_step(pb, in_hook, TX_STEP_OTHER), FMT(annotation_prefix, ".from_pubkey")),
         from_balance(make_variable(pb, FMT(annotation_prefix, ".from_balance"))),
         next_nonce(make_variable(pb, FMT(annotation_prefix, ".next_nonce"))),
 
@@ -139,133 +187,407 @@ public:
         to_balance(make_variable(pb, FMT(annotation_prefix, ".to_balance"))),
         to_nonce(make_variable(pb, FMT(annotation_prefix, ".to_nonce"))),
 
-        // Signature variables
-        sig_R(pb, FMT(annotation_prefix, ".R")),
-        sig_s(make_var_array(pb, FieldT::size_in_bits(), FMT(annotation_prefix, ".s"))),
-        sig_nonce(pb, snasma::TREE_DEPTH, FMT(annotation_prefix, ".nonce")),
-        sig_m(flatten({tx_from_idx, tx_to_idx, tx_amount.bits, sig_nonce.bits})),
-        //
-        // Calculate hash used for signature
+        is_noop(make_variable(pb, FMT(annotation_prefix, ".is_noop"))),
+
         //      M = (from_idx, to_idx, tx_amount, sig_nonce)
-        //      A = (from.x, from.y)
-        //      PureEdDSA-Verify(A, R, S, BITS(M))
-        m_sig(pb, params, jubjub::EdwardsPoint(params.Gx, params.Gy),
-            from_pubkey, sig_R, sig_s, sig_m,
-            FMT(annotation_prefix, ".sig")),
+        sig_nonce(snasma::hook_step(pb, in_hook, TX_STEP_SIG_NONCE), snasma::TREE_DEPTH, FMT(annotation_prefix, ".nonce")),
+        sig_m(flatten({tx_from_idx, tx_to_idx, tx_amount.bits, sig_nonce.bits})),
 
         // Apply balance transfer
         // first verfies from.balance is >= tx.amount
         //      from.balance -= tx.amount
         //      to.balance += tx.amount;
-        m_balance(pb, BALANCE_BITS, from_balance, to_balance, tx_amount.packed, FMT(annotation_prefix, ".subadd")),
-
-        // Verify the from_idx and to_idx exist in the current merkle tree
-        m_leaf_before_from(pb, libsnark::ONE, {from_pubkey.x, from_pubkey.y, from_balance, sig_nonce.packed}, FMT(annotation_prefix, ".leaf_before_from")),
-        proof_before_from(make_var_array(pb, snasma::TREE_DEPTH, FMT(annotation_prefix, ".proof_before_from"))),
-        path_before_from(pb, snasma::TREE_DEPTH, tx_from_idx, merkle_tree_IVs(pb), m_leaf_before_from.result(), merkle_root, proof_before_from, FMT(annotation_prefix, ".path_before_from")),
+        m_balance(snasma::hook_step(pb, in_hook, TX_STEP_BALANCE), BALANCE_BITS, from_balance, to_balance, tx_amount.packed, FMT(annotation_prefix, ".subadd")),
 
-        // Update the 'from' leaf to create a new merkle root
-        //
-        //  `path_after_from.result()` is the new root
-        m_leaf_after_from(pb, libsnark::ONE, {from_pubkey.x, from_pubkey.y, m_balance.X, next_nonce}, FMT(annotation_prefix, ".leaf_after_from")),
-        path_after_from(pb, snasma::TREE_DEPTH, tx_from_idx, merkle_tree_IVs(pb), m_leaf_after_from.result(), proof_before_from, FMT(annotation_prefix, ".path_after_from")),
+        //  leaf_before_from = H(from_pubkey.x, from_pubkey.y, from_balance, nonce)
+        //  leaf_after_from = H(from_pubkey.x, from_pubkey.y, from_balance - amount, next_nonce)
+        m_leaf_before_from(snasma::hook_step(pb, in_hook, TX_STEP_LEAF_BEFORE_FROM), libsnark::ONE, {from_pubkey.x, from_pubkey.y, from_balance, sig_nonce.packed}, FMT(annotation_prefix, ".leaf_before_from")),
+        m_leaf_after_from(snasma::hook_step(pb, in_hook, TX_STEP_LEAF_AFTER_FROM), libsnark::ONE, {from_pubkey.x, from_pubkey.y, m_balance.X, next_nonce}, FMT(annotation_prefix, ".leaf_after_from")),
 
-        // Verify the 'to' leaf exists in the new merkle root and is the expected value
-        //
         //  leaf_before_to = H(to_pubkey.x, to_pubkey.y, to_balance, to_nonce)
-        //  assert merkle_path(leaf_before_to, path_after_from.result(), proof_before_to)
-        m_leaf_before_to(pb, libsnark::ONE, {to_pubkey.x, to_pubkey.y, to_balance, to_nonce}, FMT(annotation_prefix, ".leaf_before_to")),
-        proof_before_to(make_var_array(pb, snasma::TREE_DEPTH, FMT(annotation_prefix, ".proof_before_to"))),
-        path_before_to(pb, snasma::TREE_DEPTH, tx_to_idx, merkle_tree_IVs(pb), m_leaf_before_to.result(), path_after_from.result(), proof_before_to, FMT(annotation_prefix, ".path_before_to")),
-
-        // Update the 'to' leaf with the new balance
-        // this creates the last merkle root
+        //  leaf_after_to = H(to_pubkey.x, to_pubkey.y, to_balance + amount, to_nonce)
         // to_nonce isn't incremented
-        m_leaf_after_to(pb, libsnark::ONE, {to_pubkey.x, to_pubkey.y, m_balance.Y, to_nonce}, FMT(annotation_prefix, ".leaf_after_to")),
-        path_after_to(pb, snasma::TREE_DEPTH, tx_to_idx, merkle_tree_IVs(pb), m_leaf_after_to.result(), proof_before_to, FMT(annotation_prefix, ".path_after_to"))
-    {
-
-    }
-
+        m_leaf_before_to(snasma::hook_step(pb, in_hook, TX_STEP_LEAF_BEFORE_TO), libsnark::ONE, {to_pubkey.x, to_pubkey.y, to_balance, to_nonce}, FMT(annotation_prefix, ".leaf_before_to")),
+        m_leaf_after_to(snasma::hook_step(pb, in_hook, TX_STEP_LEAF_AFTER_TO), libsnark::ONE, {to_pubkey.x, to_pubkey.y, m_balance.Y, to_nonce}, FMT(annotation_prefix, ".leaf_after_to")),
 
-    const VariableT result() const
+        proof_before_from(make_var_array(snasma::hook_step(pb, in_hook, TX_STEP_OTHER), snasma::TREE_DEPTH, FMT(annotation_prefix, ".proof_before_from"))),
+        proof_before_to(make_var_array(pb, snasma::TREE_DEPTH, FMT(annotation_prefix, ".proof_before_to")))
     {
-        return path_after_to.result();
+
     }
 
 
-    void generate_r1cs_witness( const snasma::TxProof& proof )
+    /**
+    * Generate the witness for the transaction and leaves, but not the signature
+    */
+    void generate_r1cs_witness_local( const snasma::TxProof& proof )
     {
-        this->pb.val(merkle_root) = proof.merkle_root;
-
         tx_from_idx.fill_with_bits_of_ulong(this->pb, (unsigned long)proof.stx.tx.from_idx);
         tx_to_idx.fill_with_bits_of_ulong(this->pb, (unsigned long)proof.stx.tx.to_idx);
 
         tx_amount.bits.fill_with_bits_of_ulong(this->pb, proof.stx.tx.amount);
+        hook_step(TX_STEP_AMOUNT);
         tx_amount.generate_r1cs_witness_from_bits();
+        hook_step(TX_STEP_OTHER);
 
         this->pb.val(from_pubkey.x) = proof.state_from.pubkey.x;
         this->pb.val(from_pubkey.y) = proof.state_from.pubkey.y;
         this->pb.val(from_balance) = proof.state_from.balance;
-        this->pb.val(next_nonce) = proof.stx.nonce + 1;
+        this->pb.val(next_nonce) = proof.stx.nonce + (proof.is_noop ? 0 : 1);
 
         this->pb.val(to_pubkey.x) = proof.state_to.pubkey.x;
         this->pb.val(to_pubkey.y) = proof.state_to.pubkey.y;
         this->pb.val(to_balance) = proof.state_to.balance;
         this->pb.val(to_nonce) = proof.state_to.nonce;
 
-        this->pb.val(sig_R.x) = proof.stx.sig.R.x;
-        this->pb.val(sig_R.y) = proof.stx.sig.R.y;
-        sig_s.fill_with_bits_of_field_element(this->pb, proof.stx.sig.s);
+        this->pb.val(is_noop) = proof.is_noop ? FieldT::one() : FieldT::zero();
         this->pb.val(sig_nonce.packed) = proof.stx.nonce;
+        hook_step(TX_STEP_SIG_NONCE);
         sig_nonce.generate_r1cs_witness_from_packed();
-        m_sig.generate_r1cs_witness();
 
+        hook_step(TX_STEP_BALANCE);
         m_balance.generate_r1cs_witness();
 
+        hook_step(TX_STEP_LEAF_BEFORE_FROM);
         m_leaf_before_from.generate_r1cs_witness();
-        proof_before_from.fill_with_field_elements(this->pb, proof.before_from);
-        path_before_from.generate_r1cs_witness();
-
+        hook_step(TX_STEP_LEAF_AFTER_FROM);
         m_leaf_after_from.generate_r1cs_witness();
-        path_after_from.generate_r1cs_witness();
-
+        hook_step(TX_STEP_LEAF_BEFORE_TO);
         m_leaf_before_to.generate_r1cs_witness();
-        proof_before_to.fill_with_field_elements(this->pb, proof.before_to);
-        path_before_to.generate_r1cs_witness();
-
+        hook_step(TX_STEP_LEAF_AFTER_TO);
         m_leaf_after_to.generate_r1cs_witness();
-        path_after_to.generate_r1cs_witness();
+        hook_step(TX_STEP_OTHER);
 
+        proof_before_from.fill_with_field_elements(this->pb, proof.before_from);
+        proof_before_to.fill_with_field_elements(this->pb, proof.before_to);
     }
 
 
     void generate_r1cs_constraints()
     {
+        hook_step(TX_STEP_AMOUNT);
         tx_amount.generate_r1cs_constraints(true);
+        hook_step(TX_STEP_SIG_NONCE);
         sig_nonce.generate_r1cs_constraints(true);
+        hook_step(TX_STEP_OTHER);
+
+        libsnark::generate_boolean_r1cs_constraint<FieldT>(this->pb, is_noop, FMT(this->annotation_prefix, ".is_noop"));
 
         this->pb.add_r1cs_constraint(
-            ConstraintT(sig_nonce.packed + FieldT::one(), 1, next_nonce),
-            "next_nonce = sig_nonce++");
+            ConstraintT(sig_nonce.packed + FieldT::one() - is_noop, 1, next_nonce),
+            "next_nonce = sig_nonce + (1 - is_noop)");
 
-        m_sig.generate_r1cs_constraints();
+        this->pb.add_r1cs_constraint(
+            ConstraintT(is_noop, tx_amount.packed, 0),
+            "is_noop -> amount == 0");
 
+        hook_step(TX_STEP_LEAF_BEFORE_FROM);
         m_leaf_before_from.generate_r1cs_constraints();
+        hook_step(TX_STEP_LEAF_BEFORE_TO);
         m_leaf_before_to.generate_r1cs_constraints();
 
+        hook_step(TX_STEP_BALANCE);
         m_balance.generate_r1cs_constraints();
 
+        hook_step(TX_STEP_LEAF_AFTER_FROM);
         m_leaf_after_from.generate_r1cs_constraints();
+        hook_step(TX_STEP_LEAF_AFTER_TO);
         m_leaf_after_to.generate_r1cs_constraints();
+        hook_step(TX_STEP_OTHER);
+    }
+
+protected:
+    void hook_step( TxStep next ) const
+    {
+        if( m_hook ) {
+            m_hook->step(next);
+        }
+    }
+};
+
 
+/**
+* Signature check for a transaction, or a group of transactions, from the
+* account `from_pubkey`, over the message bits `sig_m`.
+*/
+class TxSignatureGadget : public GadgetT
+{
+public:
+    const VariablePointT from_pubkey;
+    const VariableT is_noop;
+
+    // variables for signature
+    //      A = is_noop ? (0, 1) : from_pubkey
+    const VariablePointT sig_A;
+    const VariablePointT sig_R;
+    const VariableArrayT sig_s;
+    // gadgets for signature
+    jubjub::PureEdDSA_Verify m_sig;
+
+    TxSignatureGadget(
+        ProtoboardT& pb,
+        const jubjub::Params& params,
+        const VariablePointT& in_from_pubkey,
+        const VariableT& in_is_noop,
+        const VariableArrayT& in_sig_m,
+        const std::string& annotation_prefix
+    ) :
+        GadgetT(pb, annotation_prefix),
+        from_pubkey(in_from_pubkey),
+        is_noop(in_is_noop),
+        sig_A(pb, FMT(annotation_prefix, ".A")),
+        sig_R(pb, FMT(annotation_prefix, ".R")),
+        sig_s(make_var_array(pb, FieldT::size_in_bits(), FMT(annotation_prefix, ".s"))),
+        //
+        // Calculate hash used for signature
+        //      A = (from.x, from.y)
+        //      PureEdDSA-Verify(A, R, S, BITS(M))
+        m_sig(pb, params, jubjub::EdwardsPoint(params.Gx, params.Gy),
+            sig_A, sig_R, sig_s, in_sig_m,
+            FMT(annotation_prefix, ".sig"))
+    {
+
+    }
+
+
+    /**
+    * The public key and `is_noop` must already be assigned
+    */
+    void generate_r1cs_witness( const Signature& sig )
+    {
+        const bool noop = ! this->pb.val(is_noop).is_zero();
+        this->pb.val(sig_A.x) = noop ? FieldT::zero() : this->pb.val(from_pubkey.x);
+        this->pb.val(sig_A.y) = noop ? FieldT::one() : this->pb.val(from_pubkey.y);
+        this->pb.val(sig_R.x) = sig.R.x;
+        this->pb.val(sig_R.y) = sig.R.y;
+        sig_s.fill_with_bits_of_field_element(this->pb, sig.s);
+        m_sig.generate_r1cs_witness();
+    }
+
+
+    void generate_r1cs_constraints()
+    {
+        this->pb.add_r1cs_constraint(
+            ConstraintT(is_noop, from_pubkey.x, from_pubkey.x - sig_A.x),
+            "sig_A.x = is_noop ? 0 : from_pubkey.x");
+
+        this->pb.add_r1cs_constraint(
+            ConstraintT(is_noop, FieldT::one() - from_pubkey.y, sig_A.y - from_pubkey.y),
+            "sig_A.y = is_noop ? 1 : from_pubkey.y");
+
+        m_sig.generate_r1cs_constraints();
+    }
+};
+
+
+/**
+* Transaction with its own signature
+*/
+class TxCircuitBase : public TxTransferBase
+{
+public:
+    TxSignatureGadget m_signature;
+
+    TxCircuitBase(
+        ProtoboardT& pb,
+        const jubjub::Params& params,
+        const VariableT& in_merkle_root,
+        const std::string& annotation_prefix,
+        TxCircuitHook* in_hook = nullptr
+    ) :
+        TxTransferBase(pb, in_merkle_root, annotation_prefix, in_hook),
+        m_signature(snasma::hook_step(pb, in_hook, TX_STEP_SIG), params, from_pubkey, is_noop, sig_m, annotation_prefix)
+    {
+        hook_step(TX_STEP_OTHER);
+    }
+
+
+    void generate_r1cs_witness_local( const snasma::TxProof& proof )
+    {
+        TxTransferBase::generate_r1cs_witness_local(proof);
+
+        hook_step(TX_STEP_SIG);
+        m_signature.generate_r1cs_witness(proof.stx.sig);
+        hook_step(TX_STEP_OTHER);
+    }
+
+
+    void generate_r1cs_constraints()
+    {
+        TxTransferBase::generate_r1cs_constraints();
+
+        hook_step(TX_STEP_SIG);
+        m_signature.generate_r1cs_constraints();
+        hook_step(TX_STEP_OTHER);
+    }
+};
+
+
+/**
+* Per-level IVs of the merkle tree, created once per batch and shared by
+* the path gadgets of every transaction
+*
+* `merkle_tree_IVs` only assigns the IVs, here they are also constrained to
+* their values, so the prover can't choose different IVs.
+*/
+static const VariableArrayT shared_merkle_tree_IVs( ProtoboardT& pb, const std::string& annotation_prefix )
+{
+    const auto IVs = merkle_tree_IVs(pb);
+    for( size_t i = 0; i < IVs.size(); i++ )
+    {
+        pb.add_r1cs_constraint(
+            ConstraintT(IVs[i], 1, pb.val(IVs[i])),
+            FMT(annotation_prefix, ".IVs[%zu]", i));
+    }
+    return IVs;
+}
+
+
+/**
+* Applies the transaction with four merkle paths, one after another
+*
+*   `path_before_from` proves `from` is in the merkle root
+*   `path_after_from` computes the root with `from` updated
+*   `path_before_to` proves `to` is in that intermediate root
+*   `path_after_to` computes the resulting merkle root
+*
+* The base is either `TxCircuitBase`, where each transaction has its own
+* signature, or `TxTransferBase`, where the signature is checked elsewhere
+* (see `TxGroupCircuit`).
+*/
+template<typename BaseT>
+class TxPathCircuitT : public BaseT
+{
+public:
+    typedef markle_path_compute<LongsightL12p5_MP_gadget> MerklePathT;
+    typedef merkle_path_authenticator<LongsightL12p5_MP_gadget> MerklePathCheckT;
+
+    // Prove `from` leaf exists in tree
+    MerklePathCheckT path_before_from;
+
+    // Calculate new leaf for updated `from`, create new merkle-root
+    MerklePathT path_after_from;
+
+    // Prove (against merkle root from `path_after_from`) that `to` leaf exists
+    MerklePathCheckT path_before_to;
+
+    // Calculate new leaf with update `to`, creates resulting merkle-root
+    MerklePathT path_after_to;
+
+    template<typename... BaseArgs>
+    TxPathCircuitT(
+        ProtoboardT& pb,
+        const VariableArrayT& in_IVs,
+        const VariableT& in_merkle_root,
+        const std::string& annotation_prefix,
+        TxCircuitHook* in_hook,
+        BaseArgs&&... base_args
+    ) :
+        BaseT(pb, std::forward<BaseArgs>(base_args)..., in_merkle_root, annotation_prefix, in_hook),
+
+        // Verify the from_idx and to_idx exist in the current merkle tree
+        path_before_from(snasma::hook_step(pb, in_hook, TX_STEP_PATH_BEFORE_FROM), snasma::TREE_DEPTH, this->tx_from_idx, in_IVs, this->m_leaf_before_from.result(), this->merkle_root, this->proof_before_from, FMT(annotation_prefix, ".path_before_from")),
+
+        // Update the 'from' leaf to create a new merkle root
+        //
+        //  `path_after_from.result()` is the new root
+        path_after_from(snasma::hook_step(pb, in_hook, TX_STEP_PATH_AFTER_FROM), snasma::TREE_DEPTH, this->tx_from_idx, in_IVs, this->m_leaf_after_from.result(), this->proof_before_from, FMT(annotation_prefix, ".path_after_from")),
+
+        // Verify the 'to' leaf exists in the new merkle root and is the expected value
+        //
+        //  assert merkle_path(leaf_before_to, path_after_from.result(), proof_before_to)
+        path_before_to(snasma::hook_step(pb, in_hook, TX_STEP_PATH_BEFORE_TO), snasma::TREE_DEPTH, this->tx_to_idx, in_IVs, this->m_leaf_before_to.result(), path_after_from.result(), this->proof_before_to, FMT(annotation_prefix, ".path_before_to")),
+
+        // Update the 'to' leaf with the new balance
+        // this creates the last merkle root
+        path_after_to(snasma::hook_step(pb, in_hook, TX_STEP_PATH_AFTER_TO), snasma::TREE_DEPTH, this->tx_to_idx, in_IVs, this->m_leaf_after_to.result(), this->proof_before_to, FMT(annotation_prefix, ".path_after_to"))
+    {
+        this->hook_step(TX_STEP_OTHER);
+    }
+
+
+    const VariableT result() const
+    {
+        return path_after_to.result();
+    }
+
+
+    void generate_r1cs_witness( const snasma::TxProof& proof )
+    {
+        this->pb.val(this->merkle_root) = proof.merkle_root;
+
+        generate_r1cs_witness_local(proof);
+    }
+
+
+    /**
+    * Generate the witness for everything except the input merkle root
+    *
+    * The merkle path gadgets only hash the leaves with the supplied paths,
+    * comparing the result against `merkle_root` (which is the `result()` of
+    * the previous transaction) is only done by the constraints. This means
+    * the local witness of every transaction in a chain is independent, and
+    * they can be generated concurrently.
+    */
+    void generate_r1cs_witness_local( const snasma::TxProof& proof )
+    {
+        BaseT::generate_r1cs_witness_local(proof);
+
+        this->hook_step(TX_STEP_PATH_BEFORE_FROM);
+        path_before_from.generate_r1cs_witness();
+        this->hook_step(TX_STEP_PATH_AFTER_FROM);
+        path_after_from.generate_r1cs_witness();
+        this->hook_step(TX_STEP_PATH_BEFORE_TO);
+        path_before_to.generate_r1cs_witness();
+        this->hook_step(TX_STEP_PATH_AFTER_TO);
+        path_after_to.generate_r1cs_witness();
+        this->hook_step(TX_STEP_OTHER);
+    }
+
+
+    void generate_r1cs_constraints()
+    {
+        BaseT::generate_r1cs_constraints();
+
+        this->hook_step(TX_STEP_PATH_BEFORE_FROM);
         path_before_from.generate_r1cs_constraints();
+        this->hook_step(TX_STEP_PATH_BEFORE_TO);
         path_before_to.generate_r1cs_constraints();
+        this->hook_step(TX_STEP_PATH_AFTER_FROM);
         path_after_from.generate_r1cs_constraints();
+        this->hook_step(TX_STEP_PATH_AFTER_TO);
         path_after_to.generate_r1cs_constraints();
+        this->hook_step(TX_STEP_OTHER);
     }
 };
 
+
+/**
+* Transaction with its own signature, and four merkle paths
+*/
+class TxCircuit : public TxPathCircuitT<TxCircuitBase>
+{
+public:
+    TxCircuit(
+        ProtoboardT& pb,
+        const jubjub::Params& params,
+        const VariableArrayT& in_IVs,
+        const VariableT& in_merkle_root,
+        const std::string& annotation_prefix,
+        TxCircuitHook* in_hook = nullptr
+    ) :
+        TxPathCircuitT<TxCircuitBase>(pb, in_IVs, in_merkle_root, annotation_prefix, in_hook, params)
+    {
+
+    }
+};
+
+
+/**
+* Transaction without a signature, and four merkle paths
+*/
+typedef TxPathCircuitT<TxTransferBase> TxTransferCircuit;
+
 // namespace snasma
 }
 
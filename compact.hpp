@@ -0,0 +1,542 @@
+#ifndef COMPACT_HPP_
+#define COMPACT_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "txfile.hpp"
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Compact batch format for `TxProof`
+*
+* Consecutive transactions share most of their merkle path siblings, and the
+* account states of each transaction follow from the previous ones. Instead
+* of two full paths and both account states per transaction, a compact batch
+* stores every distinct node once, and the state of each account before the
+* first transaction which uses it. Transactions refer to the nodes by their
+* index in the table, the account states are re-derived while decoding, the
+* same as `AccountTreeT::apply` and `make_noop`, so no hashing is needed.
+*
+* Most of the 49 node references of a transaction are the same as those of
+* the previous transaction: the upper siblings are roots of empty subtrees,
+* or of subtrees neither touched. Only the references which differ from the
+* previous transaction are stored, marked by a bit mask. Each is stored as
+* a varint of how far back it is from the next new node, so a node used for
+* the first time, which is the common case, is the single byte 0.
+*
+* All integers are little-endian, field elements are as `txfile.hpp`.
+*
+* Header:
+*
+*   offset  size
+*   0       8       magic "SNASMATC"
+*   8       4       version
+*   12      4       tree depth
+*   16      8       number of transactions
+*   24      8       number of accounts
+*   32      8       number of nodes
+*   40      24      reserved, zero
+*
+* Followed by the accounts, in order of first use:
+*
+*   0       4       index
+*   4       4       nonce
+*   8       24      reserved, zero
+*   32      96      pubkey.x, pubkey.y, balance
+*
+* Then the nodes, 32 bytes each, then the transactions, each of a variable
+* length, where varints are LEB128 (7 bits per byte, least significant
+* first, the top bit set on all but the last byte):
+*
+*   varint  stx.tx.from_idx
+*   varint  stx.tx.to_idx
+*   varint  stx.tx.amount
+*   varint  stx.nonce
+*   1       flags, as `txfile.hpp`
+*   7       mask of the node slots which differ from the previous transaction,
+*           bit 0 is merkle_root, then before_from[TREE_DEPTH], then
+*           before_to[TREE_DEPTH], all are set for the first transaction
+*   96      stx.sig (R.x, R.y, s)
+*   varint  for each slot in the mask, in order, `next - index`, where
+*           `next` is the number of nodes referenced so far and `index`
+*           the node it refers to
+*/
+static const char COMPACT_MAGIC[8] = {'S', 'N', 'A', 'S', 'M', 'A', 'T', 'C'};
+static const uint32_t COMPACT_VERSION = 2;
+static const size_t COMPACT_HEADER_SIZE = 64;
+static const size_t COMPACT_ACCOUNT_SIZE = 128;
+static const size_t COMPACT_NODE_SIZE = TXFILE_FIELD_SIZE;
+static const size_t COMPACT_SLOTS = 1 + (2 * TREE_DEPTH);
+static const size_t COMPACT_MASK_SIZE = 7;
+static const size_t COMPACT_SIG_SIZE = 3 * TXFILE_FIELD_SIZE;
+static const size_t COMPACT_RECORD_MIN_SIZE = 4 + 1 + COMPACT_MASK_SIZE + COMPACT_SIG_SIZE;
+
+static_assert(COMPACT_SLOTS <= COMPACT_MASK_SIZE * 8, "node slot mask too small");
+
+
+static void write_varint( std::vector<uint8_t>& out, uint64_t x )
+{
+    while( x >= 0x80 )
+    {
+        out.emplace_back(uint8_t(x | 0x80));
+        x >>= 7;
+    }
+    out.emplace_back(uint8_t(x));
+}
+
+
+/**
+* Read a varint of at most 32 bits, from `p` up to `end`
+*
+* @return false if it's truncated or too large
+*/
+static bool read_varint( const uint8_t *&p, const uint8_t *end, uint32_t& out )
+{
+    uint64_t x = 0;
+    for( size_t shift = 0; shift < 35; shift += 7 )
+    {
+        if( p == end ) {
+            return false;
+        }
+        const auto byte = *p++;
+        x |= uint64_t(byte & 0x7F) << shift;
+        if( (byte & 0x80) == 0 ) {
+            out = uint32_t(x);
+            return x <= 0xFFFFFFFFULL;
+        }
+    }
+    return false;
+}
+
+
+struct FieldHash
+{
+    size_t operator()( const ethsnarks::FieldT& x ) const
+    {
+        return size_t(x.mont_repr.data[0]);
+    }
+};
+
+
+static bool account_state_equal( const AccountState& a, const AccountState& b )
+{
+    return a.pubkey.x == b.pubkey.x
+        && a.pubkey.y == b.pubkey.y
+        && a.balance == b.balance
+        && a.nonce == b.nonce;
+}
+
+
+/**
+* Account states as they are recorded in each `TxProof`, starting from the
+* state of each account before its first transaction
+*/
+class CompactAccountStates
+{
+public:
+    std::unordered_map<uint32_t, AccountState> m_current;
+
+    /**
+    * Apply a transaction, setting `state_from` and `state_to` to the
+    * states before it, as `AccountTreeT::apply` records them
+    *
+    * @return false if either account is unknown
+    */
+    bool apply( const TxProof& item, AccountState& state_from, AccountState& state_to )
+    {
+        const auto& tx = item.stx.tx;
+        const ethsnarks::FieldT amount(tx.amount);
+
+        auto from = m_current.find(tx.from_idx);
+        if( from == m_current.end() ) {
+            return false;
+        }
+        state_from = from->second;
+        from->second.nonce += item.is_noop ? 0 : 1;
+        from->second.balance -= amount;
+
+        auto to = m_current.find(tx.to_idx);
+        if( to == m_current.end() ) {
+            return false;
+        }
+        state_to = to->second;
+        to->second.balance += amount;
+
+        return true;
+    }
+};
+
+
+/**
+* Write a complete compact batch file
+*
+* @return false if the account states of a transaction don't follow on from
+*         the previous transactions, they can't be derived when decoding
+*/
+static bool write_compact_batch( std::ostream& os, const std::vector<TxProof>& items )
+{
+    CompactAccountStates states;
+    std::vector<std::pair<uint32_t, AccountState>> accounts;
+
+    std::unordered_map<ethsnarks::FieldT, uint32_t, FieldHash> node_indices;
+    std::vector<ethsnarks::FieldT> nodes;
+
+    // The encoded records, after the tables
+    std::vector<uint8_t> records;
+    records.reserve(items.size() * COMPACT_RECORD_MIN_SIZE * 2);
+
+    // Node of each slot in the previous transaction, none before the first
+    std::vector<uint32_t> prev_slots(COMPACT_SLOTS, UINT32_MAX);
+    std::vector<uint8_t> refs;
+    uint8_t sig[COMPACT_SIG_SIZE];
+
+    for( size_t i = 0; i < items.size(); i++ )
+    {
+        const auto& item = items[i];
+        const auto& tx = item.stx.tx;
+
+        // The `to` state is recorded after `from` is updated
+        if( states.m_current.emplace(tx.from_idx, item.state_from).second ) {
+            accounts.emplace_back(tx.from_idx, item.state_from);
+        }
+        if( tx.to_idx != tx.from_idx && states.m_current.emplace(tx.to_idx, item.state_to).second ) {
+            accounts.emplace_back(tx.to_idx, item.state_to);
+        }
+
+        AccountState state_from, state_to;
+        states.apply(item, state_from, state_to);
+        if( ! account_state_equal(state_from, item.state_from) || ! account_state_equal(state_to, item.state_to) ) {
+            std::cerr << "error compact: account states of transaction " << i << " don't follow from the previous" << endl;
+            return false;
+        }
+
+        if( item.before_from.size() != TREE_DEPTH || item.before_to.size() != TREE_DEPTH ) {
+            std::cerr << "error compact: wrong path length for transaction " << i << endl;
+            return false;
+        }
+
+        // Nodes are numbered in the order the decoder first sees them
+        uint64_t mask = 0;
+        refs.clear();
+        for( size_t j = 0; j < COMPACT_SLOTS; j++ )
+        {
+            const auto& x = (j == 0) ? item.merkle_root
+                          : (j <= TREE_DEPTH) ? item.before_from[j - 1]
+                          : item.before_to[j - 1 - TREE_DEPTH];
+
+            const auto next = uint32_t(nodes.size());
+            const auto it = node_indices.emplace(x, next);
+            if( it.second ) {
+                nodes.emplace_back(x);
+            }
+
+            const auto index = it.first->second;
+            if( index != prev_slots[j] )
+            {
+                mask |= uint64_t(1) << j;
+                write_varint(refs, next - index);
+                prev_slots[j] = index;
+            }
+        }
+
+        write_varint(records, tx.from_idx);
+        write_varint(records, tx.to_idx);
+        write_varint(records, tx.amount);
+        write_varint(records, item.stx.nonce);
+        records.emplace_back(uint8_t(item.is_noop ? TXFILE_FLAG_NOOP : 0));
+        for( size_t j = 0; j < COMPACT_MASK_SIZE; j++ ) {
+            records.emplace_back(uint8_t(mask >> (j * 8)));
+        }
+        encode_field(sig, item.stx.sig.R.x);
+        encode_field(sig + TXFILE_FIELD_SIZE, item.stx.sig.R.y);
+        encode_field(sig + (2 * TXFILE_FIELD_SIZE), item.stx.sig.s);
+        records.insert(records.end(), sig, sig + sizeof(sig));
+        records.insert(records.end(), refs.begin(), refs.end());
+    }
+
+    std::vector<uint8_t> buf(std::max(COMPACT_HEADER_SIZE, COMPACT_ACCOUNT_SIZE), 0);
+    memcpy(buf.data(), COMPACT_MAGIC, sizeof(COMPACT_MAGIC));
+    store_le32(buf.data() + 8, COMPACT_VERSION);
+    store_le32(buf.data() + 12, TREE_DEPTH);
+    store_le64(buf.data() + 16, items.size());
+    store_le64(buf.data() + 24, accounts.size());
+    store_le64(buf.data() + 32, nodes.size());
+    os.write((const char*)buf.data(), COMPACT_HEADER_SIZE);
+
+    for( const auto& it : accounts )
+    {
+        std::fill(buf.begin(), buf.begin() + COMPACT_ACCOUNT_SIZE, 0);
+        store_le32(buf.data(), it.first);
+        store_le32(buf.data() + 4, it.second.nonce);
+        encode_field(buf.data() + 32, it.second.pubkey.x);
+        encode_field(buf.data() + 64, it.second.pubkey.y);
+        encode_field(buf.data() + 96, it.second.balance);
+        os.write((const char*)buf.data(), COMPACT_ACCOUNT_SIZE);
+    }
+
+    for( const auto& x : nodes )
+    {
+        encode_field(buf.data(), x);
+        os.write((const char*)buf.data(), COMPACT_NODE_SIZE);
+    }
+
+    os.write((const char*)records.data(), records.size());
+
+    return bool(os);
+}
+
+
+/**
+* Read-only memory mapping of a compact batch file
+*
+* The nodes and accounts are decoded when the file is opened, transactions
+* are then decoded in order, each referring to the decoded nodes.
+*/
+class MappedCompactBatch
+{
+public:
+    const uint8_t *m_data;
+    size_t m_length;
+    size_t m_count;
+
+    // First transaction record, after the accounts and nodes
+    const uint8_t *m_records;
+
+    // Start of the next transaction record
+    const uint8_t *m_cursor;
+
+    std::vector<ethsnarks::FieldT> m_nodes;
+    CompactAccountStates m_states;
+
+    // Node of each slot in the previous transaction
+    std::vector<uint32_t> m_slots;
+
+    // Number of nodes referenced so far
+    uint32_t m_next_node;
+
+    // Index of the next transaction to decode
+    size_t m_next;
+
+    MappedCompactBatch() :
+        m_data(nullptr), m_length(0), m_count(0), m_records(nullptr), m_cursor(nullptr), m_next_node(0), m_next(0)
+    { }
+
+    ~MappedCompactBatch()
+    {
+        close();
+    }
+
+    MappedCompactBatch( const MappedCompactBatch& ) = delete;
+    MappedCompactBatch& operator= ( const MappedCompactBatch& ) = delete;
+
+    /**
+    * @return true if the file at `path` starts with the compact magic
+    */
+    static bool is_compact( const char *path )
+    {
+        char magic[sizeof(COMPACT_MAGIC)];
+        std::ifstream infile(path, std::ios::binary);
+        return infile.read(magic, sizeof(magic))
+            && memcmp(magic, COMPACT_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool open( const char *path )
+    {
+        close();
+
+        const int fd = ::open(path, O_RDONLY);
+        if( fd < 0 ) {
+            std::cerr << "error compact: cannot open " << path << endl;
+            return false;
+        }
+
+        struct stat st;
+        if( fstat(fd, &st) != 0 || size_t(st.st_size) < COMPACT_HEADER_SIZE ) {
+            std::cerr << "error compact: cannot stat, or too small " << path << endl;
+            ::close(fd);
+            return false;
+        }
+
+        void *addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if( addr == MAP_FAILED ) {
+            std::cerr << "error compact: cannot mmap " << path << endl;
+            return false;
+        }
+
+        madvise(addr, size_t(st.st_size), MADV_SEQUENTIAL);
+        m_data = (const uint8_t*)addr;
+        m_length = size_t(st.st_size);
+
+        if( ! decode_tables() ) {
+            close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void close()
+    {
+        if( m_data != nullptr ) {
+            munmap((void*)m_data, m_length);
+        }
+        m_data = nullptr;
+        m_length = 0;
+        m_count = 0;
+        m_records = nullptr;
+        m_cursor = nullptr;
+        m_nodes.clear();
+        m_states.m_current.clear();
+        m_slots.clear();
+        m_next_node = 0;
+        m_next = 0;
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    /**
+    * Decode the next transaction into an existing `TxProof`, re-using
+    * its path vectors
+    *
+    * @return false if there are none left, or the record is invalid
+    */
+    bool decode_next( TxProof& out )
+    {
+        if( m_next >= m_count ) {
+            return false;
+        }
+
+        const uint8_t *p = m_cursor;
+        const uint8_t *end = m_data + m_length;
+        m_next++;
+
+        bool ok = read_varint(p, end, out.stx.tx.from_idx)
+               && read_varint(p, end, out.stx.tx.to_idx)
+               && read_varint(p, end, out.stx.tx.amount)
+               && read_varint(p, end, out.stx.nonce)
+               && size_t(end - p) >= 1 + COMPACT_MASK_SIZE + COMPACT_SIG_SIZE;
+        if( ! ok ) {
+            return false;
+        }
+
+        out.is_noop = (*p++ & TXFILE_FLAG_NOOP) != 0;
+
+        uint64_t mask = 0;
+        for( size_t j = 0; j < COMPACT_MASK_SIZE; j++ ) {
+            mask |= uint64_t(*p++) << (j * 8);
+        }
+
+        ok = decode_field(p, out.stx.sig.R.x)
+          && decode_field(p + TXFILE_FIELD_SIZE, out.stx.sig.R.y)
+          && decode_field(p + (2 * TXFILE_FIELD_SIZE), out.stx.sig.s)
+          && (mask >> COMPACT_SLOTS) == 0;
+        p += COMPACT_SIG_SIZE;
+
+        for( size_t j = 0; ok && j < COMPACT_SLOTS; j++ )
+        {
+            if( mask & (uint64_t(1) << j) )
+            {
+                uint32_t back;
+                ok = read_varint(p, end, back) && back <= m_next_node;
+                if( ok ) {
+                    m_slots[j] = back ? (m_next_node - back) : m_next_node++;
+                }
+            }
+            // Every slot of the first transaction must be given
+            ok = ok && m_slots[j] < m_nodes.size();
+        }
+
+        out.before_from.resize(TREE_DEPTH);
+        out.before_to.resize(TREE_DEPTH);
+        if( ! ok ) {
+            return false;
+        }
+
+        out.merkle_root = m_nodes[m_slots[0]];
+        for( size_t i = 0; i < TREE_DEPTH; i++ )
+        {
+            out.before_from[i] = m_nodes[m_slots[1 + i]];
+            out.before_to[i] = m_nodes[m_slots[1 + TREE_DEPTH + i]];
+        }
+
+        m_cursor = p;
+        return m_states.apply(out, out.state_from, out.state_to);
+    }
+
+protected:
+    bool decode_tables()
+    {
+        const uint8_t *p = m_data;
+        if( memcmp(p, COMPACT_MAGIC, sizeof(COMPACT_MAGIC)) != 0
+         || load_le32(p + 8) != COMPACT_VERSION
+         || load_le32(p + 12) != TREE_DEPTH ) {
+            std::cerr << "error compact: bad magic, version or tree depth" << endl;
+            return false;
+        }
+
+        const auto count = load_le64(p + 16);
+        const auto n_accounts = load_le64(p + 24);
+        const auto n_nodes = load_le64(p + 32);
+
+        // Each is bounded first, so the total can't overflow
+        const auto remaining = m_length - COMPACT_HEADER_SIZE;
+        if( n_accounts > remaining / COMPACT_ACCOUNT_SIZE
+         || n_nodes > remaining / COMPACT_NODE_SIZE
+         || count > remaining / COMPACT_RECORD_MIN_SIZE
+         || (n_accounts * COMPACT_ACCOUNT_SIZE) + (n_nodes * COMPACT_NODE_SIZE) + (count * COMPACT_RECORD_MIN_SIZE) > remaining ) {
+            std::cerr << "error compact: truncated" << endl;
+            return false;
+        }
+
+        p += COMPACT_HEADER_SIZE;
+        m_states.m_current.reserve(n_accounts);
+        for( size_t i = 0; i < n_accounts; i++, p += COMPACT_ACCOUNT_SIZE )
+        {
+            AccountState state;
+            state.nonce = load_le32(p + 4);
+            if( ! decode_field(p + 32, state.pubkey.x)
+             || ! decode_field(p + 64, state.pubkey.y)
+             || ! decode_field(p + 96, state.balance)
+             || ! m_states.m_current.emplace(load_le32(p), state).second ) {
+                std::cerr << "error compact: invalid account " << i << endl;
+                return false;
+            }
+        }
+
+        m_nodes.resize(n_nodes);
+        for( size_t i = 0; i < n_nodes; i++, p += COMPACT_NODE_SIZE )
+        {
+            if( ! decode_field(p, m_nodes[i]) ) {
+                std::cerr << "error compact: invalid node " << i << endl;
+                return false;
+            }
+        }
+
+        m_records = p;
+        m_cursor = p;
+        m_count = count;
+        m_slots.assign(COMPACT_SLOTS, UINT32_MAX);
+        m_next_node = 0;
+        m_next = 0;
+        return true;
+    }
+};
+
+
+// namespace snasma
+}
+
+// COMPACT_HPP_
+#endif
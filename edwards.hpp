@@ -0,0 +1,341 @@
+#ifndef EDWARDS_HPP_
+#define EDWARDS_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "ethsnarks.hpp"
+#include "jubjub/point.hpp"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Scalars wide enough for the product of two field elements, plus the sum
+* of many of them, as used by the batch verifier.
+*/
+typedef libff::bigint<2 * ethsnarks::FieldT::num_limbs> WideScalarT;
+
+
+static inline const WideScalarT to_wide( const ethsnarks::FieldT& x )
+{
+    WideScalarT result;
+    const auto x_int = x.as_bigint();
+    mpn_copyi(result.data, x_int.data, ethsnarks::FieldT::num_limbs);
+    return result;
+}
+
+
+/**
+* Product of two field elements, as integers
+*/
+static inline const WideScalarT wide_mul( const ethsnarks::FieldT& a, const ethsnarks::FieldT& b )
+{
+    WideScalarT result;
+    const auto a_int = a.as_bigint();
+    const auto b_int = b.as_bigint();
+    mpn_mul_n(result.data, a_int.data, b_int.data, ethsnarks::FieldT::num_limbs);
+    return result;
+}
+
+
+static inline void wide_add( WideScalarT& acc, const WideScalarT& x )
+{
+    mpn_add_n(acc.data, acc.data, x.data, WideScalarT::N);
+}
+
+
+/**
+* Point on the twisted Edwards curve `a*x^2 + y^2 = 1 + d*x^2*y^2`, in
+* extended coordinates, where `x = X/Z`, `y = Y/Z` and `T = X*Y/Z`
+*
+* The addition and doubling formulas are from "Twisted Edwards Curves
+* Revisited" (Hisil, Wong, Carter & Dawson, 2008), they are complete for
+* Baby Jubjub, so no special cases are needed for the identity or doubling.
+*/
+class ExtendedPoint
+{
+public:
+    ethsnarks::FieldT X;
+    ethsnarks::FieldT Y;
+    ethsnarks::FieldT T;
+    ethsnarks::FieldT Z;
+
+    // Identity, (0, 1)
+    ExtendedPoint() :
+        X(ethsnarks::FieldT::zero()),
+        Y(ethsnarks::FieldT::one()),
+        T(ethsnarks::FieldT::zero()),
+        Z(ethsnarks::FieldT::one())
+    { }
+
+    ExtendedPoint( const ethsnarks::jubjub::EdwardsPoint& p ) :
+        X(p.x), Y(p.y), T(p.x * p.y), Z(ethsnarks::FieldT::one())
+    { }
+
+    ExtendedPoint(
+        const ethsnarks::FieldT& in_X, const ethsnarks::FieldT& in_Y,
+        const ethsnarks::FieldT& in_T, const ethsnarks::FieldT& in_Z
+    ) :
+        X(in_X), Y(in_Y), T(in_T), Z(in_Z)
+    { }
+
+    const ethsnarks::jubjub::EdwardsPoint to_affine() const
+    {
+        const auto Z_inv = Z.inverse();
+        return ethsnarks::jubjub::EdwardsPoint(X * Z_inv, Y * Z_inv);
+    }
+
+    bool is_zero() const
+    {
+        return X.is_zero() && Y == Z;
+    }
+
+    bool operator==( const ExtendedPoint& other ) const
+    {
+        return (X * other.Z) == (other.X * Z)
+            && (Y * other.Z) == (other.Y * Z);
+    }
+
+    const ExtendedPoint neg() const
+    {
+        return ExtendedPoint(-X, Y, -T, Z);
+    }
+
+    const ExtendedPoint add( const ExtendedPoint& other, const ethsnarks::jubjub::Params& params ) const
+    {
+        const auto A = X * other.X;
+        const auto B = Y * other.Y;
+        const auto C = params.d * T * other.T;
+        const auto D = Z * other.Z;
+        const auto E = ((X + Y) * (other.X + other.Y)) - A - B;
+        const auto F = D - C;
+        const auto G = D + C;
+        const auto H = B - (params.a * A);
+        return ExtendedPoint(E * F, G * H, E * H, F * G);
+    }
+
+    const ExtendedPoint dbl( const ethsnarks::jubjub::Params& params ) const
+    {
+        const auto A = X.squared();
+        const auto B = Y.squared();
+        const auto C = Z.squared() + Z.squared();
+        const auto D = params.a * A;
+        const auto E = (X + Y).squared() - A - B;
+        const auto G = D + B;
+        const auto F = G - C;
+        const auto H = D - B;
+        return ExtendedPoint(E * F, G * H, E * H, F * G);
+    }
+};
+
+
+static bool is_on_curve( const ethsnarks::jubjub::EdwardsPoint& p, const ethsnarks::jubjub::Params& params )
+{
+    const auto x2 = p.x.squared();
+    const auto y2 = p.y.squared();
+    return (params.a * x2) + y2 == ethsnarks::FieldT::one() + (params.d * x2 * y2);
+}
+
+
+/**
+* Multiply a point by an unreduced integer scalar, using double-and-add
+*/
+template<mp_size_t N>
+static const ExtendedPoint scalar_mul( const ExtendedPoint& p, const libff::bigint<N>& k, const ethsnarks::jubjub::Params& params )
+{
+    ExtendedPoint result;
+    for( size_t i = k.num_bits(); i-- > 0; )
+    {
+        result = result.dbl(params);
+        if( k.test_bit(i) ) {
+            result = result.add(p, params);
+        }
+    }
+    return result;
+}
+
+
+/**
+* Extract `width` bits of `k`, starting at bit `offset`
+*/
+template<mp_size_t N>
+static inline size_t scalar_window( const libff::bigint<N>& k, size_t offset, size_t width )
+{
+    const size_t limb = offset / GMP_NUMB_BITS;
+    const size_t shift = offset % GMP_NUMB_BITS;
+    if( limb >= size_t(N) ) {
+        return 0;
+    }
+
+    mp_limb_t bits = k.data[limb] >> shift;
+    if( shift + width > GMP_NUMB_BITS && limb + 1 < size_t(N) ) {
+        bits |= k.data[limb + 1] << (GMP_NUMB_BITS - shift);
+    }
+    return size_t(bits) & ((size_t(1) << width) - 1);
+}
+
+
+/**
+* Precomputed multiples of a fixed base point
+*
+* For every window `j` of `WINDOW` bits the table holds `d * 2^(WINDOW*j) * B`
+* for `d` in `1 .. 2^WINDOW - 1`, so multiplying by a scalar is one addition
+* per non-zero window and no doublings. The entries are normalised to Z = 1.
+*/
+class FixedBaseTable
+{
+public:
+    static const size_t WINDOW = 4;
+    static const size_t WINDOW_SIZE = (1 << WINDOW) - 1;
+
+    const size_t m_num_bits;
+    std::vector<ExtendedPoint> m_table;
+
+    FixedBaseTable( const ExtendedPoint& base, size_t num_bits, const ethsnarks::jubjub::Params& params ) :
+        m_num_bits(num_bits)
+    {
+        const size_t windows = (num_bits + WINDOW - 1) / WINDOW;
+        m_table.reserve(windows * WINDOW_SIZE);
+
+        ExtendedPoint window_base = base;
+        for( size_t j = 0; j < windows; j++ )
+        {
+            ExtendedPoint multiple = window_base;
+            for( size_t d = 1; d <= WINDOW_SIZE; d++ )
+            {
+                m_table.emplace_back(multiple.to_affine());
+                multiple = multiple.add(window_base, params);
+            }
+
+            // multiple is now 2^WINDOW * window_base
+            window_base = multiple;
+        }
+    }
+
+    template<mp_size_t N>
+    const ExtendedPoint mul( const libff::bigint<N>& k, const ethsnarks::jubjub::Params& params ) const
+    {
+        assert( k.num_bits() <= m_num_bits );
+
+        ExtendedPoint result;
+        for( size_t j = 0; j < m_table.size() / WINDOW_SIZE; j++ )
+        {
+            const auto d = scalar_window(k, j * WINDOW, WINDOW);
+            if( d ) {
+                result = result.add(m_table[(j * WINDOW_SIZE) + d - 1], params);
+            }
+        }
+        return result;
+    }
+};
+
+
+/**
+* Process-wide table for the EdDSA base point `(params.Gx, params.Gy)`,
+* created on first use and shared by everything computing multiples of it.
+*
+* The tables are keyed by the base point, so different parameters get
+* their own. This is `inline` rather than `static`, so there is one cache
+* for the whole program rather than one per translation unit.
+*/
+inline const FixedBaseTable& eddsa_base_table( const ethsnarks::jubjub::Params& params )
+{
+    struct Entry
+    {
+        ethsnarks::FieldT x;
+        ethsnarks::FieldT y;
+        std::unique_ptr<FixedBaseTable> table;
+    };
+
+    static std::mutex mutex;
+    static std::vector<Entry> tables;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for( const auto& entry : tables )
+    {
+        if( entry.x == params.Gx && entry.y == params.Gy ) {
+            return *entry.table;
+        }
+    }
+
+    tables.emplace_back(Entry{params.Gx, params.Gy, std::unique_ptr<FixedBaseTable>(new FixedBaseTable(
+        ExtendedPoint(ethsnarks::jubjub::EdwardsPoint(params.Gx, params.Gy)),
+        WideScalarT::N * GMP_NUMB_BITS,
+        params))});
+    return *tables.back().table;
+}
+
+
+/**
+* Multi-scalar multiplication, `sum(scalars[i] * points[i])`
+*
+* Uses Pippenger's bucket method: for each window of `c` bits the points are
+* added into one of `2^c - 1` buckets by the value of their scalar's window,
+* then the buckets are summed with a running total. With `n` points this is
+* roughly `b/c * (n + 2^c)` additions for `b` bit scalars, rather than `b`
+* additions per point.
+*/
+static const ExtendedPoint multi_scalar_mul(
+    const std::vector<ExtendedPoint>& points,
+    const std::vector<WideScalarT>& scalars,
+    const ethsnarks::jubjub::Params& params
+) {
+    assert( points.size() == scalars.size() );
+
+    size_t num_bits = 0;
+    for( const auto& k : scalars ) {
+        num_bits = std::max(num_bits, k.num_bits());
+    }
+
+    // Window size is approximately log2(n) - 2, the optimum for large n
+    size_t c = 2;
+    while( (size_t(1) << (c + 3)) <= points.size() ) {
+        c++;
+    }
+
+    std::vector<ExtendedPoint> buckets((size_t(1) << c) - 1);
+    ExtendedPoint result;
+    for( size_t w = (num_bits + c - 1) / c; w-- > 0; )
+    {
+        for( size_t i = 0; i < c; i++ ) {
+            result = result.dbl(params);
+        }
+
+        std::fill(buckets.begin(), buckets.end(), ExtendedPoint());
+        for( size_t i = 0; i < points.size(); i++ )
+        {
+            const auto index = scalar_window(scalars[i], w * c, c);
+            if( index ) {
+                buckets[index - 1] = buckets[index - 1].add(points[i], params);
+            }
+        }
+
+        // sum(j * buckets[j-1])
+        ExtendedPoint running;
+        ExtendedPoint sum;
+        for( size_t j = buckets.size(); j-- > 0; )
+        {
+            running = running.add(buckets[j], params);
+            sum = sum.add(running, params);
+        }
+
+        result = result.add(sum, params);
+    }
+
+    return result;
+}
+
+
+// namespace snasma
+}
+
+// EDWARDS_HPP_
+#endif
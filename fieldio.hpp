@@ -0,0 +1,289 @@
+#ifndef FIELDIO_HPP_
+#define FIELDIO_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "ethsnarks.hpp"
+#include "jubjub/point.hpp"
+
+#include <cstring>
+#include <istream>
+#include <ostream>
+
+
+namespace snasma {
+
+
+/**
+* Text encoding of field elements, as decimal or `0x` prefixed hexadecimal
+* integers, without going through GMP.
+*
+* The libff string conversions allocate GMP integers for every element, and
+* parsing a text transaction converts around 60. Here the digits are
+* accumulated directly into the 4 limbs, 19 decimal digits at a time with a
+* 64x64 bit multiply, then converted into Montgomery form with a single
+* multiplication. Printing does the reverse, dividing by 10^19.
+*/
+static const size_t FIELD_DEC_MAX = 78;
+static const size_t FIELD_HEX_MAX = 2 + 64;
+static const size_t FIELD_TEXT_MAX = 128;
+
+typedef libff::bigint<ethsnarks::FieldT::num_limbs> FieldBigintT;
+typedef unsigned __int128 uint128_t;
+
+static const uint64_t DEC_CHUNK_DIGITS = 19;
+static const uint64_t DEC_CHUNK = 10000000000000000000ULL;
+
+
+/**
+* Returns true if `value` is a canonical field element, less than the modulus
+*/
+static bool below_modulus( const FieldBigintT& value )
+{
+    static_assert(sizeof(mp_limb_t) == 8, "64bit limbs required");
+
+    for( size_t i = ethsnarks::FieldT::num_limbs; i-- > 0; )
+    {
+        if( value.data[i] != ethsnarks::FieldT::mod.data[i] ) {
+            return value.data[i] < ethsnarks::FieldT::mod.data[i];
+        }
+    }
+    return false;
+}
+
+
+/**
+* Parse a decimal integer, which must be less than the modulus
+*/
+static bool parse_field_dec( const char *s, size_t length, ethsnarks::FieldT& out )
+{
+    if( length == 0 ) {
+        return false;
+    }
+
+    FieldBigintT value;
+    value.clear();
+
+    // The first chunk takes the odd digits, so the rest are all full
+    size_t chunk_length = length % DEC_CHUNK_DIGITS;
+    if( chunk_length == 0 ) {
+        chunk_length = DEC_CHUNK_DIGITS;
+    }
+
+    for( size_t offset = 0; offset < length; offset += chunk_length, chunk_length = DEC_CHUNK_DIGITS )
+    {
+        uint64_t chunk = 0;
+        uint64_t scale = 1;
+        for( size_t i = offset; i < offset + chunk_length; i++ )
+        {
+            const unsigned digit = unsigned(s[i]) - '0';
+            if( digit > 9 ) {
+                return false;
+            }
+            chunk = (chunk * 10) + digit;
+            scale *= 10;
+        }
+
+        uint64_t carry = chunk;
+        for( size_t i = 0; i < ethsnarks::FieldT::num_limbs; i++ )
+        {
+            const uint128_t t = (uint128_t(value.data[i]) * scale) + carry;
+            value.data[i] = uint64_t(t);
+            carry = uint64_t(t >> 64);
+        }
+
+        if( carry != 0 ) {
+            return false;
+        }
+    }
+
+    if( ! below_modulus(value) ) {
+        return false;
+    }
+
+    out = ethsnarks::FieldT(value);
+    return true;
+}
+
+
+/**
+* Parse a hexadecimal integer, with the `0x` prefix, which must be less than
+* the modulus
+*/
+static bool parse_field_hex( const char *s, size_t length, ethsnarks::FieldT& out )
+{
+    if( length < 3 || s[0] != '0' || (s[1] != 'x' && s[1] != 'X') ) {
+        return false;
+    }
+
+    FieldBigintT value;
+    value.clear();
+
+    const auto top = ethsnarks::FieldT::num_limbs - 1;
+    for( size_t i = 2; i < length; i++ )
+    {
+        const char c = s[i];
+        uint64_t nibble;
+        if( c >= '0' && c <= '9' ) {
+            nibble = uint64_t(c - '0');
+        }
+        else if( c >= 'a' && c <= 'f' ) {
+            nibble = uint64_t(c - 'a' + 10);
+        }
+        else if( c >= 'A' && c <= 'F' ) {
+            nibble = uint64_t(c - 'A' + 10);
+        }
+        else {
+            return false;
+        }
+
+        if( (value.data[top] >> 60) != 0 ) {
+            return false;
+        }
+
+        for( size_t j = top; j > 0; j-- ) {
+            value.data[j] = (value.data[j] << 4) | (value.data[j - 1] >> 60);
+        }
+        value.data[0] = (value.data[0] << 4) | nibble;
+    }
+
+    if( ! below_modulus(value) ) {
+        return false;
+    }
+
+    out = ethsnarks::FieldT(value);
+    return true;
+}
+
+
+/**
+* Parse either a decimal or `0x` prefixed hexadecimal integer
+*/
+static bool parse_field( const char *s, size_t length, ethsnarks::FieldT& out )
+{
+    if( length > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X') ) {
+        return parse_field_hex(s, length, out);
+    }
+    return parse_field_dec(s, length, out);
+}
+
+
+/**
+* Write `x` as a decimal integer, `p` must have room for `FIELD_DEC_MAX`
+*
+* @return Number of characters written
+*/
+static size_t format_field_dec( char *p, const ethsnarks::FieldT& x )
+{
+    auto value = x.as_bigint();
+
+    // Least significant chunk first
+    uint64_t chunks[(FIELD_DEC_MAX + DEC_CHUNK_DIGITS - 1) / DEC_CHUNK_DIGITS];
+    size_t n_chunks = 0;
+    do {
+        uint64_t rem = 0;
+        for( size_t i = ethsnarks::FieldT::num_limbs; i-- > 0; )
+        {
+            const uint128_t t = (uint128_t(rem) << 64) | value.data[i];
+            value.data[i] = uint64_t(t / DEC_CHUNK);
+            rem = uint64_t(t % DEC_CHUNK);
+        }
+        chunks[n_chunks++] = rem;
+    } while( ! value.is_zero() );
+
+    // Only the most significant chunk isn't zero padded
+    char digits[DEC_CHUNK_DIGITS];
+    size_t n_digits = 0;
+    for( auto chunk = chunks[n_chunks - 1]; n_digits == 0 || chunk != 0; chunk /= 10 ) {
+        digits[n_digits++] = char('0' + (chunk % 10));
+    }
+
+    size_t length = 0;
+    while( n_digits > 0 ) {
+        p[length++] = digits[--n_digits];
+    }
+
+    for( size_t i = n_chunks - 1; i-- > 0; )
+    {
+        auto chunk = chunks[i];
+        for( size_t j = DEC_CHUNK_DIGITS; j-- > 0; chunk /= 10 ) {
+            p[length + j] = char('0' + (chunk % 10));
+        }
+        length += DEC_CHUNK_DIGITS;
+    }
+
+    return length;
+}
+
+
+/**
+* Write `x` as a `0x` prefixed lower-case hexadecimal integer, without
+* leading zeros, `p` must have room for `FIELD_HEX_MAX`
+*
+* @return Number of characters written
+*/
+static size_t format_field_hex( char *p, const ethsnarks::FieldT& x )
+{
+    static const char hex_digits[] = "0123456789abcdef";
+    const auto value = x.as_bigint();
+
+    size_t length = 0;
+    p[length++] = '0';
+    p[length++] = 'x';
+    for( size_t i = ethsnarks::FieldT::num_limbs * 16; i-- > 0; )
+    {
+        const auto nibble = (value.data[i / 16] >> ((i % 16) * 4)) & 0xF;
+        if( nibble != 0 || length > 2 || i == 0 ) {
+            p[length++] = hex_digits[nibble];
+        }
+    }
+
+    return length;
+}
+
+
+/**
+* Read a whitespace delimited field element, either decimal or `0x` prefixed
+* hexadecimal, setting the failbit if it isn't valid
+*/
+static std::istream& read_field( std::istream& is, ethsnarks::FieldT& out )
+{
+    char buf[FIELD_TEXT_MAX];
+    is.width(sizeof(buf));
+    if( ! (is >> buf) ) {
+        return is;
+    }
+
+    // A token filling the buffer may have been truncated
+    const auto length = strlen(buf);
+    if( length >= (sizeof(buf) - 1) || ! parse_field(buf, length, out) ) {
+        is.setstate(std::ios::failbit);
+    }
+
+    return is;
+}
+
+
+static std::istream& read_point( std::istream& is, ethsnarks::jubjub::EdwardsPoint& out )
+{
+    return read_field(read_field(is, out.x), out.y);
+}
+
+
+/**
+* Write a field element as a decimal integer, the same format read by
+* `read_field` and written by `snasma.py`
+*/
+static std::ostream& write_field( std::ostream& os, const ethsnarks::FieldT& x )
+{
+    char buf[FIELD_DEC_MAX];
+    return os.write(buf, format_field_dec(buf, x));
+}
+
+
+// namespace snasma
+}
+
+// FIELDIO_HPP_
+#endif
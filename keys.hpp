@@ -0,0 +1,504 @@
+#ifndef KEYS_HPP_
+#define KEYS_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "ethsnarks.hpp"
+#include "txfile.hpp"
+
+#include <libsnark/zk_proof_systems/ppzksnark/r1cs_gg_ppzksnark/r1cs_gg_ppzksnark.hpp>
+#include <libfqfft/evaluation_domain/get_evaluation_domain.hpp>
+
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace snasma {
+
+
+typedef libsnark::r1cs_gg_ppzksnark_proving_key<ethsnarks::ppT> ProvingKeyT;
+typedef libff::G1<ethsnarks::ppT> G1T;
+typedef libff::G2<ethsnarks::ppT> G2T;
+typedef libff::Fq<ethsnarks::ppT> FqT;
+
+
+/**
+* Proving key file
+*
+* The proving key is stored as raw Jacobian coordinates in Montgomery form,
+* exactly as they are held in memory, so loading is a copy rather than
+* parsing, range checking and decompressing every point. The points are not
+* validated when loading, instead the header holds an optional checksum of
+* everything that follows it.
+*
+* The constraint system isn't stored, the prover re-creates it from the
+* circuit, the number of constraints and variables ensure they match.
+*
+* The raw coordinates are in host byte order, the element sizes in the header
+* make sure the file is only used by a build with the same representation.
+*
+*   offset  size
+*   0       8       magic "SNASMAPK"
+*   8       4       version
+*   12      4       number of transactions
+*   16      8       number of constraints
+*   24      8       number of variables
+*   32      4       size of a raw G1 point
+*   36      4       size of a raw G2 point
+*   40      8       A query size
+*   48      8       B query size
+*   56      8       B query domain size
+*   64      8       H query size
+*   72      8       L query size
+*   80      8       checksum, or 0 if none
+*   88      40      reserved
+*
+* Followed by these sections, each starting on a 64 byte boundary:
+*
+*   alpha_g1, beta_g1, delta_g1, beta_g2, delta_g2
+*   A query, G1 points
+*   B query indices, 64bit integers
+*   B query values, G2 point then G1 point
+*   H query, G1 points
+*   L query, G1 points
+*/
+static const char PROVINGKEY_MAGIC[8] = {'S', 'N', 'A', 'S', 'M', 'A', 'P', 'K'};
+static const uint32_t PROVINGKEY_VERSION = 2;
+static const size_t PROVINGKEY_HEADER_SIZE = 128;
+static const size_t PROVINGKEY_ALIGN = 64;
+
+static const size_t RAW_FQ_SIZE = sizeof(FqT::mont_repr);
+static const size_t RAW_G1_SIZE = 3 * RAW_FQ_SIZE;
+static const size_t RAW_G2_SIZE = 6 * RAW_FQ_SIZE;
+
+
+struct ProvingKeyHeader
+{
+    uint32_t version;
+    uint32_t n;
+    uint64_t num_constraints;
+    uint64_t num_variables;
+    uint32_t g1_size;
+    uint32_t g2_size;
+    uint64_t A_size;
+    uint64_t B_size;
+    uint64_t B_domain_size;
+    uint64_t H_size;
+    uint64_t L_size;
+    uint64_t checksum;
+};
+
+
+static inline size_t align_pk_offset( size_t offset )
+{
+    return (offset + PROVINGKEY_ALIGN - 1) & ~(PROVINGKEY_ALIGN - 1);
+}
+
+
+/**
+* Offsets of each section, derived from the sizes in the header
+*/
+struct ProvingKeyLayout
+{
+    size_t fixed;
+    size_t A_query;
+    size_t B_indices;
+    size_t B_values;
+    size_t H_query;
+    size_t L_query;
+    size_t end;
+
+    ProvingKeyLayout( const ProvingKeyHeader& header )
+    {
+        fixed = PROVINGKEY_HEADER_SIZE;
+        A_query = align_pk_offset(fixed + (3 * RAW_G1_SIZE) + (2 * RAW_G2_SIZE));
+        B_indices = align_pk_offset(A_query + (header.A_size * RAW_G1_SIZE));
+        B_values = align_pk_offset(B_indices + (header.B_size * sizeof(uint64_t)));
+        H_query = align_pk_offset(B_values + (header.B_size * (RAW_G2_SIZE + RAW_G1_SIZE)));
+        L_query = align_pk_offset(H_query + (header.H_size * RAW_G1_SIZE));
+        end = L_query + (header.L_size * RAW_G1_SIZE);
+    }
+};
+
+
+static inline uint8_t *encode_raw( uint8_t *p, const FqT& x )
+{
+    memcpy(p, x.mont_repr.data, RAW_FQ_SIZE);
+    return p + RAW_FQ_SIZE;
+}
+
+static inline const uint8_t *decode_raw( const uint8_t *p, FqT& x )
+{
+    memcpy(x.mont_repr.data, p, RAW_FQ_SIZE);
+    return p + RAW_FQ_SIZE;
+}
+
+static inline uint8_t *encode_raw( uint8_t *p, const G1T& point )
+{
+    return encode_raw(encode_raw(encode_raw(p, point.X), point.Y), point.Z);
+}
+
+static inline const uint8_t *decode_raw( const uint8_t *p, G1T& point )
+{
+    return decode_raw(decode_raw(decode_raw(p, point.X), point.Y), point.Z);
+}
+
+static inline uint8_t *encode_raw( uint8_t *p, const G2T& point )
+{
+    p = encode_raw(encode_raw(p, point.X.c0), point.X.c1);
+    p = encode_raw(encode_raw(p, point.Y.c0), point.Y.c1);
+    return encode_raw(encode_raw(p, point.Z.c0), point.Z.c1);
+}
+
+static inline const uint8_t *decode_raw( const uint8_t *p, G2T& point )
+{
+    p = decode_raw(decode_raw(p, point.X.c0), point.X.c1);
+    p = decode_raw(decode_raw(p, point.Y.c0), point.Y.c1);
+    return decode_raw(decode_raw(p, point.Z.c0), point.Z.c1);
+}
+
+static inline uint8_t *encode_raw( uint8_t *p, const libsnark::knowledge_commitment<G2T, G1T>& kc )
+{
+    return encode_raw(encode_raw(p, kc.g), kc.h);
+}
+
+static inline const uint8_t *decode_raw( const uint8_t *p, libsnark::knowledge_commitment<G2T, G1T>& kc )
+{
+    return decode_raw(decode_raw(p, kc.g), kc.h);
+}
+
+static inline uint8_t *encode_raw( uint8_t *p, const size_t& index )
+{
+    store_le64(p, index);
+    return p + sizeof(uint64_t);
+}
+
+static inline const uint8_t *decode_raw( const uint8_t *p, size_t& index )
+{
+    index = size_t(load_le64(p));
+    return p + sizeof(uint64_t);
+}
+
+
+static void encode_proving_key_header( uint8_t *buf, const ProvingKeyHeader& header )
+{
+    memset(buf, 0, PROVINGKEY_HEADER_SIZE);
+    memcpy(buf, PROVINGKEY_MAGIC, sizeof(PROVINGKEY_MAGIC));
+    store_le32(buf + 8, header.version);
+    store_le32(buf + 12, header.n);
+    store_le64(buf + 16, header.num_constraints);
+    store_le64(buf + 24, header.num_variables);
+    store_le32(buf + 32, header.g1_size);
+    store_le32(buf + 36, header.g2_size);
+    store_le64(buf + 40, header.A_size);
+    store_le64(buf + 48, header.B_size);
+    store_le64(buf + 56, header.B_domain_size);
+    store_le64(buf + 64, header.H_size);
+    store_le64(buf + 72, header.L_size);
+    store_le64(buf + 80, header.checksum);
+}
+
+
+static bool decode_proving_key_header( const uint8_t *buf, size_t length, ProvingKeyHeader& header )
+{
+    if( length < PROVINGKEY_HEADER_SIZE || memcmp(buf, PROVINGKEY_MAGIC, sizeof(PROVINGKEY_MAGIC)) != 0 ) {
+        std::cerr << "error proving key: bad magic" << endl;
+        return false;
+    }
+
+    header.version = load_le32(buf + 8);
+    header.n = load_le32(buf + 12);
+    header.num_constraints = load_le64(buf + 16);
+    header.num_variables = load_le64(buf + 24);
+    header.g1_size = load_le32(buf + 32);
+    header.g2_size = load_le32(buf + 36);
+    header.A_size = load_le64(buf + 40);
+    header.B_size = load_le64(buf + 48);
+    header.B_domain_size = load_le64(buf + 56);
+    header.H_size = load_le64(buf + 64);
+    header.L_size = load_le64(buf + 72);
+    header.checksum = load_le64(buf + 80);
+
+    if( header.version != PROVINGKEY_VERSION ) {
+        std::cerr << "error proving key: unsupported version " << header.version << ", regenerate the keys" << endl;
+        return false;
+    }
+
+    if( header.g1_size != RAW_G1_SIZE || header.g2_size != RAW_G2_SIZE ) {
+        std::cerr << "error proving key: point representation differs from this build" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+* Check the section sizes of the header against the file length, and that
+* they are consistent with the number of constraints and variables.
+*
+* Each count is bounded by the length first, so the offsets computed by
+* `ProvingKeyLayout` can't overflow.
+*/
+static bool check_proving_key_sizes( const ProvingKeyHeader& header, size_t length )
+{
+    const auto remaining = length - PROVINGKEY_HEADER_SIZE;
+    if( header.num_variables >= remaining / RAW_G1_SIZE
+     || header.A_size > remaining / RAW_G1_SIZE
+     || header.B_size > remaining / (sizeof(uint64_t) + RAW_G2_SIZE + RAW_G1_SIZE)
+     || header.H_size > remaining / RAW_G1_SIZE
+     || header.L_size > remaining / RAW_G1_SIZE ) {
+        std::cerr << "error proving key: truncated" << endl;
+        return false;
+    }
+
+    // The A query and B query domain have one element per variable, and the constant
+    if( header.A_size != header.num_variables + 1
+     || header.B_domain_size != header.num_variables + 1
+     || header.B_size > header.B_domain_size
+     || header.L_size > header.num_variables
+     || header.H_size < header.num_constraints ) {
+        std::cerr << "error proving key: section sizes don't match the constraints and variables" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+* Check the loaded key has exactly the H and L queries the prover will use
+* for the constraint system, they depend on the evaluation domain and the
+* number of inputs, which aren't in the header.
+*/
+static bool proving_key_matches( const ProvingKeyT& pk, const libsnark::r1cs_constraint_system<ethsnarks::FieldT>& cs )
+{
+    const auto domain = libfqfft::get_evaluation_domain<ethsnarks::FieldT>(cs.num_constraints() + cs.num_inputs() + 1);
+    if( pk.H_query.size() != domain->m - 1 || pk.L_query.size() != cs.num_variables() - cs.num_inputs() ) {
+        std::cerr << "error proving key: H or L query doesn't match the constraint system" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+* Read only the header, to find the circuit size before loading the key
+*/
+static bool read_proving_key_header( const char *path, ProvingKeyHeader& header )
+{
+    uint8_t buf[PROVINGKEY_HEADER_SIZE];
+    std::ifstream in(path, std::ios::binary);
+    if( ! in.is_open() ) {
+        std::cerr << "error proving key: cannot open " << path << endl;
+        return false;
+    }
+
+    if( ! in.read((char*)buf, sizeof(buf)) ) {
+        std::cerr << "error proving key: truncated header " << path << endl;
+        return false;
+    }
+
+    return decode_proving_key_header(buf, sizeof(buf), header);
+}
+
+
+/**
+* Writes a section in chunks, padded to the next section boundary
+*/
+template<typename T>
+static bool write_pk_section( std::ostream& out, size_t& offset, uint64_t& checksum, const std::vector<T>& items, size_t item_size )
+{
+    const size_t chunk_items = 4096;
+    std::vector<uint8_t> buf(chunk_items * item_size);
+
+    for( size_t i = 0; i < items.size(); i += chunk_items )
+    {
+        const auto count = std::min(chunk_items, items.size() - i);
+        uint8_t *p = buf.data();
+        for( size_t j = 0; j < count; j++ ) {
+            p = encode_raw(p, items[i + j]);
+        }
+
+        const auto length = size_t(p - buf.data());
+        checksum = checksum_update(checksum, buf.data(), length);
+        if( ! out.write((const char*)buf.data(), length) ) {
+            return false;
+        }
+        offset += length;
+    }
+
+    const uint8_t padding[PROVINGKEY_ALIGN] = {0};
+    const auto padding_length = align_pk_offset(offset) - offset;
+    checksum = checksum_update(checksum, padding, padding_length);
+    offset += padding_length;
+    return bool(out.write((const char*)padding, padding_length));
+}
+
+
+static bool write_proving_key( const char *path, size_t n, const ProvingKeyT& pk )
+{
+    std::ofstream out(path, std::ios::binary);
+
+    ProvingKeyHeader header;
+    header.version = PROVINGKEY_VERSION;
+    header.n = uint32_t(n);
+    header.num_constraints = pk.constraint_system.num_constraints();
+    header.num_variables = pk.constraint_system.num_variables();
+    header.g1_size = RAW_G1_SIZE;
+    header.g2_size = RAW_G2_SIZE;
+    header.A_size = pk.A_query.size();
+    header.B_size = pk.B_query.values.size();
+    header.B_domain_size = pk.B_query.domain_size();
+    header.H_size = pk.H_query.size();
+    header.L_size = pk.L_query.size();
+    header.checksum = 0;
+
+    // Header is re-written with the checksum once everything else is written
+    uint8_t buf[PROVINGKEY_HEADER_SIZE];
+    encode_proving_key_header(buf, header);
+    bool ok = bool(out.write((const char*)buf, sizeof(buf)));
+
+    // Fixed points, padded up to the first query
+    std::vector<uint8_t> fixed(ProvingKeyLayout(header).A_query - PROVINGKEY_HEADER_SIZE, 0);
+    uint8_t *p = fixed.data();
+    p = encode_raw(p, pk.alpha_g1);
+    p = encode_raw(p, pk.beta_g1);
+    p = encode_raw(p, pk.delta_g1);
+    p = encode_raw(p, pk.beta_g2);
+    encode_raw(p, pk.delta_g2);
+
+    uint64_t checksum = checksum_update(CHECKSUM_INIT, fixed.data(), fixed.size());
+    size_t offset = PROVINGKEY_HEADER_SIZE + fixed.size();
+    ok = ok
+      && out.write((const char*)fixed.data(), fixed.size())
+      && write_pk_section(out, offset, checksum, pk.A_query, RAW_G1_SIZE)
+      && write_pk_section(out, offset, checksum, pk.B_query.indices, sizeof(uint64_t))
+      && write_pk_section(out, offset, checksum, pk.B_query.values, RAW_G2_SIZE + RAW_G1_SIZE)
+      && write_pk_section(out, offset, checksum, pk.H_query, RAW_G1_SIZE)
+      && write_pk_section(out, offset, checksum, pk.L_query, RAW_G1_SIZE);
+
+    if( ok ) {
+        header.checksum = checksum;
+        encode_proving_key_header(buf, header);
+        ok = out.seekp(0) && out.write((const char*)buf, sizeof(buf));
+    }
+
+    if( ! ok ) {
+        std::cerr << "error proving key: cannot write " << path << endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+* Copies a section of the mapped file into a vector, in parallel when
+* built with MULTICORE as each element is independent.
+*/
+template<typename T>
+static void read_pk_section( const uint8_t *data, size_t count, size_t item_size, std::vector<T>& out )
+{
+    out.resize(count);
+
+#ifdef MULTICORE
+    #pragma omp parallel for
+#endif
+    for( size_t i = 0; i < count; i++ ) {
+        decode_raw(data + (i * item_size), out[i]);
+    }
+}
+
+
+/**
+* Loads the proving key by memory mapping the file and copying the points
+* directly into the key, without the constraint system.
+*
+* @param verify_checksum Compare the checksum of the whole file against the header
+*/
+static bool read_proving_key( const char *path, ProvingKeyHeader& header, ProvingKeyT& pk, bool verify_checksum )
+{
+    const int fd = ::open(path, O_RDONLY);
+    if( fd < 0 ) {
+        std::cerr << "error proving key: cannot open " << path << endl;
+        return false;
+    }
+
+    struct stat st;
+    if( fstat(fd, &st) != 0 ) {
+        std::cerr << "error proving key: cannot stat " << path << endl;
+        ::close(fd);
+        return false;
+    }
+
+    const auto length = size_t(st.st_size);
+    void *addr = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if( addr == MAP_FAILED ) {
+        std::cerr << "error proving key: cannot mmap " << path << endl;
+        return false;
+    }
+
+    madvise(addr, length, MADV_SEQUENTIAL);
+    const auto data = (const uint8_t*)addr;
+
+    bool ok = decode_proving_key_header(data, length, header) && check_proving_key_sizes(header, length);
+    const ProvingKeyLayout layout(ok ? header : ProvingKeyHeader());
+    if( ok && layout.end > length ) {
+        std::cerr << "error proving key: truncated " << path << endl;
+        ok = false;
+    }
+
+    if( ok && verify_checksum && header.checksum != 0 ) {
+        const auto checksum = checksum_update(CHECKSUM_INIT, data + PROVINGKEY_HEADER_SIZE, layout.end - PROVINGKEY_HEADER_SIZE);
+        if( checksum != header.checksum ) {
+            std::cerr << "error proving key: checksum mismatch " << path << endl;
+            ok = false;
+        }
+    }
+
+    if( ok )
+    {
+        const uint8_t *p = data + layout.fixed;
+        p = decode_raw(p, pk.alpha_g1);
+        p = decode_raw(p, pk.beta_g1);
+        p = decode_raw(p, pk.delta_g1);
+        p = decode_raw(p, pk.beta_g2);
+        decode_raw(p, pk.delta_g2);
+
+        read_pk_section(data + layout.A_query, header.A_size, RAW_G1_SIZE, pk.A_query);
+        read_pk_section(data + layout.B_indices, header.B_size, sizeof(uint64_t), pk.B_query.indices);
+
+        // The prover indexes the assignment with these, they must be in order and in range
+        for( size_t i = 0; ok && i < pk.B_query.indices.size(); i++ )
+        {
+            if( pk.B_query.indices[i] >= header.B_domain_size || (i > 0 && pk.B_query.indices[i] <= pk.B_query.indices[i - 1]) ) {
+                std::cerr << "error proving key: B query index " << i << " out of order or range " << path << endl;
+                ok = false;
+            }
+        }
+        read_pk_section(data + layout.B_values, header.B_size, RAW_G2_SIZE + RAW_G1_SIZE, pk.B_query.values);
+        pk.B_query.domain_size_ = header.B_domain_size;
+        read_pk_section(data + layout.H_query, header.H_size, RAW_G1_SIZE, pk.H_query);
+        read_pk_section(data + layout.L_query, header.L_size, RAW_G1_SIZE, pk.L_query);
+    }
+
+    munmap(addr, length);
+    return ok;
+}
+
+
+// namespace snasma
+}
+
+// KEYS_HPP_
+#endif
@@ -0,0 +1,135 @@
+#ifndef LADDER_HPP_
+#define LADDER_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "snasma.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Set of circuit sizes which have been built, or have persisted keys
+*
+* A batch is proven with the smallest circuit that fits, padded with no-op
+* transactions, so a batch cut early at low traffic doesn't pay for the
+* largest circuit. Batches are cut when they reach `largest()`.
+*/
+class CircuitLadder
+{
+public:
+    // Ascending, without duplicates
+    std::vector<size_t> m_sizes;
+
+    CircuitLadder() {}
+
+    CircuitLadder( const std::vector<size_t>& sizes ) :
+        m_sizes(sizes)
+    {
+        std::sort(m_sizes.begin(), m_sizes.end());
+        m_sizes.erase(std::unique(m_sizes.begin(), m_sizes.end()), m_sizes.end());
+    }
+
+    /**
+    * Parse a comma separated list of sizes, e.g. "8,32,128,512"
+    *
+    * A single number is a ladder with one size.
+    */
+    static bool parse( const std::string& spec, CircuitLadder& out )
+    {
+        std::vector<size_t> sizes;
+        size_t begin = 0;
+        while( begin <= spec.size() )
+        {
+            auto end = spec.find(',', begin);
+            if( end == std::string::npos ) {
+                end = spec.size();
+            }
+
+            const auto item = spec.substr(begin, end - begin);
+            char *item_end = nullptr;
+            const auto n = strtoul(item.c_str(), &item_end, 10);
+            if( item.empty() || *item_end != '\0' || n < 1 ) {
+                std::cerr << "Error: invalid circuit size '" << item << "' in " << spec << std::endl;
+                return false;
+            }
+
+            sizes.emplace_back(size_t(n));
+            begin = end + 1;
+        }
+
+        out = CircuitLadder(sizes);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return m_sizes.size();
+    }
+
+    size_t largest() const
+    {
+        return m_sizes.back();
+    }
+
+    /**
+    * @return Index of the smallest size which fits `count` transactions,
+    *         or of the largest if none do
+    */
+    size_t select( size_t count ) const
+    {
+        const auto it = std::lower_bound(m_sizes.begin(), m_sizes.end(), count);
+        if( it == m_sizes.end() ) {
+            return m_sizes.size() - 1;
+        }
+        return size_t(it - m_sizes.begin());
+    }
+
+    /**
+    * Keys for each size are kept in one directory, as `pk-<n>.raw` and
+    * `vk-<n>.json`
+    */
+    static const std::string proving_key_path( const std::string& dir, size_t n )
+    {
+        return dir + "/pk-" + std::to_string(n) + ".raw";
+    }
+
+    static const std::string verification_key_path( const std::string& dir, size_t n )
+    {
+        return dir + "/vk-" + std::to_string(n) + ".json";
+    }
+};
+
+
+/**
+* Pad `items` up to `n` transactions with no-ops which follow on from the
+* last transaction, see `make_noop`
+*
+* @return Number of no-ops added
+*/
+static size_t pad_batch( std::vector<TxProof>& items, size_t n, MerkleHasher& hasher, const ethsnarks::jubjub::Params& params )
+{
+    if( items.empty() || items.size() >= n ) {
+        return 0;
+    }
+
+    const auto n_padding = n - items.size();
+    const auto noop = make_noop(items.back(), hasher, params);
+    items.resize(n, noop);
+    return n_padding;
+}
+
+
+// namespace snasma
+}
+
+// LADDER_HPP_
+#endif
@@ -4,26 +4,59 @@
 #include "ethsnarks.hpp"
 #include "utils.hpp"
 #include "stubs.hpp"
+#include "export.hpp"
 #include "jubjub/point.hpp"
 #include "jubjub/eddsa.hpp"
 
 #include "snasma.hpp"
 #include "circuit.hpp"
+#include "txgroup.hpp"
+#include "txfile.hpp"
+#include "compact.hpp"
+#include "stream.hpp"
+#include "keys.hpp"
+#include "ladder.hpp"
+#include "public_input.hpp"
+#include "profile.hpp"
+#include "verify.hpp"
+#include "preflight.hpp"
+#include "r1csfile.hpp"
 
+#include <libsnark/zk_proof_systems/ppzksnark/r1cs_gg_ppzksnark/r1cs_gg_ppzksnark.hpp>
+
+#include <chrono>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <memory>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
+
+#include <errno.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 using std::cerr;
 using std::cout;
 using std::endl;
 using std::ifstream;
+using std::ofstream;
 using std::string;
 using std::istringstream;
 using std::vector;
 
 using namespace ethsnarks;
 
+typedef std::chrono::steady_clock ClockT;
+
+
+static double seconds_between( const ClockT::time_point& start, const ClockT::time_point& end )
+{
+	return std::chrono::duration<double>(end - start).count();
+}
+
 
 /**
 * Display all fields in the transaction
@@ -32,32 +65,33 @@ void print_tx( const snasma::TxProof& p )
 {
 	cout << "Tx:" << endl;
 	cout << "\tFrom IDX: " << p.stx.tx.from_idx << "\n\tTo IDX: " << p.stx.tx.to_idx << "\n\tAmount: " << p.stx.tx.amount << endl;
+	cout << "\tNo-op: " << p.is_noop << endl;
 
-	cout << "Sig:\n\tR.x = "; p.stx.sig.R.x.print();
-	cout << "\tR.y = "; p.stx.sig.R.y.print();
-	cout << "\ts = "; p.stx.sig.s.print();
+	cout << "Sig:\n\tR.x = "; snasma::write_field(cout, p.stx.sig.R.x) << endl;
+	cout << "\tR.y = "; snasma::write_field(cout, p.stx.sig.R.y) << endl;
+	cout << "\ts = "; snasma::write_field(cout, p.stx.sig.s) << endl;
 	cout << "\tnonce = " << p.stx.nonce << endl;
 
 	cout << "From:" << endl;
-	cout << "\tpubkey.x = "; p.state_from.pubkey.x.print();
-	cout << "\tpubkey.y = "; p.state_from.pubkey.y.print();
-	cout << "\tbalance = "; p.state_from.balance.print();
+	cout << "\tpubkey.x = "; snasma::write_field(cout, p.state_from.pubkey.x) << endl;
+	cout << "\tpubkey.y = "; snasma::write_field(cout, p.state_from.pubkey.y) << endl;
+	cout << "\tbalance = "; snasma::write_field(cout, p.state_from.balance) << endl;
 	cout << "\tnonce = " << p.state_from.nonce << endl;
 
 	cout << "To:" << endl;
-	cout << "\tpubkey.x = "; p.state_to.pubkey.x.print();
-	cout << "\tpubkey.y = "; p.state_to.pubkey.y.print();
-	cout << "\tbalance = "; p.state_to.balance.print();
+	cout << "\tpubkey.x = "; snasma::write_field(cout, p.state_to.pubkey.x) << endl;
+	cout << "\tpubkey.y = "; snasma::write_field(cout, p.state_to.pubkey.y) << endl;
+	cout << "\tbalance = "; snasma::write_field(cout, p.state_to.balance) << endl;
 	cout << "\tnonce = " << p.state_to.nonce << endl;
 
 	cout << "Before From path:" << endl;
 	for( size_t i = 0; i < p.before_from.size(); i++ ) {
-		cout << "\t" << i << " : "; p.before_from[i].print();
+		cout << "\t" << i << " : "; snasma::write_field(cout, p.before_from[i]) << endl;
 	}
 
 	cout << "Before To path:" << endl;
 	for( size_t i = 0; i < p.before_to.size(); i++ ) {
-		cout << "\t" << i << " : "; p.before_to[i].print();
+		cout << "\t" << i << " : "; snasma::write_field(cout, p.before_to[i]) << endl;
 	}
 
 	cout << endl;
@@ -67,56 +101,91 @@ void print_tx( const snasma::TxProof& p )
 void print_tx( ProtoboardT& pb, const snasma::TxCircuit& p )
 {
 	cout << "Msg bits len: " << p.sig_m.size() << endl;
-	auto bits = p.m_sig.m_hash_RAM.m_RAM_bits.get_bits(pb);
+	auto bits = p.m_signature.m_sig.m_hash_RAM.m_RAM_bits.get_bits(pb);
 	print_bv(" msg bits", bits);
 
-	cout << "tx_from_idx: "; p.tx_from_idx.get_field_element_from_bits(pb).print();
-	cout << "tx_to_idx: "; p.tx_to_idx.get_field_element_from_bits(pb).print();
+	cout << "tx_from_idx: "; snasma::write_field(cout, p.tx_from_idx.get_field_element_from_bits(pb)) << endl;
+	cout << "tx_to_idx: "; snasma::write_field(cout, p.tx_to_idx.get_field_element_from_bits(pb)) << endl;
 
-	cout << "from_pubkey.x: "; pb.val(p.from_pubkey.x).print();
-	cout << "from_pubkey.y: "; pb.val(p.from_pubkey.y).print();
-	cout << "from_balance: "; pb.val(p.from_balance).print();
-	cout << "next_nonce: "; pb.val(p.next_nonce).print();
+	cout << "from_pubkey.x: "; snasma::write_field(cout, pb.val(p.from_pubkey.x)) << endl;
+	cout << "from_pubkey.y: "; snasma::write_field(cout, pb.val(p.from_pubkey.y)) << endl;
+	cout << "from_balance: "; snasma::write_field(cout, pb.val(p.from_balance)) << endl;
+	cout << "next_nonce: "; snasma::write_field(cout, pb.val(p.next_nonce)) << endl;
 
-	cout << "to_pubkey.x: "; pb.val(p.to_pubkey.x).print();
-	cout << "to_pubkey.y: "; pb.val(p.to_pubkey.y).print();
-	cout << "to_balance: "; pb.val(p.to_balance).print();
-	cout << "to_nonce: "; pb.val(p.to_nonce).print();
+	cout << "to_pubkey.x: "; snasma::write_field(cout, pb.val(p.to_pubkey.x)) << endl;
+	cout << "to_pubkey.y: "; snasma::write_field(cout, pb.val(p.to_pubkey.y)) << endl;
+	cout << "to_balance: "; snasma::write_field(cout, pb.val(p.to_balance)) << endl;
+	cout << "to_nonce: "; snasma::write_field(cout, pb.val(p.to_nonce)) << endl;
+	cout << "is_noop: "; snasma::write_field(cout, pb.val(p.is_noop)) << endl;
 
-	cout << "sig_R.x: "; pb.val(p.sig_R.x).print();
-	cout << "sig_R.y: "; pb.val(p.sig_R.y).print();
-	cout << "sig_nonce: "; pb.val(p.sig_nonce.packed).print();
-	cout << "sig_s: "; p.sig_s.get_field_element_from_bits(pb).print();
+	cout << "sig_R.x: "; snasma::write_field(cout, pb.val(p.m_signature.sig_R.x)) << endl;
+	cout << "sig_R.y: "; snasma::write_field(cout, pb.val(p.m_signature.sig_R.y)) << endl;
+	cout << "sig_nonce: "; snasma::write_field(cout, pb.val(p.sig_nonce.packed)) << endl;
+	cout << "sig_s: "; snasma::write_field(cout, p.m_signature.sig_s.get_field_element_from_bits(pb)) << endl;
 
-	cout << "balance.A: "; pb.val(p.m_balance.A).print();
-	cout << "balance.B: "; pb.val(p.m_balance.B).print();
-	cout << "balance.N: "; pb.val(p.m_balance.N).print();
-	cout << "balance.X: "; pb.val(p.m_balance.X).print();
-	cout << "balance.Y: "; pb.val(p.m_balance.Y).print();
+	cout << "balance.A: "; snasma::write_field(cout, pb.val(p.m_balance.A)) << endl;
+	cout << "balance.B: "; snasma::write_field(cout, pb.val(p.m_balance.B)) << endl;
+	cout << "balance.N: "; snasma::write_field(cout, pb.val(p.m_balance.N)) << endl;
+	cout << "balance.X: "; snasma::write_field(cout, pb.val(p.m_balance.X)) << endl;
+	cout << "balance.Y: "; snasma::write_field(cout, pb.val(p.m_balance.Y)) << endl;
 
-	cout << "balance.N_lt_A: "; pb.val(p.m_balance.N_lt_A).print();
-	cout << "balance.N_leq_A: "; pb.val(p.m_balance.N_leq_A).print();
-	cout << "balance.Y_overflow_lt: "; pb.val(p.m_balance.Y_overflow_lt).print();
-	cout << "balance.Y_overflow_leq: "; pb.val(p.m_balance.Y_overflow_leq).print();
+	cout << "balance.N_lt_A: "; snasma::write_field(cout, pb.val(p.m_balance.N_lt_A)) << endl;
+	cout << "balance.N_leq_A: "; snasma::write_field(cout, pb.val(p.m_balance.N_leq_A)) << endl;
+	cout << "balance.Y_overflow_lt: "; snasma::write_field(cout, pb.val(p.m_balance.Y_overflow_lt)) << endl;
+	cout << "balance.Y_overflow_leq: "; snasma::write_field(cout, pb.val(p.m_balance.Y_overflow_leq)) << endl;
 
-	cout << "m_leaf_before_from: "; pb.val(p.m_leaf_before_from.result()).print();
-	cout << "m_leaf_after_from: "; pb.val(p.m_leaf_after_from.result()).print();
-	cout << "m_leaf_before_to: "; pb.val(p.m_leaf_before_to.result()).print();
-	cout << "m_leaf_after_to: "; pb.val(p.m_leaf_after_to.result()).print();
+	cout << "m_leaf_before_from: "; snasma::write_field(cout, pb.val(p.m_leaf_before_from.result())) << endl;
+	cout << "m_leaf_after_from: "; snasma::write_field(cout, pb.val(p.m_leaf_after_from.result())) << endl;
+	cout << "m_leaf_before_to: "; snasma::write_field(cout, pb.val(p.m_leaf_before_to.result())) << endl;
+	cout << "m_leaf_after_to: "; snasma::write_field(cout, pb.val(p.m_leaf_after_to.result())) << endl;
 }
 
 
-const VariableT setup_circuits( ProtoboardT& pb, jubjub::Params& params, vector<snasma::TxCircuit>& tx_gadgets, int arg_n )
+/**
+* Inputs of a batch, the merkle root before and after
+*
+* The only public input is `input_hash`, which commits to both roots and the
+* on-chain data of every transaction (see `public_input_gadget`). A batch
+* which is split into parts, each proven separately, can be checked to chain
+* from one to the next with `batch_public_input` (see `main_verify_chain`).
+*/
+struct BatchRoots
+{
+	VariableT input_hash;
+	VariableT merkle_root;
+	VariableT new_root;
+	std::shared_ptr<snasma::public_input_gadget> public_input;
+};
+
+
+const BatchRoots setup_circuits( ProtoboardT& pb, jubjub::Params& params, vector<snasma::TxCircuit>& tx_gadgets, int arg_n, snasma::TxCircuitHook* hook = nullptr )
 {
-	const VariableT merkle_root = make_variable(pb, "merkle_root");
+	BatchRoots roots;
+	roots.input_hash = make_variable(pb, "input_hash");
+	pb.set_input_sizes(1);
+	roots.merkle_root = make_variable(pb, "merkle_root");
+	roots.new_root = make_variable(pb, "new_root");
+	const auto& merkle_root = roots.merkle_root;
 
 	libff::enter_block("Circuit");	
 
 		libff::enter_block("setup");	
+		const auto IVs = snasma::shared_merkle_tree_IVs(pb, "IVs");
+
+		// Gadgets hold many small vectors, don't move them all as it grows
+		tx_gadgets.reserve(arg_n);
 		for( size_t j = 0; j < arg_n; j++ )
 		{
-			tx_gadgets.emplace_back(pb, params, (j == 0) ? merkle_root : tx_gadgets.back().result(), FMT("tx", "[%zu]", j));
+			tx_gadgets.emplace_back(pb, params, IVs, (j == 0) ? merkle_root : tx_gadgets.back().result(), FMT("tx", "[%zu]", j), hook);
+		}
+
+		vector<VariableArrayT> tx_bits;
+		tx_bits.reserve(arg_n);
+		for( const auto& gadget : tx_gadgets )
+		{
+			tx_bits.emplace_back(snasma::public_input_gadget::tx_bits(gadget));
 		}
+		roots.public_input = std::make_shared<snasma::public_input_gadget>(pb, roots.input_hash, roots.merkle_root, roots.new_root, tx_bits, "public_input");
 		libff::leave_block("setup");
 
 		libff::enter_block("constraints");
@@ -124,58 +193,164 @@ const VariableT setup_circuits( ProtoboardT& pb, jubjub::Params& params, vector<
 		{
 			gadget.generate_r1cs_constraints();
 		}
+		pb.add_r1cs_constraint(
+			ConstraintT(tx_gadgets.back().result(), 1, roots.new_root),
+			"new_root == tx[n-1].result");
+		roots.public_input->generate_r1cs_constraints();
 		libff::leave_block("constraints");
 
 	libff::leave_block("Circuit");
 
-	cout << pb.num_constraints() << " constraints (" << (pb.num_constraints() / arg_n) << " avg/tx)" << endl;
+	cout << pb.num_constraints() << " constraints (" << (pb.num_constraints() / arg_n) << " avg/tx), "
+		 << pb.num_variables() << " variables (" << (pb.num_variables() / arg_n) << " avg/tx)" << endl;
 
-	return merkle_root;
+	return roots;
 }
 
 
-bool parse_lines( const VariableT& merkle_root, vector<snasma::TxCircuit>& tx_gadgets, int arg_n, ifstream& infile )
+/**
+* Read up to `arg_n` transactions from the stream, one per line.
+* Empty lines and lines starting with '#' are skipped.
+*
+* @return false if a line couldn't be parsed, or the transaction is invalid
+*/
+bool read_batch( std::istream& in, size_t arg_n, vector<snasma::TxProof>& items )
 {
-	libff::enter_block("Parsing Lines");
+	items.clear();
 	string line;
-	size_t i = 0;
-	while ( std::getline(infile, line) )
+	while ( items.size() < arg_n && std::getline(in, line) )
 	{
-		if( '#' == line[0] )
+		if( line.empty() || '#' == line[0] )
 		{
 			continue;
 		}
 
-		if( i >= arg_n )
-		{
-			break;
-		}
-
 		snasma::TxProof item;
 		if( istringstream(line) >> item )
 		{
 			if( ! item.is_valid() )
 			{
-				cerr << "is_valid failed " << i << endl;
+				cerr << "is_valid failed " << items.size() << endl;
 			}
 			else {
-				tx_gadgets[i].generate_r1cs_witness(item);
-				i += 1;
+				items.emplace_back(item);
 				continue;
 			}
 		}
 		else {
-			cerr << "Error parsing line " << i << endl;
+			cerr << "Error parsing line " << items.size() << endl;
 		}
-		
+
 		cerr << "Line is: " << line << endl;
 		print_tx(item);
 		return false;
 	}
-	libff::leave_block("Parsing Lines");
 
-	if( i != arg_n ) {
-		cerr << "Expected " << arg_n << " lines, got " << i << endl;
+	return true;
+}
+
+
+/**
+* Reads batches of transactions from a text stream, or a binary file
+*
+* Binary files (see `txfile.hpp`) are memory mapped and each record is
+* decoded directly into a re-used `TxProof`. Compact files (see
+* `compact.hpp`) are memory mapped, and decoded in order.
+*/
+class BatchReader
+{
+public:
+	ifstream m_infile;
+	std::istream* m_stream;
+	snasma::MappedTxFile m_txfile;
+	snasma::MappedCompactBatch m_compact;
+	size_t m_offset;
+
+	BatchReader() :
+		m_stream(nullptr), m_offset(0)
+	{ }
+
+	/**
+	* @param path File to read, or "-" for text from stdin
+	*/
+	bool open( const char *path )
+	{
+		if( string(path) == "-" ) {
+			m_stream = &std::cin;
+			return true;
+		}
+
+		if( snasma::MappedTxFile::is_binary(path) ) {
+			return m_txfile.open(path);
+		}
+
+		if( snasma::MappedCompactBatch::is_compact(path) ) {
+			return m_compact.open(path);
+		}
+
+		m_infile.open(path);
+		if( ! m_infile.is_open() )
+		{
+			cerr << "Error: cannot open input file - " << path << endl;
+			return false;
+		}
+		m_stream = &m_infile;
+		return true;
+	}
+
+	bool read( size_t arg_n, vector<snasma::TxProof>& items )
+	{
+		if( m_stream != nullptr ) {
+			return read_batch(*m_stream, arg_n, items);
+		}
+
+		if( m_compact.m_data != nullptr )
+		{
+			const auto count = std::min(arg_n, m_compact.size() - m_offset);
+			items.resize(count);
+			for( size_t i = 0; i < count; i++ )
+			{
+				if( ! m_compact.decode_next(items[i]) || ! items[i].is_valid() )
+				{
+					cerr << "Error decoding compact record " << (m_offset + i) << endl;
+					return false;
+				}
+			}
+			m_offset += count;
+
+			return true;
+		}
+
+		const auto count = std::min(arg_n, m_txfile.size() - m_offset);
+		items.resize(count);
+		for( size_t i = 0; i < count; i++ )
+		{
+			if( ! m_txfile.decode(m_offset + i, items[i]) || ! items[i].is_valid() )
+			{
+				cerr << "Error decoding record " << (m_offset + i) << endl;
+				return false;
+			}
+		}
+		m_offset += count;
+
+		return true;
+	}
+};
+
+
+/**
+* Check every transaction natively, including the signatures, so an invalid
+* transaction is found before any work is done on the circuit, see
+* `preflight_batch`
+*/
+bool preflight( snasma::BatchVerifier& verifier, const vector<snasma::TxProof>& items )
+{
+	size_t bad_index;
+	const auto error = snasma::preflight_batch(verifier, items, bad_index);
+	if( error != snasma::PREFLIGHT_OK )
+	{
+		cerr << "Error: transaction " << bad_index << " - " << snasma::preflight_error_string(error) << endl;
+		print_tx(items[bad_index]);
 		return false;
 	}
 
@@ -183,53 +358,1573 @@ bool parse_lines( const VariableT& merkle_root, vector<snasma::TxCircuit>& tx_ga
 }
 
 
-int main( int argc, char **argv )
+/**
+* Generate the witness for a chain of transactions
+*
+* The transactions are checked natively first, see `preflight`. The local
+* witness of each transaction is independent of the others, with `MULTICORE`
+* these are computed in parallel. Then the input merkle root of each
+* transaction is checked, in order, against the result of the previous.
+*
+* @return false if a transaction is invalid, or the merkle roots don't chain
+*/
+bool generate_witness( ProtoboardT& pb, const BatchRoots& roots, vector<snasma::TxCircuit>& tx_gadgets, snasma::BatchVerifier& verifier, const vector<snasma::TxProof>& items )
 {
-	if( argc < 3 ) {
-		cerr << "Usage: " << argv[0] << " <n> <transactions.txt>" << endl;
+	if( ! preflight(verifier, items) ) {
+		return false;
+	}
+
+#ifdef MULTICORE
+	#pragma omp parallel for schedule(static)
+#endif
+	for( size_t i = 0; i < items.size(); i++ )
+	{
+		tx_gadgets[i].generate_r1cs_witness_local(items[i]);
+	}
+
+	pb.val(roots.merkle_root) = items[0].merkle_root;
+	for( size_t i = 1; i < items.size(); i++ )
+	{
+		if( pb.val(tx_gadgets[i].merkle_root) != items[i].merkle_root )
+		{
+			cerr << "Error: merkle root of transaction " << i << " doesn't match the result of " << (i - 1) << endl;
+			return false;
+		}
+	}
+	pb.val(roots.new_root) = pb.val(tx_gadgets.back().result());
+	roots.public_input->generate_r1cs_witness();
+
+	return true;
+}
+
+
+bool parse_lines( ProtoboardT& pb, const BatchRoots& roots, vector<snasma::TxCircuit>& tx_gadgets, snasma::BatchVerifier& verifier, size_t arg_n, BatchReader& reader )
+{
+	libff::enter_block("Parsing Lines");
+	vector<snasma::TxProof> items;
+	const auto success = reader.read(arg_n, items);
+	libff::leave_block("Parsing Lines");
+
+	if( ! success ) {
+		return false;
+	}
+
+	if( items.size() != arg_n ) {
+		cerr << "Expected " << arg_n << " lines, got " << items.size() << endl;
+		return false;
+	}
+
+	libff::enter_block("Witness");
+	const auto chained = generate_witness(pb, roots, tx_gadgets, verifier, items);
+	libff::leave_block("Witness");
+
+	return chained;
+}
+
+
+/**
+* Restore the variable assignment to its state after the circuit was setup,
+* this retains any constants assigned during construction (e.g. IVs) but
+* discards the witness of the previous batch.
+*/
+void reset_assignment( ProtoboardT& pb, const libsnark::r1cs_variable_assignment<FieldT>& initial )
+{
+	for( size_t i = 0; i < initial.size(); i++ )
+	{
+		pb.val(VariableT(i + 1)) = initial[i];
+	}
+}
+
+
+/**
+* Long-running batch mode
+*
+* The circuit, constraint system and keypair are created once, then
+* consecutive batches of `n` transactions are read from the input stream
+* until it ends. Each batch re-uses the same protoboard: the assignment is
+* reset, the witness is generated and then a proof is created and verified.
+*/
+int main_batch( const char *prog_name, int argc, char **argv )
+{
+	bool arg_prove = true;
+	if( argc > 0 && string(argv[0]) == "--no-prove" ) {
+		arg_prove = false;
+		argc--;
+		argv++;
+	}
+
+	if( argc < 1 ) {
+		cerr << "Usage: " << prog_name << " batch [--no-prove] <n> [transactions.txt|-]" << endl;
 		return 1;
 	}
 
-	ppT::init_public_params();
-	ProtoboardT pb;
+	const auto arg_n = size_t(atoi(argv[0]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
 
-	// open inputs file
-	const auto arg_n = atoi(argv[1]);
-	const auto arg_sigsfile = argv[2];
-	ifstream infile(arg_sigsfile);
-	if( ! infile.is_open() )
+	BatchReader reader;
+	if( ! reader.open(argc > 1 ? argv[1] : "-") )
 	{
-		cerr << "Error: cannot open input file - " << arg_sigsfile << endl;
-		return 2; 
+		return 2;
 	}
 
-	// Setup circuit and parse lines
+	ProtoboardT pb;
 	jubjub::Params params;
 	vector<snasma::TxCircuit> tx_gadgets;
-	const auto merkle_root = setup_circuits(pb, params, tx_gadgets, arg_n);
-	if ( ! parse_lines(merkle_root, tx_gadgets, arg_n, infile) )
+	const auto roots = setup_circuits(pb, params, tx_gadgets, arg_n);
+	snasma::BatchVerifier verifier(params);
+	const auto initial_assignment = pb.full_variable_assignment();
+
+	// Only needed to prove, the witness alone doesn't use the keypair
+	libsnark::r1cs_gg_ppzksnark_keypair<ppT> keypair;
+	libsnark::r1cs_gg_ppzksnark_processed_verification_key<ppT> pvk;
+	if( arg_prove )
 	{
-		return 3;
+		libff::enter_block("Generate keypair");
+		keypair = libsnark::r1cs_gg_ppzksnark_generator<ppT>(pb.get_constraint_system());
+		pvk = libsnark::r1cs_gg_ppzksnark_verifier_process_vk<ppT>(keypair.vk);
+		libff::leave_block("Generate keypair");
 	}
 
-	// Display circuit inputs and necessary intermediates
-	/*
-	for( const auto& gadget : tx_gadgets )
+	vector<snasma::TxProof> items;
+	for( size_t batch_idx = 0; ; batch_idx++ )
 	{
-		print_tx(pb, gadget);
+		const auto start = ClockT::now();
+		if( ! reader.read(arg_n, items) ) {
+			return 3;
+		}
+
+		if( items.empty() ) {
+			break;
+		}
+
+		if( items.size() != arg_n ) {
+			cerr << "Error: batch " << batch_idx << " incomplete, expected " << arg_n << " transactions, got " << items.size() << endl;
+			return 3;
+		}
+
+		const auto read_done = ClockT::now();
+		reset_assignment(pb, initial_assignment);
+		if( ! generate_witness(pb, roots, tx_gadgets, verifier, items) || ! pb.is_satisfied() )
+		{
+			cerr << "Error: batch " << batch_idx << " not valid" << endl;
+			return 3;
+		}
+		const auto witness_done = ClockT::now();
+
+		auto prove_done = witness_done;
+		if( arg_prove )
+		{
+			const auto primary_input = pb.primary_input();
+			const auto proof = libsnark::r1cs_gg_ppzksnark_prover<ppT>(keypair.pk, primary_input, pb.auxiliary_input());
+			prove_done = ClockT::now();
+
+			if( ! libsnark::r1cs_gg_ppzksnark_online_verifier_strong_IC<ppT>(pvk, primary_input, proof) ) {
+				cerr << "Error: batch " << batch_idx << " proof failed to verify" << endl;
+				return 4;
+			}
+		}
+		const auto verify_done = ClockT::now();
+
+		cout << "batch " << batch_idx << ": " << items.size() << " tx"
+			 << ", read " << seconds_between(start, read_done) << "s"
+			 << ", witness " << seconds_between(read_done, witness_done) << "s"
+			 << ", prove " << seconds_between(witness_done, prove_done) << "s"
+			 << ", verify " << seconds_between(prove_done, verify_done) << "s"
+			 << ", total " << seconds_between(start, verify_done) << "s" << endl;
 	}
-	*/
 
-	if( ! pb.is_satisfied() )
+	return 0;
+}
+
+
+/**
+* Circuit for one size of the ladder, with its keypair when proving
+*
+* The transaction gadgets refer to `pb`, so this is never moved.
+*/
+struct LadderCircuit
+{
+	ProtoboardT pb;
+	BatchRoots roots;
+	vector<snasma::TxCircuit> tx_gadgets;
+	libsnark::r1cs_variable_assignment<FieldT> initial_assignment;
+	libsnark::r1cs_gg_ppzksnark_keypair<ppT> keypair;
+	libsnark::r1cs_gg_ppzksnark_processed_verification_key<ppT> pvk;
+};
+
+
+/**
+* Transactions cut from the input stream, padded to the smallest circuit
+* which fits them
+*/
+struct StreamBatch
+{
+	vector<snasma::TxProof> items;
+	size_t circuit;
+	size_t n_padding;
+	ClockT::time_point cut_time;
+};
+
+
+/**
+* A batch with its witness generated, ready to be proven
+*/
+struct ProverJob
+{
+	size_t batch_idx;
+	size_t circuit;
+	size_t n_padding;
+	ClockT::time_point cut_time;
+	double witness_time;
+	libsnark::r1cs_primary_input<FieldT> primary_input;
+	libsnark::r1cs_auxiliary_input<FieldT> auxiliary_input;
+};
+
+
+/**
+* First stage of the streaming pipeline
+*
+* Reads transactions and cuts a batch when the largest circuit is full, or
+* when `arg_timeout_ms` has passed since the first transaction of the batch.
+* Short batches are padded with no-op transactions, up to the smallest
+* circuit of the ladder which fits them.
+*/
+void stream_read( snasma::StreamSource& source, const snasma::CircuitLadder& ladder, int arg_timeout_ms, snasma::BoundedQueue<StreamBatch>& out )
+{
+	jubjub::Params params;
+	snasma::MerkleHasher hasher;
+	StreamBatch batch;
+	ClockT::time_point deadline;
+	string line;
+
+	auto emit = [&]() -> bool {
+		batch.circuit = ladder.select(batch.items.size());
+		batch.n_padding = snasma::pad_batch(batch.items, ladder.m_sizes[batch.circuit], hasher, params);
+		batch.cut_time = ClockT::now();
+		const auto accepted = out.push(std::move(batch));
+		batch = StreamBatch();
+		return accepted;
+	};
+
+	while( true )
 	{
-		cerr << "Not valid" << endl;
-		return 3;
+		int wait_ms = -1;
+		if( ! batch.items.empty() && arg_timeout_ms > 0 )
+		{
+			const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - ClockT::now()).count();
+			wait_ms = int(std::max(decltype(remaining)(0), remaining));
+		}
+
+		const auto status = source.next_line(line, wait_ms);
+		if( status == snasma::StreamSource::LINE )
+		{
+			if( line.empty() || '#' == line[0] ) {
+				continue;
+			}
+
+			snasma::TxProof item;
+			if( ! (istringstream(line) >> item) || ! item.is_valid() ) {
+				cerr << "Error: skipping invalid transaction - " << line << endl;
+				continue;
+			}
+
+			if( batch.items.empty() ) {
+				deadline = ClockT::now() + std::chrono::milliseconds(arg_timeout_ms);
+			}
+			batch.items.emplace_back(item);
+
+			if( batch.items.size() == ladder.largest() && ! emit() ) {
+				break;
+			}
+		}
+		else if( status == snasma::StreamSource::TIMEOUT )
+		{
+			if( ! batch.items.empty() && ! emit() ) {
+				break;
+			}
+		}
+		else {
+			if( ! batch.items.empty() ) {
+				emit();
+			}
+			break;
+		}
 	}
 
-	if( ! stub_test_proof_verify(pb) ) {
-		cerr << "FAIL" << endl;
-		return 4;
+	out.close();
+}
+
+
+/**
+* Streaming mode
+*
+* Transactions are read continuously from stdin or a Unix domain socket.
+* Reading, witness generation and proving run as separate pipeline stages
+* connected by bounded queues, so the next batch is read and witnessed
+* while the current one is being proven. When a stage falls behind the
+* queue fills, and the stages before it block.
+*
+* With `--ladder` a circuit and keypair is built for each size, and each
+* batch is proven by the smallest one which fits it, so at low traffic a
+* batch cut by the timeout is cheaper to prove.
+*/
+int main_stream( const char *prog_name, int argc, char **argv )
+{
+	bool arg_prove = true;
+	int arg_timeout_ms = 0;
+	const char *arg_socket = nullptr;
+	const char *arg_ladder = nullptr;
+
+	while( argc > 0 && argv[0][0] == '-' && argv[0][1] == '-' )
+	{
+		const string arg(argv[0]);
+		if( arg == "--no-prove" ) {
+			arg_prove = false;
+		}
+		else if( arg == "--timeout" && argc > 1 ) {
+			arg_timeout_ms = atoi(argv[1]);
+			argc--;
+			argv++;
+		}
+		else if( arg == "--socket" && argc > 1 ) {
+			arg_socket = argv[1];
+			argc--;
+			argv++;
+		}
+		else if( arg == "--ladder" && argc > 1 ) {
+			arg_ladder = argv[1];
+			argc--;
+			argv++;
+		}
+		else {
+			argc = 0;
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
+	if( argc < 1 && ! arg_ladder ) {
+		cerr << "Usage: " << prog_name << " stream [--no-prove] [--timeout <ms>] [--socket <path>] <n|--ladder <sizes>>" << endl;
+		return 1;
+	}
+
+	snasma::CircuitLadder ladder;
+	if( ! snasma::CircuitLadder::parse(arg_ladder ? arg_ladder : argv[0], ladder) ) {
+		return 1;
+	}
+
+	snasma::StreamSource source;
+	if( ! (arg_socket ? source.open_socket(arg_socket) : source.open_stdin()) ) {
+		return 2;
 	}
 
+	jubjub::Params params;
+	vector<std::unique_ptr<LadderCircuit>> circuits;
+	for( const auto n : ladder.m_sizes )
+	{
+		circuits.emplace_back(new LadderCircuit);
+		auto& circuit = *circuits.back();
+		circuit.roots = setup_circuits(circuit.pb, params, circuit.tx_gadgets, n);
+		circuit.initial_assignment = circuit.pb.full_variable_assignment();
+
+		if( arg_prove )
+		{
+			libff::enter_block("Generate keypair");
+			circuit.keypair = libsnark::r1cs_gg_ppzksnark_generator<ppT>(circuit.pb.get_constraint_system());
+			circuit.pvk = libsnark::r1cs_gg_ppzksnark_verifier_process_vk<ppT>(circuit.keypair.vk);
+			libff::leave_block("Generate keypair");
+		}
+	}
+	snasma::BatchVerifier verifier(params);
+
+	snasma::BoundedQueue<StreamBatch> batches(2);
+	snasma::BoundedQueue<ProverJob> jobs(1);
+
+	std::thread reader([&]() {
+		stream_read(source, ladder, arg_timeout_ms, batches);
+	});
+
+	std::thread prover([&]() {
+		ProverJob job;
+		while( jobs.pop(job) )
+		{
+			const auto& circuit = *circuits[job.circuit];
+			const auto start = ClockT::now();
+			const auto proof = libsnark::r1cs_gg_ppzksnark_prover<ppT>(circuit.keypair.pk, job.primary_input, job.auxiliary_input);
+			const auto prove_done = ClockT::now();
+
+			if( ! libsnark::r1cs_gg_ppzksnark_online_verifier_strong_IC<ppT>(circuit.pvk, job.primary_input, proof) ) {
+				cerr << "Error: batch " << job.batch_idx << " proof failed to verify" << endl;
+				continue;
+			}
+
+			const auto n = ladder.m_sizes[job.circuit];
+			cout << "batch " << job.batch_idx << ": " << (n - job.n_padding) << " tx, " << job.n_padding << " padding, circuit " << n
+				 << ", witness " << job.witness_time << "s"
+				 << ", prove " << seconds_between(start, prove_done) << "s"
+				 << ", latency " << seconds_between(job.cut_time, ClockT::now()) << "s" << endl;
+		}
+	});
+
+	StreamBatch batch;
+	for( size_t batch_idx = 0; batches.pop(batch); batch_idx++ )
+	{
+		auto& circuit = *circuits[batch.circuit];
+		const auto start = ClockT::now();
+		reset_assignment(circuit.pb, circuit.initial_assignment);
+		if( ! generate_witness(circuit.pb, circuit.roots, circuit.tx_gadgets, verifier, batch.items) || ! circuit.pb.is_satisfied() )
+		{
+			cerr << "Error: batch " << batch_idx << " not valid, skipped" << endl;
+			continue;
+		}
+		const auto witness_time = seconds_between(start, ClockT::now());
+
+		if( ! arg_prove )
+		{
+			const auto n = ladder.m_sizes[batch.circuit];
+			cout << "batch " << batch_idx << ": " << (n - batch.n_padding) << " tx, " << batch.n_padding << " padding, circuit " << n
+				 << ", witness " << witness_time << "s" << endl;
+			continue;
+		}
+
+		jobs.push(ProverJob{batch_idx, batch.circuit, batch.n_padding, batch.cut_time, witness_time, circuit.pb.primary_input(), circuit.pb.auxiliary_input()});
+	}
+
+	jobs.close();
+	reader.join();
+	prover.join();
+
 	return 0;
 }
+
+
+bool read_file( const char *path, string& out )
+{
+	ifstream infile(path, std::ios::binary);
+	if( ! infile.is_open() )
+	{
+		cerr << "Error: cannot open file - " << path << endl;
+		return false;
+	}
+
+	std::stringstream buffer;
+	buffer << infile.rdbuf();
+	out = buffer.str();
+	return true;
+}
+
+
+/**
+* Create and write the proving and verification keys for a circuit of `n`
+* transactions
+*/
+bool genkeys( size_t arg_n, const string& pk_path, const string& vk_path )
+{
+	ProtoboardT pb;
+	jubjub::Params params;
+	vector<snasma::TxCircuit> tx_gadgets;
+	setup_circuits(pb, params, tx_gadgets, arg_n);
+
+	libff::enter_block("Generate keypair");
+	auto keypair = libsnark::r1cs_gg_ppzksnark_generator<ppT>(pb.get_constraint_system());
+	libff::leave_block("Generate keypair");
+
+	libff::enter_block("Write keys");
+	if( ! snasma::write_proving_key(pk_path.c_str(), arg_n, keypair.pk) ) {
+		libff::leave_block("Write keys");
+		return false;
+	}
+
+	ofstream vk_out(vk_path);
+	if( ! (vk_out << vk2json(keypair.vk)) ) {
+		cerr << "Error: cannot write verification key - " << vk_path << endl;
+		libff::leave_block("Write keys");
+		return false;
+	}
+	libff::leave_block("Write keys");
+
+	return true;
+}
+
+
+/**
+* Create the proving and verification keys for a circuit of `n` transactions,
+* this only needs to be done once per circuit size.
+*
+* With `--ladder` keys are created for each size, in one directory, see
+* `CircuitLadder::proving_key_path`.
+*/
+int main_genkeys( const char *prog_name, int argc, char **argv )
+{
+	if( argc > 2 && string(argv[0]) == "--ladder" )
+	{
+		snasma::CircuitLadder ladder;
+		if( ! snasma::CircuitLadder::parse(argv[1], ladder) ) {
+			return 1;
+		}
+
+		for( const auto n : ladder.m_sizes )
+		{
+			if( ! genkeys(n, ladder.proving_key_path(argv[2], n), ladder.verification_key_path(argv[2], n)) ) {
+				return 2;
+			}
+		}
+
+		return 0;
+	}
+
+	if( argc < 3 ) {
+		cerr << "Usage: " << prog_name << " genkeys <n> <pk.raw> <vk.json>" << endl;
+		cerr << "       " << prog_name << " genkeys --ladder <sizes> <keydir>" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[0]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	return genkeys(arg_n, argv[1], argv[2]) ? 0 : 2;
+}
+
+
+/**
+* Circuit of `n` transactions with its proving key, loaded once and used to
+* prove any number of batches
+*
+* The transaction gadgets refer to `pb`, so this is never moved.
+*/
+struct ProvingCircuit
+{
+	ProtoboardT pb;
+	BatchRoots roots;
+	vector<snasma::TxCircuit> tx_gadgets;
+	snasma::ProvingKeyT pk;
+};
+
+
+/**
+* Load the proving key at `pk_path` and build the circuit it is for, which
+* must have `n` transactions
+*/
+bool load_proving_circuit( const string& pk_path, bool arg_check, size_t arg_n, jubjub::Params& params, ProvingCircuit& circuit )
+{
+	snasma::ProvingKeyHeader header;
+	libff::enter_block("Load proving key");
+	const auto loaded = snasma::read_proving_key(pk_path.c_str(), header, circuit.pk, arg_check);
+	libff::leave_block("Load proving key");
+	if( ! loaded ) {
+		return false;
+	}
+
+	auto& pb = circuit.pb;
+	circuit.roots = setup_circuits(pb, params, circuit.tx_gadgets, arg_n);
+	if( header.n != arg_n || pb.num_constraints() != header.num_constraints || pb.num_variables() != header.num_variables )
+	{
+		cerr << "Error: proving key doesn't match the circuit for " << arg_n << " transactions - " << pk_path << endl;
+		return false;
+	}
+	circuit.pk.constraint_system = pb.get_constraint_system();
+	if( ! snasma::proving_key_matches(circuit.pk, circuit.pk.constraint_system) ) {
+		cerr << "Error: proving key doesn't match the circuit for " << arg_n << " transactions - " << pk_path << endl;
+		return false;
+	}
+
+	return true;
+}
+
+
+/**
+* Prove `n` transactions, which have already been padded, with a loaded
+* circuit and write the proof as JSON
+*/
+int prove_items( ProvingCircuit& circuit, snasma::BatchVerifier& verifier, const vector<snasma::TxProof>& items, const char *proof_path )
+{
+	auto& pb = circuit.pb;
+
+	libff::enter_block("Witness");
+	const auto chained = generate_witness(pb, circuit.roots, circuit.tx_gadgets, verifier, items);
+	libff::leave_block("Witness");
+	if( ! chained ) {
+		return 3;
+	}
+
+	if( ! pb.is_satisfied() )
+	{
+		cerr << "Not valid" << endl;
+		return 3;
+	}
+
+	libff::enter_block("Prove");
+	auto primary_input = pb.primary_input();
+	auto proof = libsnark::r1cs_gg_ppzksnark_prover<ppT>(circuit.pk, primary_input, pb.auxiliary_input());
+	libff::leave_block("Prove");
+
+	ofstream proof_out(proof_path);
+	if( ! (proof_out << proof_to_json(proof, primary_input)) ) {
+		cerr << "Error: cannot write proof - " << proof_path << endl;
+		return 2;
+	}
+
+	return 0;
+}
+
+
+/**
+* Prove `n` transactions, which have already been padded, with the proving
+* key at `pk_path` and write the proof as JSON
+*/
+int prove_batch( const string& pk_path, bool arg_check, size_t arg_n, const vector<snasma::TxProof>& items, const char *proof_path )
+{
+	jubjub::Params params;
+	ProvingCircuit circuit;
+	if( ! load_proving_circuit(pk_path, arg_check, arg_n, params, circuit) ) {
+		return 2;
+	}
+
+	snasma::BatchVerifier verifier(params);
+	return prove_items(circuit, verifier, items, proof_path);
+}
+
+
+/**
+* Prove a batch of transactions using a persisted proving key,
+* the circuit size is taken from the key.
+*
+* With `--ladder` the keys for each size are in one directory, and the
+* smallest circuit which fits the transactions is used. Either way a short
+* batch is padded with no-ops.
+*/
+int main_prove( const char *prog_name, int argc, char **argv )
+{
+	bool arg_check = false;
+	const char *arg_ladder = nullptr;
+	while( argc > 0 && argv[0][0] == '-' && argv[0][1] == '-' )
+	{
+		const string arg(argv[0]);
+		if( arg == "--check" ) {
+			arg_check = true;
+		}
+		else if( arg == "--ladder" && argc > 1 ) {
+			arg_ladder = argv[1];
+			argc--;
+			argv++;
+		}
+		else {
+			argc = 0;
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
+	if( argc < 3 ) {
+		cerr << "Usage: " << prog_name << " prove [--check] <pk.raw> <transactions.txt> <proof.json>" << endl;
+		cerr << "       " << prog_name << " prove [--check] --ladder <sizes> <keydir> <transactions.txt> <proof.json>" << endl;
+		return 1;
+	}
+
+	snasma::ProvingKeyHeader header;
+	snasma::CircuitLadder ladder;
+	if( arg_ladder ) {
+		if( ! snasma::CircuitLadder::parse(arg_ladder, ladder) ) {
+			return 1;
+		}
+	}
+	else {
+		if( ! snasma::read_proving_key_header(argv[0], header) ) {
+			return 2;
+		}
+		ladder = snasma::CircuitLadder(vector<size_t>{header.n});
+	}
+
+	BatchReader reader;
+	if( ! reader.open(argv[1]) ) {
+		return 2;
+	}
+
+	libff::enter_block("Parsing Lines");
+	vector<snasma::TxProof> items;
+	const auto success = reader.read(ladder.largest(), items);
+	libff::leave_block("Parsing Lines");
+	if( ! success ) {
+		return 3;
+	}
+	if( items.empty() ) {
+		cerr << "Error: no transactions" << endl;
+		return 3;
+	}
+
+	jubjub::Params params;
+	snasma::MerkleHasher hasher;
+	const auto arg_n = ladder.m_sizes[ladder.select(items.size())];
+	const auto n_padding = snasma::pad_batch(items, arg_n, hasher, params);
+	cout << (arg_n - n_padding) << " tx, " << n_padding << " padding, circuit " << arg_n << endl;
+
+	const auto pk_path = arg_ladder ? ladder.proving_key_path(argv[0], arg_n) : string(argv[0]);
+	return prove_batch(pk_path, arg_check, arg_n, items, argv[2]);
+}
+
+
+/**
+* Prove a long chain of transactions as consecutive parts of `n`, the size
+* of the proving key, each part by a separate worker process.
+*
+* Every transaction carries the merkle root it applies to, so the parts
+* are independent and up to `--workers` are proven at once. The proving
+* key is loaded and the circuit built once, before the workers are forked,
+* so their pages are shared copy-on-write. Each worker only writes its own
+* witness and proof. With `MULTICORE` each worker also uses OpenMP, so
+* fewer workers are needed.
+*
+* The proofs are written as `<prefix>.<i>.json`, the public input of each
+* commits to the roots before and after the part, use `verify-chain` with
+* the same transactions to check they follow on from one another.
+*/
+int main_prove_split( const char *prog_name, int argc, char **argv )
+{
+	bool arg_check = false;
+	size_t arg_workers = std::max(1u, std::thread::hardware_concurrency());
+	while( argc > 0 && argv[0][0] == '-' && argv[0][1] == '-' )
+	{
+		const string arg(argv[0]);
+		if( arg == "--check" ) {
+			arg_check = true;
+		}
+		else if( arg == "--workers" && argc > 1 ) {
+			arg_workers = size_t(atoi(argv[1]));
+			argc--;
+			argv++;
+		}
+		else {
+			argc = 0;
+			break;
+		}
+		argc--;
+		argv++;
+	}
+
+	if( argc < 3 || arg_workers < 1 ) {
+		cerr << "Usage: " << prog_name << " prove-split [--check] [--workers <w>] <pk.raw> <transactions.txt> <proof-prefix>" << endl;
+		return 1;
+	}
+
+	snasma::ProvingKeyHeader header;
+	if( ! snasma::read_proving_key_header(argv[0], header) ) {
+		return 2;
+	}
+	const size_t arg_n = header.n;
+
+	BatchReader reader;
+	if( ! reader.open(argv[1]) ) {
+		return 2;
+	}
+
+	jubjub::Params params;
+	snasma::MerkleHasher hasher;
+	vector<vector<snasma::TxProof>> parts;
+	while( true )
+	{
+		vector<snasma::TxProof> items;
+		if( ! reader.read(arg_n, items) ) {
+			return 3;
+		}
+		if( items.empty() ) {
+			break;
+		}
+		snasma::pad_batch(items, arg_n, hasher, params);
+		parts.emplace_back(std::move(items));
+	}
+
+	if( parts.empty() ) {
+		cerr << "Error: no transactions" << endl;
+		return 3;
+	}
+
+	ProvingCircuit circuit;
+	if( ! load_proving_circuit(argv[0], arg_check, arg_n, params, circuit) ) {
+		return 2;
+	}
+	snasma::BatchVerifier verifier(params);
+
+	cout << parts.size() << " parts of " << arg_n << " tx, " << std::min(arg_workers, parts.size()) << " workers" << endl;
+
+	const auto start = ClockT::now();
+	std::unordered_map<pid_t, size_t> running;
+	size_t next = 0;
+	bool success = true;
+	while( running.size() > 0 || (success && next < parts.size()) )
+	{
+		if( success && next < parts.size() && running.size() < arg_workers )
+		{
+			const auto proof_path = string(argv[2]) + "." + std::to_string(next) + ".json";
+			cout.flush();
+			fflush(stdout);
+
+			const auto pid = fork();
+			if( pid < 0 ) {
+				cerr << "Error: cannot fork worker - " << strerror(errno) << endl;
+				success = false;
+				continue;
+			}
+
+			if( pid == 0 ) {
+				const auto ret = prove_items(circuit, verifier, parts[next], proof_path.c_str());
+				cout.flush();
+				fflush(stdout);
+				_exit(ret);
+			}
+
+			running[pid] = next++;
+			continue;
+		}
+
+		int status;
+		const auto pid = waitpid(-1, &status, 0);
+		if( pid < 0 ) {
+			cerr << "Error: waiting for workers - " << strerror(errno) << endl;
+			return 2;
+		}
+
+		const auto part = running[pid];
+		running.erase(pid);
+		if( ! WIFEXITED(status) || WEXITSTATUS(status) != 0 ) {
+			cerr << "Error: part " << part << " failed" << endl;
+			success = false;
+		}
+		else {
+			cout << "part " << part << ": proven, " << seconds_between(start, ClockT::now()) << "s" << endl;
+		}
+	}
+
+	return success ? 0 : 3;
+}
+
+
+int main_verify( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " verify <vk.json> <proof.json>" << endl;
+		return 1;
+	}
+
+	string vk_json;
+	string proof_json;
+	if( ! read_file(argv[0], vk_json) || ! read_file(argv[1], proof_json) ) {
+		return 2;
+	}
+
+	if( ! stub_verify(vk_json.c_str(), proof_json.c_str()) ) {
+		cerr << "FAIL" << endl;
+		return 4;
+	}
+
+	cout << "OK" << endl;
+	return 0;
+}
+
+
+/**
+* Public inputs of a proof, as written by `proof_to_json`, either decimal or
+* hexadecimal prefixed with `0x`. Each must be less than the field modulus,
+* a larger value would otherwise be reduced and could match another input.
+*/
+bool read_proof_inputs( const string& proof_json, vector<FieldT>& out )
+{
+	const auto key = proof_json.find("\"input\"");
+	const auto begin = proof_json.find('[', key);
+	const auto end = proof_json.find(']', begin);
+	if( key == string::npos || begin == string::npos || end == string::npos ) {
+		return false;
+	}
+
+	out.clear();
+	istringstream items(proof_json.substr(begin + 1, end - begin - 1));
+	string item;
+	while( std::getline(items, item, ',') )
+	{
+		const auto first = item.find_first_not_of(" \t\r\n\"");
+		const auto last = item.find_last_not_of(" \t\r\n\"");
+		if( first == string::npos ) {
+			continue;
+		}
+
+		FieldT value;
+		if( ! snasma::parse_field(item.c_str() + first, last - first + 1, value) ) {
+			return false;
+		}
+		out.emplace_back(value);
+	}
+
+	return true;
+}
+
+
+/**
+* Read the transactions of each batch of `n`, padded with no-ops, and compute
+* the public input for each with `batch_public_input`
+*
+* @return false if the transactions can't be read, or don't chain from one
+*         batch to the next
+*/
+bool read_public_inputs( const char *path, size_t arg_n, vector<FieldT>& out )
+{
+	BatchReader reader;
+	if( ! reader.open(path) ) {
+		return false;
+	}
+
+	jubjub::Params params;
+	snasma::MerkleHasher hasher;
+	vector<snasma::TxProof> items;
+	FieldT previous_root;
+	out.clear();
+	while( true )
+	{
+		if( ! reader.read(arg_n, items) ) {
+			return false;
+		}
+		if( items.empty() ) {
+			break;
+		}
+
+		if( out.size() > 0 && items[0].merkle_root != previous_root ) {
+			cerr << "Error: batch " << out.size() << " doesn't start at the root batch " << (out.size() - 1) << " finished with" << endl;
+			return false;
+		}
+
+		snasma::pad_batch(items, arg_n, hasher, params);
+		previous_root = snasma::batch_new_root(items, hasher);
+		out.emplace_back(snasma::batch_public_input(items, hasher));
+	}
+
+	return true;
+}
+
+
+/**
+* Print the public input of each batch of `n` transactions, as it would be
+* computed on-chain from the published transactions and roots
+*/
+int main_public_input( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " public-input <n> <transactions.txt>" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[0]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	vector<FieldT> inputs;
+	if( ! read_public_inputs(argv[1], arg_n, inputs) ) {
+		return 3;
+	}
+
+	for( const auto& input : inputs ) {
+		snasma::write_field(cout, input) << endl;
+	}
+
+	return 0;
+}
+
+
+/**
+* Check every batch of `n` transactions in the file natively, without the
+* circuit, reporting the first invalid transaction and why. The last batch
+* may be shorter, as it would be padded with no-ops. Exits non-zero if any
+* are invalid, so it can be used as a gate before proving.
+*/
+int main_check( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " check <n> <transactions.txt>" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[0]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	BatchReader reader;
+	if( ! reader.open(argv[1]) ) {
+		return 2;
+	}
+
+	jubjub::Params params;
+	snasma::BatchVerifier verifier(params);
+
+	// Every batch of the file is checked, as they would be proven
+	vector<snasma::TxProof> items;
+	size_t n_checked = 0;
+	double elapsed = 0;
+	size_t batch_idx = 0;
+	for( ; ; batch_idx++ )
+	{
+		if( ! reader.read(arg_n, items) ) {
+			return 3;
+		}
+
+		if( items.empty() ) {
+			break;
+		}
+
+		const auto start = ClockT::now();
+		const auto valid = preflight(verifier, items);
+		elapsed += seconds_between(start, ClockT::now());
+
+		if( ! valid ) {
+			cerr << "Error: batch " << batch_idx << " not valid" << endl;
+			cout << "invalid: " << (n_checked + items.size()) << " transactions checked in " << elapsed << "s" << endl;
+			return 3;
+		}
+		n_checked += items.size();
+	}
+
+	if( n_checked == 0 ) {
+		cerr << "Error: no transactions" << endl;
+		return 3;
+	}
+
+	cout << "valid: " << n_checked << " transactions in " << batch_idx << " batches checked in " << elapsed << "s" << endl;
+
+	return 0;
+}
+
+
+/**
+* Check a file of transaction groups, one `TxGroupProof` of `k` transactions
+* per line, natively and optionally against a chain of `TxGroupCircuit`.
+* Exits non-zero if any are invalid.
+*
+* Groups are checked here, but not yet proven: that needs keys for a circuit
+* mixing `TxCircuit` and `TxGroupCircuit`, which `genkeys` doesn't create.
+*/
+int main_check_group( const char *prog_name, int argc, char **argv )
+{
+	const bool arg_circuit = argc > 0 && string(argv[0]) == "--circuit";
+	if( arg_circuit ) {
+		argc--;
+		argv++;
+	}
+
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " check-group [--circuit] <k> <groups.txt>" << endl;
+		return 1;
+	}
+
+	const auto arg_k = size_t(atoi(argv[0]));
+	if( arg_k < 1 || arg_k > snasma::MAX_GROUP_SIZE ) {
+		cerr << "Error: k must be between 1 and " << snasma::MAX_GROUP_SIZE << endl;
+		return 1;
+	}
+
+	ifstream infile(argv[1]);
+	if( ! infile.is_open() ) {
+		cerr << "Error: cannot open input file - " << argv[1] << endl;
+		return 2;
+	}
+
+	vector<snasma::TxGroupProof> groups;
+	string line;
+	for( size_t line_no = 1; std::getline(infile, line); line_no++ )
+	{
+		if( line.empty() || line[0] == '#' ) {
+			continue;
+		}
+
+		snasma::TxGroupProof group;
+		if( ! (istringstream(line) >> group) || group.txs.size() != arg_k ) {
+			cerr << "Error: line " << line_no << " is not a group of " << arg_k << " transactions" << endl;
+			return 3;
+		}
+		groups.emplace_back(group);
+	}
+
+	if( groups.empty() ) {
+		cerr << "Error: no groups" << endl;
+		return 3;
+	}
+
+	jubjub::Params params;
+	snasma::BatchVerifier verifier(params);
+
+	auto start = ClockT::now();
+	size_t bad_group, bad_index;
+	const auto error = snasma::preflight_groups(verifier, groups, bad_group, bad_index);
+	if( error != snasma::PREFLIGHT_OK ) {
+		cerr << "Error: group " << bad_group << " transaction " << bad_index << " - " << snasma::preflight_error_string(error) << endl;
+		return 3;
+	}
+
+	cout << "valid: " << groups.size() << " groups checked in " << seconds_between(start, ClockT::now()) << "s" << endl;
+
+	if( ! arg_circuit ) {
+		return 0;
+	}
+
+	start = ClockT::now();
+	ProtoboardT pb;
+	const VariableT merkle_root = make_variable(pb, "merkle_root");
+	const auto IVs = snasma::shared_merkle_tree_IVs(pb, "IVs");
+	vector<snasma::TxGroupCircuit> group_gadgets;
+	group_gadgets.reserve(groups.size());
+	for( size_t i = 0; i < groups.size(); i++ )
+	{
+		const auto root = i ? group_gadgets.back().result() : merkle_root;
+		group_gadgets.emplace_back(pb, params, IVs, root, arg_k, FMT("group", "[%zu]", i));
+		group_gadgets.back().generate_r1cs_constraints();
+	}
+
+	for( size_t i = 0; i < groups.size(); i++ ) {
+		group_gadgets[i].generate_r1cs_witness(groups[i].txs, groups[i].sig);
+	}
+
+	const auto satisfied = pb.is_satisfied();
+	cout << (satisfied ? "satisfied" : "NOT satisfied") << ": " << pb.num_constraints() << " constraints in " << seconds_between(start, ClockT::now()) << "s" << endl;
+
+	return satisfied ? 0 : 3;
+}
+
+
+/**
+* Write the constraint system for `n` transactions as a `.r1cs` file, see
+* `r1csfile.hpp`, so an external prover can setup and prove the circuit.
+* This is only needed once for each circuit size.
+*/
+int main_export_r1cs( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " export-r1cs <n> <circuit.r1cs>" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[0]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	ProtoboardT pb;
+	jubjub::Params params;
+	vector<snasma::TxCircuit> tx_gadgets;
+	setup_circuits(pb, params, tx_gadgets, arg_n);
+
+	ofstream out(argv[1], std::ios::binary);
+	if( ! out.is_open() ) {
+		cerr << "Error: cannot open " << argv[1] << endl;
+		return 2;
+	}
+
+	const auto start = ClockT::now();
+	const auto cs = pb.get_constraint_system();
+	const auto written = snasma::write_r1cs(out, cs);
+	out.close();
+	if( ! written || ! out ) {
+		cerr << "Error: failed to write " << argv[1] << endl;
+		return 2;
+	}
+
+	cout << cs.num_constraints() << " constraints, " << cs.num_variables() << " variables, written in " << seconds_between(start, ClockT::now()) << "s" << endl;
+
+	return 0;
+}
+
+
+/**
+* Re-evaluate every constraint of a `.r1cs` file with the wires of a `.wtns`
+* file, as written by `export-r1cs` and `export-witness`, to check the
+* exported files agree without running an external prover.
+*/
+int main_check_r1cs( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " check-r1cs <circuit.r1cs> <witness.wtns>" << endl;
+		return 1;
+	}
+
+	ifstream r1cs_in(argv[0], std::ios::binary);
+	libsnark::r1cs_constraint_system<FieldT> cs;
+	uint64_t n_wires = 0;
+	if( ! r1cs_in.is_open() || ! snasma::read_r1cs(r1cs_in, cs, n_wires) ) {
+		cerr << "Error: cannot read " << argv[0] << endl;
+		return 2;
+	}
+
+	ifstream wtns_in(argv[1], std::ios::binary);
+	vector<FieldT> values;
+	if( ! wtns_in.is_open() || ! snasma::read_witness(wtns_in, values) ) {
+		cerr << "Error: cannot read " << argv[1] << endl;
+		return 2;
+	}
+
+	if( values.size() != n_wires || values[0] != FieldT::one() ) {
+		cerr << "Error: witness has " << values.size() << " wires, expected " << n_wires << " starting with 1" << endl;
+		return 3;
+	}
+
+	// Without the constant, as `full_variable_assignment`
+	const vector<FieldT> assignment(values.begin() + 1, values.end());
+	for( size_t i = 0; i < cs.constraints.size(); i++ )
+	{
+		const auto& constraint = cs.constraints[i];
+		if( constraint.a.evaluate(assignment) * constraint.b.evaluate(assignment) != constraint.c.evaluate(assignment) ) {
+			cerr << "Error: constraint " << i << " not satisfied" << endl;
+			return 3;
+		}
+	}
+
+	cout << cs.num_constraints() << " constraints satisfied by " << n_wires << " wires" << endl;
+
+	return 0;
+}
+
+
+/**
+* Generate the witness of consecutive batches of `n` transactions and write
+* each as `<prefix>.<i>.wtns`, see `r1csfile.hpp`, to be proven externally
+* with the constraint system from `export-r1cs`.
+*
+* As with `batch` the circuit is setup once and the assignment reset for
+* each batch. The last batch is padded with no-ops if it's short.
+*/
+int main_export_witness( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: " << prog_name << " export-witness <n> <transactions.txt|-> <witness-prefix>" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[0]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	BatchReader reader;
+	if( ! reader.open(argv[1]) ) {
+		return 2;
+	}
+
+	ProtoboardT pb;
+	jubjub::Params params;
+	vector<snasma::TxCircuit> tx_gadgets;
+	const auto roots = setup_circuits(pb, params, tx_gadgets, arg_n);
+	snasma::BatchVerifier verifier(params);
+	snasma::MerkleHasher hasher;
+	const auto initial_assignment = pb.full_variable_assignment();
+
+	vector<snasma::TxProof> items;
+	for( size_t batch_idx = 0; ; batch_idx++ )
+	{
+		const auto start = ClockT::now();
+		if( ! reader.read(arg_n, items) ) {
+			return 3;
+		}
+
+		if( items.empty() ) {
+			break;
+		}
+
+		const auto n_padding = snasma::pad_batch(items, arg_n, hasher, params);
+
+		const auto read_done = ClockT::now();
+		reset_assignment(pb, initial_assignment);
+		if( ! generate_witness(pb, roots, tx_gadgets, verifier, items) || ! pb.is_satisfied() )
+		{
+			cerr << "Error: batch " << batch_idx << " not valid" << endl;
+			return 3;
+		}
+		const auto witness_done = ClockT::now();
+
+		const auto path = string(argv[2]) + "." + std::to_string(batch_idx) + ".wtns";
+		ofstream out(path, std::ios::binary);
+		if( ! out.is_open() ) {
+			cerr << "Error: cannot open " << path << endl;
+			return 2;
+		}
+
+		const auto written = snasma::write_witness(out, pb.full_variable_assignment());
+		out.close();
+		if( ! written || ! out ) {
+			cerr << "Error: failed to write " << path << endl;
+			return 2;
+		}
+		const auto write_done = ClockT::now();
+
+		cout << path << ": " << (arg_n - n_padding) << " tx, " << n_padding << " padding"
+			 << ", read " << seconds_between(start, read_done) << "s"
+			 << ", witness " << seconds_between(read_done, witness_done) << "s"
+			 << ", write " << seconds_between(witness_done, write_done) << "s" << endl;
+
+		if( n_padding ) {
+			break;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+* Verify the proofs written by `prove-split`, in order, against the public
+* inputs computed from the transactions they were proven for. The batches
+* must chain, each starting at the merkle root the previous finished with.
+*/
+int main_verify_chain( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 4 ) {
+		cerr << "Usage: " << prog_name << " verify-chain <vk.json> <n> <transactions.txt> <proof.0.json> [proof.1.json ...]" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[1]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	string vk_json;
+	if( ! read_file(argv[0], vk_json) ) {
+		return 2;
+	}
+
+	vector<FieldT> expected;
+	if( ! read_public_inputs(argv[2], arg_n, expected) ) {
+		return 3;
+	}
+
+	const auto n_proofs = size_t(argc - 3);
+	if( expected.size() != n_proofs ) {
+		cerr << "FAIL: " << expected.size() << " batches of transactions, but " << n_proofs << " proofs" << endl;
+		return 4;
+	}
+
+	for( size_t i = 0; i < n_proofs; i++ )
+	{
+		const auto proof_path = argv[3 + i];
+		string proof_json;
+		if( ! read_file(proof_path, proof_json) ) {
+			return 2;
+		}
+
+		vector<FieldT> inputs;
+		if( ! read_proof_inputs(proof_json, inputs) || inputs.size() != 1 ) {
+			cerr << "Error: expected one public input, less than the field modulus - " << proof_path << endl;
+			return 2;
+		}
+
+		if( inputs[0] != expected[i] ) {
+			cerr << "FAIL: public input doesn't match batch " << i << " - " << proof_path << endl;
+			return 4;
+		}
+
+		if( ! stub_verify(vk_json.c_str(), proof_json.c_str()) ) {
+			cerr << "FAIL: proof not valid - " << proof_path << endl;
+			return 4;
+		}
+	}
+
+	cout << "OK" << endl;
+	return 0;
+}
+
+
+/**
+* Breakdown of constraints, variables and witness time per sub-gadget of
+* the transaction circuit, written as JSON to track changes between commits.
+*/
+int main_profile( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 3 ) {
+		cerr << "Usage: " << prog_name << " --profile <profile.json> <n> <transactions.txt>" << endl;
+		return 1;
+	}
+
+	const auto arg_n = size_t(atoi(argv[1]));
+	if( arg_n < 1 ) {
+		cerr << "Error: n must be at least 1" << endl;
+		return 1;
+	}
+
+	BatchReader reader;
+	if( ! reader.open(argv[2]) ) {
+		return 2;
+	}
+
+	vector<snasma::TxProof> items;
+	if( ! reader.read(arg_n, items) ) {
+		return 3;
+	}
+	if( items.size() != arg_n ) {
+		cerr << "Expected " << arg_n << " lines, got " << items.size() << endl;
+		return 3;
+	}
+
+	ProtoboardT pb;
+	jubjub::Params params;
+	vector<snasma::TxCircuit> tx_gadgets;
+	snasma::TxCircuitProfile profile(pb);
+	profile.begin(false);
+	const auto roots = setup_circuits(pb, params, tx_gadgets, arg_n, &profile);
+	profile.set_circuit(arg_n);
+
+	profile.begin(true);
+	for( size_t i = 0; i < arg_n; i++ )
+	{
+		tx_gadgets[i].generate_r1cs_witness(items[i]);
+	}
+	profile.end();
+	pb.val(roots.new_root) = pb.val(tx_gadgets.back().result());
+	roots.public_input->generate_r1cs_witness();
+
+	if( ! pb.is_satisfied() )
+	{
+		cerr << "Not valid" << endl;
+		return 3;
+	}
+
+	ofstream profile_out(argv[0]);
+	profile.write_json(profile_out);
+	if( ! profile_out ) {
+		cerr << "Error: cannot write profile - " << argv[0] << endl;
+		return 2;
+	}
+
+	return 0;
+}
+
+
+int main_single( const char *prog_name, int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << prog_name << " <n> <transactions.txt>" << endl;
+		return 1;
+	}
+
+	ProtoboardT pb;
+
+	// open inputs file
+	const auto arg_n = atoi(argv[0]);
+	const auto arg_sigsfile = argv[1];
+	BatchReader reader;
+	if( ! reader.open(arg_sigsfile) )
+	{
+		return 2; 
+	}
+
+	// Setup circuit and parse lines
+	jubjub::Params params;
+	vector<snasma::TxCircuit> tx_gadgets;
+	const auto roots = setup_circuits(pb, params, tx_gadgets, arg_n);
+	snasma::BatchVerifier verifier(params);
+	if ( ! parse_lines(pb, roots, tx_gadgets, verifier, arg_n, reader) )
+	{
+		return 3;
+	}
+
+	// Display circuit inputs and necessary intermediates
+	/*
+	for( const auto& gadget : tx_gadgets )
+	{
+		print_tx(pb, gadget);
+	}
+	*/
+
+	if( ! pb.is_satisfied() )
+	{
+		cerr << "Not valid" << endl;
+		return 3;
+	}
+
+	if( ! stub_test_proof_verify(pb) ) {
+		cerr << "FAIL" << endl;
+		return 4;
+	}
+
+	return 0;
+}
+
+
+int main( int argc, char **argv )
+{
+	if( argc < 2 ) {
+		cerr << "Usage: " << argv[0] << " <n> <transactions.txt>" << endl;
+		cerr << "       " << argv[0] << " batch [--no-prove] <n> [transactions.txt|-]" << endl;
+		cerr << "       " << argv[0] << " stream [--no-prove] [--timeout <ms>] [--socket <path>] <n|--ladder <sizes>>" << endl;
+		cerr << "       " << argv[0] << " genkeys <n> <pk.raw> <vk.json>" << endl;
+		cerr << "       " << argv[0] << " genkeys --ladder <sizes> <keydir>" << endl;
+		cerr << "       " << argv[0] << " prove [--check] [--ladder <sizes>] <pk.raw|keydir> <transactions.txt> <proof.json>" << endl;
+		cerr << "       " << argv[0] << " prove-split [--check] [--workers <w>] <pk.raw> <transactions.txt> <proof-prefix>" << endl;
+		cerr << "       " << argv[0] << " verify <vk.json> <proof.json>" << endl;
+		cerr << "       " << argv[0] << " verify-chain <vk.json> <n> <transactions.txt> <proof.0.json> [proof.1.json ...]" << endl;
+		cerr << "       " << argv[0] << " public-input <n> <transactions.txt>" << endl;
+		cerr << "       " << argv[0] << " check <n> <transactions.txt>" << endl;
+		cerr << "       " << argv[0] << " check-group [--circuit] <k> <groups.txt>" << endl;
+		cerr << "       " << argv[0] << " export-r1cs <n> <circuit.r1cs>" << endl;
+		cerr << "       " << argv[0] << " export-witness <n> <transactions.txt|-> <witness-prefix>" << endl;
+		cerr << "       " << argv[0] << " check-r1cs <circuit.r1cs> <witness.wtns>" << endl;
+		cerr << "       " << argv[0] << " --profile <profile.json> <n> <transactions.txt>" << endl;
+		cerr << endl;
+		cerr << "Transaction files can be text, one per line, binary (see txfile.hpp) or compact (see compact.hpp)" << endl;
+		return 1;
+	}
+
+	ppT::init_public_params();
+
+	const string arg_mode(argv[1]);
+	if( arg_mode == "batch" ) {
+		return main_batch(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "stream" ) {
+		return main_stream(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "genkeys" ) {
+		return main_genkeys(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "prove" ) {
+		return main_prove(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "prove-split" ) {
+		return main_prove_split(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "verify" ) {
+		return main_verify(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "verify-chain" ) {
+		return main_verify_chain(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "public-input" ) {
+		return main_public_input(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check" ) {
+		return main_check(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-group" ) {
+		return main_check_group(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "export-r1cs" ) {
+		return main_export_r1cs(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "export-witness" ) {
+		return main_export_witness(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "check-r1cs" ) {
+		return main_check_r1cs(argv[0], argc - 2, argv + 2);
+	}
+	else if( arg_mode == "--profile" ) {
+		return main_profile(argv[0], argc - 2, argv + 2);
+	}
+
+	return main_single(argv[0], argc - 1, argv + 1);
+}
@@ -0,0 +1,314 @@
+#ifndef MEMPOOL_HPP_
+#define MEMPOOL_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "snasma.hpp"
+#include "ladder.hpp"
+#include "verify.hpp"
+
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Result of submitting a transaction to the `Mempool`
+*/
+enum MempoolStatus
+{
+    MEMPOOL_ACCEPTED = 0,
+    MEMPOOL_DUPLICATE,
+    MEMPOOL_CONFLICT,
+    MEMPOOL_UNKNOWN_ACCOUNT,
+    MEMPOOL_STALE_NONCE,
+    MEMPOOL_NONCE_GAP,
+    MEMPOOL_INSUFFICIENT_BALANCE,
+    MEMPOOL_INVALID,
+    MEMPOOL_BAD_SIGNATURE,
+    MEMPOOL_FULL
+};
+
+
+static const char *mempool_status_string( MempoolStatus status )
+{
+    switch( status )
+    {
+    case MEMPOOL_ACCEPTED:              return "accepted";
+    case MEMPOOL_DUPLICATE:             return "already pending";
+    case MEMPOOL_CONFLICT:              return "a different transaction is pending with the same nonce";
+    case MEMPOOL_UNKNOWN_ACCOUNT:       return "unknown account";
+    case MEMPOOL_STALE_NONCE:           return "nonce already used";
+    case MEMPOOL_NONCE_GAP:             return "nonce isn't the next for the sender";
+    case MEMPOOL_INSUFFICIENT_BALANCE:  return "balance not sufficient after pending transactions";
+    case MEMPOOL_INVALID:               return "invalid transaction";
+    case MEMPOOL_BAD_SIGNATURE:         return "invalid signature";
+    case MEMPOOL_FULL:                  return "mempool full";
+    }
+    return "unknown";
+}
+
+
+static bool signed_transaction_equal( const SignedTransaction& a, const SignedTransaction& b )
+{
+    return a.tx.from_idx == b.tx.from_idx
+        && a.tx.to_idx == b.tx.to_idx
+        && a.tx.amount == b.tx.amount
+        && a.nonce == b.nonce
+        && a.sig.R.x == b.sig.R.x
+        && a.sig.R.y == b.sig.R.y
+        && a.sig.s == b.sig.s;
+}
+
+
+/**
+* Pending transactions of each sender, waiting to be put into a batch
+*
+* Transactions are keyed by (from account, nonce). The pending transactions
+* of a sender always have consecutive nonces, starting at the nonce of its
+* account in the tree, so a transaction is only accepted if its nonce is the
+* next one. The amounts of a sender's pending transactions are reserved from
+* its balance, a transaction which would spend more than the balance left is
+* rejected, so a double-spend never reaches a batch. Incoming transfers only
+* count once they've been applied.
+*
+* The signature is checked against the sender's public key before a
+* transaction is accepted, otherwise a forgery could take the sender's next
+* nonce and be applied to the tree in place of the real transaction.
+* `submit` checks one signature, once the cheaper checks have passed, which
+* costs a challenge hash and a full scalar multiplication for every
+* transaction. `submit_many` checks all of them together with
+* `BatchVerifier`, which is much faster per signature, and is the path to
+* use for high submission rates. `submit` is for occasional transactions.
+*
+* Batches are filled by taking the next transaction of each sender in turn,
+* in the order senders became ready, and applying it to the tree, which
+* records its `TxProof`.
+*/
+class Mempool
+{
+public:
+    struct Sender
+    {
+        // Consecutive nonces, the first is the nonce of the account
+        std::deque<SignedTransaction> pending;
+
+        // Sum of the pending amounts
+        ethsnarks::FieldT reserved;
+
+        Sender() :
+            reserved(ethsnarks::FieldT::zero())
+        { }
+    };
+
+    AccountTree& m_tree;
+
+    std::unordered_map<uint32_t, Sender> m_senders;
+
+    // Senders with pending transactions, each appears once
+    std::deque<uint32_t> m_ready;
+
+    size_t m_size;
+    size_t m_max_size;
+
+    // Used by `submit_many`
+    BatchVerifier m_verifier;
+
+    // Used by `submit`, so it doesn't disturb a `submit_many` in progress
+    BatchVerifier m_single;
+
+    // Indices of the invalid signatures found by `submit_many`
+    std::vector<size_t> m_bad;
+
+    Mempool( AccountTree& tree, const ethsnarks::jubjub::Params& params, size_t max_size = (size_t(1) << 20) ) :
+        m_tree(tree),
+        m_size(0),
+        m_max_size(max_size),
+        m_verifier(params),
+        m_single(params)
+    { }
+
+    size_t size() const
+    {
+        return m_size;
+    }
+
+    MempoolStatus submit( const SignedTransaction& stx )
+    {
+        return admit(stx, true);
+    }
+
+    /**
+    * Submit transactions in order, as `submit`, after checking all of their
+    * signatures together
+    *
+    * @param statuses Set to the result for each transaction
+    */
+    void submit_many( const std::vector<SignedTransaction>& stxs, std::vector<MempoolStatus>& statuses )
+    {
+        // Without a sender the transaction is rejected by `admit` anyway
+        m_verifier.clear();
+        std::vector<size_t> signed_indices;
+        for( size_t i = 0; i < stxs.size(); i++ )
+        {
+            const auto from_idx = stxs[i].tx.from_idx;
+            if( m_tree.exists(from_idx) )
+            {
+                m_verifier.add(stxs[i], m_tree.account(from_idx).pubkey);
+                signed_indices.emplace_back(i);
+            }
+        }
+
+        std::vector<bool> valid(stxs.size(), true);
+        m_verifier.verify_all(m_bad);
+        for( const auto i : m_bad ) {
+            valid[signed_indices[i]] = false;
+        }
+
+        statuses.resize(stxs.size());
+        for( size_t i = 0; i < stxs.size(); i++ ) {
+            statuses[i] = valid[i] ? admit(stxs[i], false) : MEMPOOL_BAD_SIGNATURE;
+        }
+    }
+
+    /**
+    * Apply up to `n` pending transactions to the tree, taking one from each
+    * ready sender in turn, and append their proofs to `out`
+    *
+    * If a transaction can't be applied (e.g. the balance of the receiver
+    * would overflow) it is dropped, with the rest of its sender's pending
+    * transactions, as their nonces can no longer be used.
+    *
+    * @return Number of transactions dropped
+    */
+    size_t take( size_t n, std::vector<TxProof>& out )
+    {
+        size_t n_dropped = 0;
+        const auto limit = out.size() + n;
+        while( out.size() < limit && ! m_ready.empty() )
+        {
+            const auto from_idx = m_ready.front();
+            m_ready.pop_front();
+
+            auto it = m_senders.find(from_idx);
+            auto& sender = it->second;
+            const auto stx = sender.pending.front();
+            sender.pending.pop_front();
+            sender.reserved -= ethsnarks::FieldT(stx.tx.amount);
+            m_size--;
+
+            out.emplace_back();
+            if( ! m_tree.apply(stx, out.back()) )
+            {
+                out.pop_back();
+                n_dropped += 1 + sender.pending.size();
+                m_size -= sender.pending.size();
+                sender.pending.clear();
+            }
+
+            if( sender.pending.empty() ) {
+                m_senders.erase(it);
+            }
+            else {
+                m_ready.emplace_back(from_idx);
+            }
+        }
+        return n_dropped;
+    }
+
+    /**
+    * Fill the next batch, up to the largest circuit of the ladder, then pad
+    * it to the smallest circuit which fits, see `pad_batch`
+    *
+    * @return Index of the circuit in the ladder, or the ladder size if there
+    *         are no pending transactions
+    */
+    size_t next_batch( const CircuitLadder& ladder, const ethsnarks::jubjub::Params& params, std::vector<TxProof>& batch )
+    {
+        batch.clear();
+        while( batch.empty() && ! m_ready.empty() ) {
+            take(ladder.largest(), batch);
+        }
+
+        if( batch.empty() ) {
+            return ladder.size();
+        }
+
+        const auto circuit = ladder.select(batch.size());
+        pad_batch(batch, ladder.m_sizes[circuit], m_tree.m_hasher, params);
+        return circuit;
+    }
+
+protected:
+    /**
+    * @param check_signature false if the signature has already been checked
+    */
+    MempoolStatus admit( const SignedTransaction& stx, bool check_signature )
+    {
+        const auto& tx = stx.tx;
+        if( tx.amount == 0 || tx.from_idx >= (size_t(1) << TREE_DEPTH) || tx.to_idx >= (size_t(1) << TREE_DEPTH) ) {
+            return MEMPOOL_INVALID;
+        }
+
+        if( ! m_tree.exists(tx.from_idx) || ! m_tree.exists(tx.to_idx) ) {
+            return MEMPOOL_UNKNOWN_ACCOUNT;
+        }
+
+        const auto& account = m_tree.account(tx.from_idx);
+        if( stx.nonce < account.nonce ) {
+            return MEMPOOL_STALE_NONCE;
+        }
+
+        // Senders are only added once a transaction is accepted
+        const auto it = m_senders.find(tx.from_idx);
+        const auto n_pending = (it == m_senders.end()) ? size_t(0) : it->second.pending.size();
+        const auto offset = size_t(stx.nonce - account.nonce);
+        if( offset < n_pending ) {
+            return signed_transaction_equal(it->second.pending[offset], stx) ? MEMPOOL_DUPLICATE : MEMPOOL_CONFLICT;
+        }
+
+        if( offset > n_pending ) {
+            return MEMPOOL_NONCE_GAP;
+        }
+
+        if( m_size >= m_max_size ) {
+            return MEMPOOL_FULL;
+        }
+
+        const ethsnarks::FieldT amount(tx.amount);
+        const auto reserved = (n_pending ? it->second.reserved : ethsnarks::FieldT::zero()) + amount;
+        if( field_lt(account.balance, reserved) ) {
+            return MEMPOOL_INSUFFICIENT_BALANCE;
+        }
+
+        if( check_signature )
+        {
+            m_single.clear();
+            m_single.add(stx, account.pubkey);
+            if( ! m_single.verify_one(0) ) {
+                return MEMPOOL_BAD_SIGNATURE;
+            }
+        }
+
+        auto& sender = (it == m_senders.end()) ? m_senders[tx.from_idx] : it->second;
+        if( sender.pending.empty() ) {
+            m_ready.emplace_back(tx.from_idx);
+        }
+        sender.pending.emplace_back(stx);
+        sender.reserved = reserved;
+        m_size++;
+
+        return MEMPOOL_ACCEPTED;
+    }
+};
+
+
+// namespace snasma
+}
+
+// MEMPOOL_HPP_
+#endif
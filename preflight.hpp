@@ -0,0 +1,294 @@
+#ifndef PREFLIGHT_HPP_
+#define PREFLIGHT_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "snasma.hpp"
+#include "verify.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Reason a transaction wouldn't satisfy `TxCircuit`, in the order they are
+* checked
+*/
+enum PreflightError
+{
+    PREFLIGHT_OK = 0,
+    PREFLIGHT_MALFORMED,
+    PREFLIGHT_ROOT_CHAIN,
+    PREFLIGHT_NONCE,
+    PREFLIGHT_FROM_PATH,
+    PREFLIGHT_BALANCE,
+    PREFLIGHT_TO_PATH,
+    PREFLIGHT_OVERFLOW,
+    PREFLIGHT_SIGNATURE,
+    PREFLIGHT_GROUP
+};
+
+
+static const char *preflight_error_string( PreflightError error )
+{
+    switch( error )
+    {
+    case PREFLIGHT_OK:          return "ok";
+    case PREFLIGHT_MALFORMED:   return "malformed, index out of range, wrong path length, or amount invalid for a no-op";
+    case PREFLIGHT_ROOT_CHAIN:  return "merkle root doesn't match the result of the previous transaction";
+    case PREFLIGHT_NONCE:       return "nonce doesn't match the nonce of the from account";
+    case PREFLIGHT_FROM_PATH:   return "from leaf and path don't match the merkle root";
+    case PREFLIGHT_BALANCE:     return "balance of from account not sufficient, or out of range";
+    case PREFLIGHT_TO_PATH:     return "to leaf and path don't match the merkle root after from is updated";
+    case PREFLIGHT_OVERFLOW:    return "balance of to account would overflow";
+    case PREFLIGHT_SIGNATURE:   return "invalid signature";
+    case PREFLIGHT_GROUP:       return "group changes sender, public key or no-op, or its nonces aren't consecutive";
+    }
+    return "unknown";
+}
+
+
+/**
+* Check a transaction natively, as `TxCircuit` would, except the signature
+* and that its merkle root follows on from the previous transaction
+*
+* @param new_root Set to the merkle root after the transaction
+*/
+static PreflightError preflight_tx( const TxProof& item, MerkleHasher& hasher, ethsnarks::FieldT& new_root )
+{
+    const auto& tx = item.stx.tx;
+    if( item.before_from.size() != TREE_DEPTH
+     || item.before_to.size() != TREE_DEPTH
+     || tx.from_idx >= (size_t(1) << TREE_DEPTH)
+     || tx.to_idx >= (size_t(1) << TREE_DEPTH)
+     || item.stx.nonce >= (size_t(1) << TREE_DEPTH)
+     || (item.is_noop ? tx.amount != 0 : tx.amount == 0) ) {
+        return PREFLIGHT_MALFORMED;
+    }
+
+    if( item.stx.nonce != item.state_from.nonce ) {
+        return PREFLIGHT_NONCE;
+    }
+
+    if( hasher.root(hasher.leaf(item.state_from), tx.from_idx, item.before_from) != item.merkle_root ) {
+        return PREFLIGHT_FROM_PATH;
+    }
+
+    const ethsnarks::FieldT amount(tx.amount);
+    if( item.state_from.balance.as_bigint().num_bits() > BALANCE_BITS || field_lt(item.state_from.balance, amount) ) {
+        return PREFLIGHT_BALANCE;
+    }
+
+    auto from = item.state_from;
+    from.balance -= amount;
+    from.nonce += item.is_noop ? 0 : 1;
+    const auto from_root = hasher.root(hasher.leaf(from), tx.from_idx, item.before_from);
+
+    if( hasher.root(hasher.leaf(item.state_to), tx.to_idx, item.before_to) != from_root ) {
+        return PREFLIGHT_TO_PATH;
+    }
+
+    auto to = item.state_to;
+    to.balance += amount;
+    if( to.balance.as_bigint().num_bits() > BALANCE_BITS ) {
+        return PREFLIGHT_OVERFLOW;
+    }
+
+    new_root = hasher.root(hasher.leaf(to), tx.to_idx, item.before_to);
+    return PREFLIGHT_OK;
+}
+
+
+/**
+* Check a batch of transactions natively, except their signatures, finding
+* the first which would leave the circuit unsatisfied and why.
+*
+* The transactions are independent apart from the merkle root chain, so
+* they're checked concurrently, in contiguous ranges with one `MerkleHasher`
+* per thread, then the roots are chained in order.
+*
+* @param bad_index Set to the index of the first invalid transaction, or
+*                  the number of transactions if they're all valid
+* @param n_threads Number of threads, or zero for one per core
+*/
+static PreflightError preflight_transfers( const std::vector<TxProof>& items, size_t& bad_index, size_t n_threads = 0 )
+{
+    const auto n = items.size();
+    if( n_threads == 0 ) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    n_threads = std::max(size_t(1), std::min(n_threads, n));
+
+    std::vector<PreflightError> errors(n, PREFLIGHT_OK);
+    std::vector<ethsnarks::FieldT> new_roots(n);
+
+    // Each range stops at its first error, later results aren't needed
+    const auto check_range = [&]( size_t t ) {
+        MerkleHasher hasher;
+        for( size_t i = (t * n) / n_threads; i < ((t + 1) * n) / n_threads; i++ )
+        {
+            errors[i] = preflight_tx(items[i], hasher, new_roots[i]);
+            if( errors[i] != PREFLIGHT_OK ) {
+                break;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    threads.reserve(n_threads - 1);
+    for( size_t t = 1; t < n_threads; t++ ) {
+        threads.emplace_back(check_range, t);
+    }
+    check_range(0);
+    for( auto& thread : threads ) {
+        thread.join();
+    }
+
+    bad_index = n;
+    for( size_t i = 0; i < n; i++ )
+    {
+        const auto error = (i > 0 && items[i].merkle_root != new_roots[i - 1]) ? PREFLIGHT_ROOT_CHAIN : errors[i];
+        if( error != PREFLIGHT_OK ) {
+            bad_index = i;
+            return error;
+        }
+    }
+
+    return PREFLIGHT_OK;
+}
+
+
+/**
+* Check a batch of transactions natively before any work is done on the
+* circuit, as `preflight_transfers`, then the signatures are checked by
+* `verifier`, up to the first transaction which failed.
+*
+* @param bad_index Set to the index of the first invalid transaction
+* @param n_threads Number of threads, or zero for one per core
+*/
+static PreflightError preflight_batch( BatchVerifier& verifier, const std::vector<TxProof>& items, size_t& bad_index, size_t n_threads = 0 )
+{
+    const auto error = preflight_transfers(items, bad_index, n_threads);
+
+    // Only an earlier invalid signature is reported instead
+    verifier.clear();
+    for( size_t i = 0; i < bad_index; i++ ) {
+        verifier.add(items[i]);
+    }
+
+    size_t bad_signature;
+    if( ! verifier.verify(bad_signature) ) {
+        bad_index = bad_signature;
+        return PREFLIGHT_SIGNATURE;
+    }
+
+    return error;
+}
+
+
+/**
+* Check that a group satisfies the constraints `TxGroupCircuit` adds
+* between its transactions
+*
+* @return Index of the first transaction which doesn't follow on from the
+*         previous, or the size of the group
+*/
+static size_t check_group_links( const TxGroupProof& group )
+{
+    const auto& first = group.txs[0];
+    for( size_t i = 1; i < group.txs.size(); i++ )
+    {
+        const auto& prev = group.txs[i - 1];
+        const auto& item = group.txs[i];
+        if( item.stx.tx.from_idx != first.stx.tx.from_idx
+         || item.state_from.pubkey.x != first.state_from.pubkey.x
+         || item.state_from.pubkey.y != first.state_from.pubkey.y
+         || item.is_noop != first.is_noop
+         || size_t(item.stx.nonce) != (size_t(prev.stx.nonce) + (prev.is_noop ? 0 : 1)) ) {
+            return i;
+        }
+    }
+    return group.txs.size();
+}
+
+
+/**
+* Check a batch of transaction groups natively, as `TxGroupCircuit` would:
+* every transaction as `preflight_transfers`, chained by merkle root across
+* groups, then the links within each group and the signature of each group.
+*
+* As `preflight_batch`, only a signature or link error before the first
+* invalid transaction is reported instead of it.
+*
+* @param bad_group Set to the index of the first invalid group
+* @param bad_index Set to the index of the first invalid transaction within
+*                  that group, or zero for its signature
+*/
+static PreflightError preflight_groups( BatchVerifier& verifier, const std::vector<TxGroupProof>& groups, size_t& bad_group, size_t& bad_index, size_t n_threads = 0 )
+{
+    std::vector<TxProof> items;
+    std::vector<size_t> group_begin;
+    group_begin.reserve(groups.size());
+    for( const auto& group : groups )
+    {
+        if( group.txs.empty() ) {
+            bad_group = group_begin.size();
+            bad_index = 0;
+            return PREFLIGHT_MALFORMED;
+        }
+        group_begin.emplace_back(items.size());
+        items.insert(items.end(), group.txs.begin(), group.txs.end());
+    }
+
+    size_t bad_item;
+    auto error = preflight_transfers(items, bad_item, n_threads);
+
+    bad_group = groups.size();
+    bad_index = 0;
+    if( error != PREFLIGHT_OK )
+    {
+        bad_group = size_t(std::upper_bound(group_begin.begin(), group_begin.end(), bad_item) - group_begin.begin()) - 1;
+        bad_index = bad_item - group_begin[bad_group];
+    }
+
+    // Groups up to and including the one with the invalid transaction
+    const auto n_checked = std::min(groups.size(), bad_group + 1);
+    for( size_t g = 0; g < n_checked; g++ )
+    {
+        const auto link = check_group_links(groups[g]);
+        if( link < groups[g].txs.size() && (g < bad_group || link < bad_index) )
+        {
+            bad_group = g;
+            bad_index = link;
+            error = PREFLIGHT_GROUP;
+            break;
+        }
+    }
+
+    // Only the signature of an earlier group is reported instead
+    verifier.clear();
+    for( size_t g = 0; g < std::min(groups.size(), bad_group); g++ ) {
+        verifier.add(groups[g]);
+    }
+
+    size_t bad_signature;
+    if( ! verifier.verify(bad_signature) ) {
+        bad_group = bad_signature;
+        bad_index = 0;
+        return PREFLIGHT_SIGNATURE;
+    }
+
+    return error;
+}
+
+// namespace snasma
+}
+
+// PREFLIGHT_HPP_
+#endif
@@ -0,0 +1,184 @@
+#ifndef PROFILE_HPP_
+#define PROFILE_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "circuit.hpp"
+
+#include <chrono>
+#include <ostream>
+#include <string>
+#include <vector>
+
+
+namespace snasma {
+
+
+struct GadgetProfile
+{
+    std::string name;
+    size_t constraints;
+    size_t variables;
+    double witness_seconds;
+
+    GadgetProfile( const std::string& in_name ) :
+        name(in_name), constraints(0), variables(0), witness_seconds(0)
+    { }
+};
+
+
+/**
+* Breakdown of constraints, variables and witness generation time for each
+* sub-gadget of `TxCircuit`.
+*
+* The profile is the `TxCircuitHook` of every transaction, so it measures
+* the real circuit as it is created, has its constraints added and has its
+* witness generated. The variables and constraints added between two steps,
+* and for the witness the time taken, belong to the step of the first.
+* Anything outside a sub-gadget, such as the account state, the IVs, the
+* no-op constraints and the batch public input, is reported as "other".
+*
+*   profile.begin(false);
+*   setup_circuits(pb, params, tx_gadgets, n, &profile);
+*   profile.set_circuit(n);
+*   profile.begin(true);
+*   ... generate the witness of each transaction
+*   profile.end();
+*/
+class TxCircuitProfile : public TxCircuitHook
+{
+public:
+    typedef std::chrono::steady_clock ClockT;
+
+    const ProtoboardT& m_pb;
+    std::vector<GadgetProfile> m_gadgets;
+    size_t m_n;
+    size_t m_constraints;
+    size_t m_variables;
+    double m_witness_seconds;
+
+    TxCircuitProfile( const ProtoboardT& pb ) :
+        m_pb(pb),
+        m_gadgets({
+            GadgetProfile("tx_amount"),
+            GadgetProfile("sig_nonce"),
+            GadgetProfile("m_sig"),
+            GadgetProfile("m_balance"),
+            GadgetProfile("m_leaf_before_from"),
+            GadgetProfile("m_leaf_after_from"),
+            GadgetProfile("m_leaf_before_to"),
+            GadgetProfile("m_leaf_after_to"),
+            GadgetProfile("path_before_from"),
+            GadgetProfile("path_after_from"),
+            GadgetProfile("path_before_to"),
+            GadgetProfile("path_after_to"),
+            GadgetProfile("other")
+        }),
+        m_n(0), m_constraints(0), m_variables(0), m_witness_seconds(0),
+        m_current(TX_STEP_OTHER), m_timed(false),
+        m_mark_constraints(0), m_mark_variables(0)
+    {
+        assert( m_gadgets.size() == TX_STEP_COUNT );
+    }
+
+    /**
+    * Start measuring, from `TX_STEP_OTHER`, timing each step if `timed`
+    */
+    void begin( bool timed )
+    {
+        m_current = TX_STEP_OTHER;
+        m_timed = timed;
+        m_mark_constraints = m_pb.num_constraints();
+        m_mark_variables = m_pb.num_variables();
+        m_begin = m_mark_time = ClockT::now();
+    }
+
+    void end()
+    {
+        step(TX_STEP_OTHER);
+        if( m_timed ) {
+            m_witness_seconds += std::chrono::duration<double>(m_mark_time - m_begin).count();
+        }
+    }
+
+    /**
+    * Once the circuit of `n` transactions is complete, record its size and
+    * make the size of each step per transaction
+    */
+    void set_circuit( size_t n )
+    {
+        end();
+
+        m_n = n;
+        m_constraints = m_pb.num_constraints();
+        m_variables = m_pb.num_variables();
+
+        for( auto& g : m_gadgets )
+        {
+            g.constraints /= n;
+            g.variables /= n;
+        }
+    }
+
+    void step( TxStep next ) override
+    {
+        const auto constraints = m_pb.num_constraints();
+        const auto variables = m_pb.num_variables();
+
+        auto& g = m_gadgets[m_current];
+        g.constraints += constraints - m_mark_constraints;
+        g.variables += variables - m_mark_variables;
+        m_mark_constraints = constraints;
+        m_mark_variables = variables;
+
+        if( m_timed )
+        {
+            const auto now = ClockT::now();
+            g.witness_seconds += std::chrono::duration<double>(now - m_mark_time).count();
+            m_mark_time = now;
+        }
+
+        m_current = next;
+    }
+
+    /**
+    * Constraints and variables are per transaction, witness times are the
+    * total for all transactions.
+    */
+    void write_json( std::ostream& out ) const
+    {
+        out << "{\n";
+        out << "  \"n\": " << m_n << ",\n";
+        out << "  \"constraints\": " << m_constraints << ",\n";
+        out << "  \"variables\": " << m_variables << ",\n";
+        out << "  \"witness_seconds\": " << m_witness_seconds << ",\n";
+        out << "  \"gadgets\": [\n";
+        for( size_t i = 0; i < m_gadgets.size(); i++ )
+        {
+            const auto& g = m_gadgets[i];
+            out << "    {\"name\": \"" << g.name << "\""
+                << ", \"constraints\": " << g.constraints
+                << ", \"variables\": " << g.variables
+                << ", \"witness_seconds\": " << g.witness_seconds
+                << "}" << (i + 1 < m_gadgets.size() ? "," : "") << "\n";
+        }
+        out << "  ]\n";
+        out << "}\n";
+    }
+
+protected:
+    TxStep m_current;
+    bool m_timed;
+    size_t m_mark_constraints;
+    size_t m_mark_variables;
+    ClockT::time_point m_mark_time;
+    ClockT::time_point m_begin;
+};
+
+
+// namespace snasma
+}
+
+// PROFILE_HPP_
+#endif
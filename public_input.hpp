@@ -0,0 +1,193 @@
+#ifndef PUBLIC_INPUT_HPP_
+#define PUBLIC_INPUT_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "circuit.hpp"
+
+#include <algorithm>
+
+
+namespace snasma {
+
+
+/**
+* Compresses the public data of a batch into a single public input
+*
+*   input = H(merkle_root, new_root, P_0, P_1, ...)
+*
+* Where each `P_j` packs the on-chain data of several transactions into one
+* field element, using `TX_BITS` for each: from_idx, to_idx and amount, each
+* least significant bit first, as they are in the circuit. H is LongsightL12p5
+* in Miyaguchi-Preneel mode, the same as the merkle tree, with an IV of 1.
+*
+* The verifier recomputes the input from the published transactions and the
+* roots, so its cost doesn't depend on the number of transactions.
+*/
+class public_input_gadget : public GadgetT
+{
+public:
+    static const size_t TX_BITS = (2 * TREE_DEPTH) + AMOUNT_BITS;
+
+    const VariableT m_result;
+    std::vector<VariableArrayT> m_chunks;
+    const VariableArrayT m_packed;
+    LongsightL12p5_MP_gadget m_hash;
+
+    /**
+    * @param in_tx_bits On-chain data of each transaction, `TX_BITS` each
+    */
+    public_input_gadget(
+        ProtoboardT& pb,
+        const VariableT& in_result,
+        const VariableT& in_merkle_root,
+        const VariableT& in_new_root,
+        const std::vector<VariableArrayT>& in_tx_bits,
+        const std::string& annotation_prefix
+    ) :
+        GadgetT(pb, annotation_prefix),
+        m_result(in_result),
+        m_chunks(make_chunks(flatten(in_tx_bits))),
+        m_packed(make_var_array(pb, m_chunks.size(), FMT(annotation_prefix, ".packed"))),
+        m_hash(pb, libsnark::ONE, hash_inputs(in_merkle_root, in_new_root, m_packed), FMT(annotation_prefix, ".hash"))
+    {
+
+    }
+
+    /**
+    * Transactions packed into each field element
+    */
+    static size_t txs_per_element()
+    {
+        return FieldT::capacity() / TX_BITS;
+    }
+
+    /**
+    * On-chain data of a transaction, as used by the circuit
+    */
+    static const VariableArrayT tx_bits( const TxTransferBase& tx )
+    {
+        return flatten({tx.tx_from_idx, tx.tx_to_idx, tx.tx_amount.bits});
+    }
+
+    /**
+    * The transaction data must already be assigned
+    */
+    void generate_r1cs_witness()
+    {
+        // Least significant bit first, as `pb_packing_sum`
+        for( size_t i = 0; i < m_chunks.size(); i++ )
+        {
+            FieldT packed = FieldT::zero();
+            FieldT bit_value = FieldT::one();
+            for( const auto& bit : m_chunks[i] )
+            {
+                if( ! this->pb.val(bit).is_zero() ) {
+                    packed += bit_value;
+                }
+                bit_value += bit_value;
+            }
+            this->pb.val(m_packed[i]) = packed;
+        }
+
+        m_hash.generate_r1cs_witness();
+        this->pb.val(m_result) = this->pb.val(m_hash.result());
+    }
+
+    void generate_r1cs_constraints()
+    {
+        for( size_t i = 0; i < m_chunks.size(); i++ )
+        {
+            this->pb.add_r1cs_constraint(
+                ConstraintT(libsnark::pb_packing_sum<FieldT>(m_chunks[i]), 1, m_packed[i]),
+                FMT(this->annotation_prefix, ".packed[%zu]", i));
+        }
+
+        m_hash.generate_r1cs_constraints();
+
+        this->pb.add_r1cs_constraint(
+            ConstraintT(m_hash.result(), 1, m_result),
+            FMT(this->annotation_prefix, ".result"));
+    }
+
+protected:
+    static const std::vector<VariableArrayT> make_chunks( const VariableArrayT& bits )
+    {
+        const auto chunk_size = txs_per_element() * TX_BITS;
+
+        std::vector<VariableArrayT> result;
+        for( size_t begin = 0; begin < bits.size(); begin += chunk_size )
+        {
+            const auto end = std::min(begin + chunk_size, bits.size());
+            result.emplace_back(bits.begin() + begin, bits.begin() + end);
+        }
+        return result;
+    }
+
+    static const VariableArrayT hash_inputs( const VariableT& merkle_root, const VariableT& new_root, const VariableArrayT& packed )
+    {
+        VariableArrayT result;
+        result.reserve(2 + packed.size());
+        result.emplace_back(merkle_root);
+        result.emplace_back(new_root);
+        result.insert(result.end(), packed.begin(), packed.end());
+        return result;
+    }
+};
+
+
+/**
+* Merkle root after the last transaction of a batch has been applied
+*
+* The path of `to` was recorded after `from` was updated, so the root is
+* computed from the updated `to` leaf and that path.
+*/
+static const ethsnarks::FieldT batch_new_root( const std::vector<TxProof>& items, MerkleHasher& hasher )
+{
+    const auto& last = items.back();
+    auto to = last.state_to;
+    to.balance += ethsnarks::FieldT(last.stx.tx.amount);
+    return hasher.root(hasher.leaf(to), last.stx.tx.to_idx, last.before_to);
+}
+
+
+/**
+* Public input of a batch, as computed by `public_input_gadget`
+*
+* The gadget is instantiated on a private protoboard, with the transaction
+* data, so the result is identical to the circuit.
+*/
+static const ethsnarks::FieldT batch_public_input( const std::vector<TxProof>& items, MerkleHasher& hasher )
+{
+    ProtoboardT pb;
+    const auto result = make_variable(pb, "result");
+    const auto merkle_root = make_variable(pb, "merkle_root");
+    const auto new_root = make_variable(pb, "new_root");
+
+    std::vector<VariableArrayT> tx_bits;
+    for( const auto& item : items )
+    {
+        const auto from_idx = make_var_array(pb, TREE_DEPTH, "from_idx");
+        const auto to_idx = make_var_array(pb, TREE_DEPTH, "to_idx");
+        const auto amount = make_var_array(pb, AMOUNT_BITS, "amount");
+        from_idx.fill_with_bits_of_ulong(pb, item.stx.tx.from_idx);
+        to_idx.fill_with_bits_of_ulong(pb, item.stx.tx.to_idx);
+        amount.fill_with_bits_of_ulong(pb, item.stx.tx.amount);
+        tx_bits.emplace_back(flatten({from_idx, to_idx, amount}));
+    }
+
+    public_input_gadget gadget(pb, result, merkle_root, new_root, tx_bits, "public_input");
+    pb.val(merkle_root) = items[0].merkle_root;
+    pb.val(new_root) = batch_new_root(items, hasher);
+    gadget.generate_r1cs_witness();
+
+    return pb.val(result);
+}
+
+
+// namespace snasma
+}
+
+// PUBLIC_INPUT_HPP_
+#endif
@@ -0,0 +1,504 @@
+#ifndef R1CSFILE_HPP_
+#define R1CSFILE_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "txfile.hpp"
+
+#include <libsnark/relations/constraint_satisfaction_problems/r1cs/r1cs.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <istream>
+#include <ostream>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Constraint system and witness export, in the binary `.r1cs` and `.wtns`
+* formats used by circom and snarkjs, so the circuit can be proven by
+* another prover process without linking the circuit code.
+*
+* Both files start with a 4 byte magic, a 32bit version and the number of
+* sections. Each section is a 32bit type, a 64bit size in bytes and then
+* its contents. All integers are little-endian, field elements are 32 byte
+* little-endian integers (not in Montgomery form), as `txfile.hpp`.
+*
+* `.r1cs`, version 1:
+*
+*   section 1, header
+*       4       size of a field element, 32
+*       32      field modulus
+*       4       number of wires, including the constant 1
+*       4       number of public outputs, 0
+*       4       number of public inputs
+*       4       number of private inputs, 0
+*       8       number of labels, the same as the number of wires
+*       4       number of constraints
+*
+*   section 2, constraints, each A*B = C as three linear combinations of:
+*       4       number of terms
+*       36      each term, a wire (4 bytes) and its coefficient
+*
+*       The terms are sorted by wire, each wire at most once with a non-zero
+*       coefficient, which other readers of the format expect.
+*
+*   section 3, label of each wire, 8 bytes each, the wire index
+*
+* `.wtns`, version 2:
+*
+*   section 1, header
+*       4       size of a field element, 32
+*       32      field modulus
+*       4       number of wires
+*
+*   section 2, the value of each wire
+*
+* Wire 0 is the constant 1, then the public inputs, then the auxiliary
+* variables, which is the same as the variable indices of the protoboard.
+* The constraint system depends only on the circuit size, so it's exported
+* once for each, the witness for every batch.
+*/
+static const char R1CS_MAGIC[4] = {'r', '1', 'c', 's'};
+static const uint32_t R1CS_VERSION = 1;
+static const char WTNS_MAGIC[4] = {'w', 't', 'n', 's'};
+static const uint32_t WTNS_VERSION = 2;
+static const size_t R1CS_FIELD_SIZE = TXFILE_FIELD_SIZE;
+
+typedef libsnark::linear_combination<ethsnarks::FieldT> LinearCombinationT;
+typedef libsnark::linear_term<ethsnarks::FieldT> LinearTermT;
+
+
+static void write_le32( std::ostream& os, uint32_t x )
+{
+    uint8_t buf[4];
+    store_le32(buf, x);
+    os.write((const char*)buf, sizeof(buf));
+}
+
+
+static void write_le64( std::ostream& os, uint64_t x )
+{
+    uint8_t buf[8];
+    store_le64(buf, x);
+    os.write((const char*)buf, sizeof(buf));
+}
+
+
+static void write_field_le( std::ostream& os, const ethsnarks::FieldT& x )
+{
+    uint8_t buf[R1CS_FIELD_SIZE];
+    encode_field(buf, x);
+    os.write((const char*)buf, sizeof(buf));
+}
+
+
+static void write_section_header( std::ostream& os, uint32_t type, uint64_t size )
+{
+    write_le32(os, type);
+    write_le64(os, size);
+}
+
+
+/**
+* Size of a field element, then the modulus
+*/
+static void write_field_description( std::ostream& os )
+{
+    write_le32(os, R1CS_FIELD_SIZE);
+    for( size_t i = 0; i < ethsnarks::FieldT::num_limbs; i++ ) {
+        write_le64(os, ethsnarks::FieldT::mod.data[i]);
+    }
+}
+
+
+/**
+* The terms of `lc` sorted by wire, with the coefficients of a repeated wire
+* added together and zero coefficients dropped. libsnark doesn't normalise
+* linear combinations, a gadget can add the same variable more than once.
+*
+* @param out Reused between calls, to avoid allocating for each
+*/
+static void normalize_lc( const LinearCombinationT& lc, std::vector<LinearTermT>& out )
+{
+    out.assign(lc.terms.begin(), lc.terms.end());
+    std::sort(out.begin(), out.end(), []( const LinearTermT& a, const LinearTermT& b ) {
+        return a.index < b.index;
+    });
+
+    size_t n = 0;
+    for( size_t i = 0; i < out.size(); )
+    {
+        auto term = out[i];
+        for( i++; i < out.size() && out[i].index == term.index; i++ ) {
+            term.coeff += out[i].coeff;
+        }
+        if( ! term.coeff.is_zero() ) {
+            out[n++] = term;
+        }
+    }
+    out.erase(out.begin() + n, out.end());
+}
+
+
+static uint64_t r1cs_lc_size( const LinearCombinationT& lc, std::vector<LinearTermT>& terms )
+{
+    normalize_lc(lc, terms);
+    return 4 + (terms.size() * (4 + R1CS_FIELD_SIZE));
+}
+
+
+static void write_r1cs_lc( std::ostream& os, const LinearCombinationT& lc, std::vector<LinearTermT>& terms )
+{
+    normalize_lc(lc, terms);
+    write_le32(os, uint32_t(terms.size()));
+    for( const auto& term : terms )
+    {
+        write_le32(os, uint32_t(term.index));
+        write_field_le(os, term.coeff);
+    }
+}
+
+
+static bool write_r1cs( std::ostream& os, const libsnark::r1cs_constraint_system<ethsnarks::FieldT>& cs )
+{
+    const uint64_t n_wires = 1 + cs.num_variables();
+
+    // Normalised twice, rather than keeping a copy of every constraint
+    std::vector<LinearTermT> terms;
+    uint64_t constraints_size = 0;
+    for( const auto& constraint : cs.constraints ) {
+        constraints_size += r1cs_lc_size(constraint.a, terms) + r1cs_lc_size(constraint.b, terms) + r1cs_lc_size(constraint.c, terms);
+    }
+
+    os.write(R1CS_MAGIC, sizeof(R1CS_MAGIC));
+    write_le32(os, R1CS_VERSION);
+    write_le32(os, 3);
+
+    write_section_header(os, 1, 4 + R1CS_FIELD_SIZE + (4 * 4) + 8 + 4);
+    write_field_description(os);
+    write_le32(os, uint32_t(n_wires));
+    write_le32(os, 0);
+    write_le32(os, uint32_t(cs.num_inputs()));
+    write_le32(os, 0);
+    write_le64(os, n_wires);
+    write_le32(os, uint32_t(cs.num_constraints()));
+
+    write_section_header(os, 2, constraints_size);
+    for( const auto& constraint : cs.constraints )
+    {
+        write_r1cs_lc(os, constraint.a, terms);
+        write_r1cs_lc(os, constraint.b, terms);
+        write_r1cs_lc(os, constraint.c, terms);
+    }
+
+    write_section_header(os, 3, n_wires * 8);
+    for( uint64_t i = 0; i < n_wires; i++ ) {
+        write_le64(os, i);
+    }
+
+    return bool(os);
+}
+
+
+/**
+* @param assignment Every variable except the constant, as
+*                   `full_variable_assignment` of the protoboard
+*/
+static bool write_witness( std::ostream& os, const libsnark::r1cs_variable_assignment<ethsnarks::FieldT>& assignment )
+{
+    const uint64_t n_wires = 1 + assignment.size();
+
+    os.write(WTNS_MAGIC, sizeof(WTNS_MAGIC));
+    write_le32(os, WTNS_VERSION);
+    write_le32(os, 2);
+
+    write_section_header(os, 1, 4 + R1CS_FIELD_SIZE + 4);
+    write_field_description(os);
+    write_le32(os, uint32_t(n_wires));
+
+    // Encoded in blocks, rather than one write per element
+    write_section_header(os, 2, n_wires * R1CS_FIELD_SIZE);
+    std::vector<uint8_t> buf(4096 * R1CS_FIELD_SIZE);
+    for( uint64_t begin = 0; begin < n_wires; begin += 4096 )
+    {
+        const auto end = std::min(begin + 4096, n_wires);
+        for( auto i = begin; i < end; i++ ) {
+            encode_field(buf.data() + ((i - begin) * R1CS_FIELD_SIZE), i ? assignment[i - 1] : ethsnarks::FieldT::one());
+        }
+        os.write((const char*)buf.data(), (end - begin) * R1CS_FIELD_SIZE);
+    }
+
+    return bool(os);
+}
+
+
+static bool read_le32( std::istream& is, uint32_t& out )
+{
+    uint8_t buf[4];
+    if( ! is.read((char*)buf, sizeof(buf)) ) {
+        return false;
+    }
+    out = load_le32(buf);
+    return true;
+}
+
+
+static bool read_le64( std::istream& is, uint64_t& out )
+{
+    uint8_t buf[8];
+    if( ! is.read((char*)buf, sizeof(buf)) ) {
+        return false;
+    }
+    out = load_le64(buf);
+    return true;
+}
+
+
+static bool read_field_le( std::istream& is, ethsnarks::FieldT& out )
+{
+    uint8_t buf[R1CS_FIELD_SIZE];
+    return is.read((char*)buf, sizeof(buf)) && decode_field(buf, out);
+}
+
+
+/**
+* The magic and version, then the number of sections
+*/
+static bool read_file_header( std::istream& is, const char *magic, uint32_t version, uint32_t& n_sections )
+{
+    char buf[4];
+    uint32_t file_version;
+    if( ! is.read(buf, sizeof(buf)) || memcmp(buf, magic, sizeof(buf)) != 0
+     || ! read_le32(is, file_version) || file_version != version
+     || ! read_le32(is, n_sections) ) {
+        std::cerr << "error r1cs: bad magic or version" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+/**
+* Size of a field element, then the modulus, which must be this field
+*/
+static bool read_field_description( std::istream& is )
+{
+    uint32_t field_size;
+    if( ! read_le32(is, field_size) || field_size != R1CS_FIELD_SIZE ) {
+        std::cerr << "error r1cs: field elements aren't " << R1CS_FIELD_SIZE << " bytes" << std::endl;
+        return false;
+    }
+
+    for( size_t i = 0; i < ethsnarks::FieldT::num_limbs; i++ )
+    {
+        uint64_t limb;
+        if( ! read_le64(is, limb) || limb != ethsnarks::FieldT::mod.data[i] ) {
+            std::cerr << "error r1cs: different field modulus" << std::endl;
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+* Read a linear combination, which must be normalised as `normalize_lc`
+*/
+static bool read_r1cs_lc( std::istream& is, uint64_t n_wires, LinearCombinationT& lc )
+{
+    uint32_t n_terms;
+    if( ! read_le32(is, n_terms) || n_terms > n_wires ) {
+        std::cerr << "error r1cs: bad number of terms" << std::endl;
+        return false;
+    }
+
+    lc.terms.clear();
+    lc.terms.reserve(n_terms);
+    for( uint32_t i = 0; i < n_terms; i++ )
+    {
+        uint32_t wire;
+        ethsnarks::FieldT coeff;
+        if( ! read_le32(is, wire) || ! read_field_le(is, coeff) ) {
+            std::cerr << "error r1cs: truncated or invalid term" << std::endl;
+            return false;
+        }
+
+        if( wire >= n_wires || (i > 0 && wire <= lc.terms.back().index) || coeff.is_zero() ) {
+            std::cerr << "error r1cs: terms not normalised, wire " << wire << std::endl;
+            return false;
+        }
+
+        lc.terms.emplace_back(libsnark::variable<ethsnarks::FieldT>(wire), coeff);
+    }
+
+    return true;
+}
+
+
+/**
+* Read a `.r1cs` file, as written by `write_r1cs`. Sections other than the
+* header and constraints are skipped, the header must be first.
+*
+* @param n_wires Number of wires, including the constant 1
+*/
+static bool read_r1cs( std::istream& is, libsnark::r1cs_constraint_system<ethsnarks::FieldT>& cs, uint64_t& n_wires )
+{
+    uint32_t n_sections;
+    if( ! read_file_header(is, R1CS_MAGIC, R1CS_VERSION, n_sections) ) {
+        return false;
+    }
+
+    bool have_header = false;
+    bool have_constraints = false;
+    uint32_t n_constraints = 0;
+    for( uint32_t i = 0; i < n_sections; i++ )
+    {
+        uint32_t type;
+        uint64_t size;
+        if( ! read_le32(is, type) || ! read_le64(is, size) ) {
+            std::cerr << "error r1cs: truncated section " << i << std::endl;
+            return false;
+        }
+
+        const auto start = is.tellg();
+        if( type == 1 )
+        {
+            uint32_t wires, n_outputs, n_inputs, n_private;
+            uint64_t n_labels;
+            if( ! read_field_description(is)
+             || ! read_le32(is, wires) || ! read_le32(is, n_outputs)
+             || ! read_le32(is, n_inputs) || ! read_le32(is, n_private)
+             || ! read_le64(is, n_labels) || ! read_le32(is, n_constraints) ) {
+                return false;
+            }
+
+            if( uint64_t(wires) < uint64_t(1) + n_outputs + n_inputs + n_private ) {
+                std::cerr << "error r1cs: more inputs than wires" << std::endl;
+                return false;
+            }
+
+            n_wires = wires;
+            cs.primary_input_size = n_outputs + n_inputs;
+            cs.auxiliary_input_size = wires - 1 - cs.primary_input_size;
+            have_header = true;
+        }
+        else if( type == 2 )
+        {
+            if( ! have_header ) {
+                std::cerr << "error r1cs: constraints before the header" << std::endl;
+                return false;
+            }
+
+            cs.constraints.clear();
+            cs.constraints.reserve(n_constraints);
+            for( uint32_t j = 0; j < n_constraints; j++ )
+            {
+                libsnark::r1cs_constraint<ethsnarks::FieldT> constraint;
+                if( ! read_r1cs_lc(is, n_wires, constraint.a)
+                 || ! read_r1cs_lc(is, n_wires, constraint.b)
+                 || ! read_r1cs_lc(is, n_wires, constraint.c) ) {
+                    std::cerr << "error r1cs: cannot read constraint " << j << std::endl;
+                    return false;
+                }
+                cs.constraints.emplace_back(std::move(constraint));
+            }
+            have_constraints = true;
+        }
+        else {
+            is.seekg(std::streamoff(size), std::ios::cur);
+        }
+
+        if( ! is || uint64_t(is.tellg() - start) != size ) {
+            std::cerr << "error r1cs: section " << i << " isn't " << size << " bytes" << std::endl;
+            return false;
+        }
+    }
+
+    if( ! have_constraints ) {
+        std::cerr << "error r1cs: no constraints section" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+* Read a `.wtns` file, as written by `write_witness`
+*
+* @param values Every wire, including the constant 1
+*/
+static bool read_witness( std::istream& is, std::vector<ethsnarks::FieldT>& values )
+{
+    uint32_t n_sections;
+    if( ! read_file_header(is, WTNS_MAGIC, WTNS_VERSION, n_sections) ) {
+        return false;
+    }
+
+    bool have_header = false;
+    bool have_values = false;
+    uint32_t n_wires = 0;
+    for( uint32_t i = 0; i < n_sections; i++ )
+    {
+        uint32_t type;
+        uint64_t size;
+        if( ! read_le32(is, type) || ! read_le64(is, size) ) {
+            std::cerr << "error r1cs: truncated witness section " << i << std::endl;
+            return false;
+        }
+
+        const auto start = is.tellg();
+        if( type == 1 )
+        {
+            if( ! read_field_description(is) || ! read_le32(is, n_wires) ) {
+                return false;
+            }
+            have_header = true;
+        }
+        else if( type == 2 )
+        {
+            if( ! have_header ) {
+                std::cerr << "error r1cs: witness values before the header" << std::endl;
+                return false;
+            }
+
+            values.resize(n_wires);
+            for( auto& value : values )
+            {
+                if( ! read_field_le(is, value) ) {
+                    std::cerr << "error r1cs: truncated or invalid witness value" << std::endl;
+                    return false;
+                }
+            }
+            have_values = true;
+        }
+        else {
+            is.seekg(std::streamoff(size), std::ios::cur);
+        }
+
+        if( ! is || uint64_t(is.tellg() - start) != size ) {
+            std::cerr << "error r1cs: witness section " << i << " isn't " << size << " bytes" << std::endl;
+            return false;
+        }
+    }
+
+    if( ! have_values ) {
+        std::cerr << "error r1cs: no witness values section" << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// namespace snasma
+}
+
+// R1CSFILE_HPP_
+#endif
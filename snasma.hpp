@@ -5,7 +5,18 @@
 // License: GPL-3.0+
 
 #include "ethsnarks.hpp"
+#include "utils.hpp"
 #include "jubjub/point.hpp"
+#include "gadgets/longsightl.hpp"
+#include "gadgets/merkle_tree.hpp"
+
+#include "fieldio.hpp"
+
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
 
 
 namespace snasma {
@@ -15,9 +26,32 @@ static const size_t TREE_DEPTH = 24;
 static const size_t AMOUNT_BITS = 32;
 static const size_t BALANCE_BITS = 120;
 
+/**
+* Largest number of transactions in a `TxGroupCircuit`, the signed message
+* grows by 104 bits for each one
+*/
+static const size_t MAX_GROUP_SIZE = 256;
+
 using std::endl;
 
 
+/**
+* Compare two field elements as unsigned integers, returns true if `a < b`
+*/
+static bool field_lt( const ethsnarks::FieldT& a, const ethsnarks::FieldT& b )
+{
+    const auto a_int = a.as_bigint();
+    const auto b_int = b.as_bigint();
+    for( size_t i = ethsnarks::FieldT::num_limbs; i-- > 0; )
+    {
+        if( a_int.data[i] != b_int.data[i] ) {
+            return a_int.data[i] < b_int.data[i];
+        }
+    }
+    return false;
+}
+
+
 /**
 * Contains the only information published on-chain
 *
@@ -73,6 +107,11 @@ public:
 
         return is;
     }
+
+    friend std::ostream& operator<< (std::ostream& os, const OnchainTransaction& self)
+    {
+        return os << self.from_idx << " " << self.to_idx << " " << self.amount;
+    }
 };
 
 
@@ -91,20 +130,23 @@ public:
 
     friend std::istream& operator>> (std::istream& is, Signature& self)
     {
-        if ( ! (is >> self.R) ) {
+        if ( ! read_point(is, self.R) ) {
             std::cerr << "error read R" << endl;
         }
 
-        std::string read_str;
-        if ( ! (is >> read_str) ) {        
+        if ( ! read_field(is, self.s) ) {
             std::cerr << "error read s" << endl;
         }
-        else {
-            self.s = decltype(self.s)(read_str.c_str());
-        }
 
         return is;
     }
+
+    friend std::ostream& operator<< (std::ostream& os, const Signature& self)
+    {
+        write_field(os, self.R.x) << " ";
+        write_field(os, self.R.y) << " ";
+        return write_field(os, self.s);
+    }
 };
 
 
@@ -129,7 +171,7 @@ public:
 
     AccountState(const decltype(pubkey) in_pubkey, const decltype(balance) in_balance
     ) :
-        pubkey(in_pubkey), balance(in_balance)
+        pubkey(in_pubkey), balance(in_balance), nonce(0)
     {
         assert( is_valid() );
     }
@@ -140,11 +182,11 @@ public:
 
     friend std::istream& operator>> (std::istream& is, AccountState& self)
     {
-        if( ! (is >> self.pubkey) ) {
+        if( ! read_point(is, self.pubkey) ) {
             std::cerr << "error reading AccountState.pubkey" << endl;
         }
 
-        if( ! (is >> self.balance) ) {
+        if( ! read_field(is, self.balance) ) {
             std::cerr << "error reading AccountState.balance" << endl;
         }
 
@@ -154,6 +196,14 @@ public:
 
         return is;
     }
+
+    friend std::ostream& operator<< (std::ostream& os, const AccountState& self)
+    {
+        write_field(os, self.pubkey.x) << " ";
+        write_field(os, self.pubkey.y) << " ";
+        write_field(os, self.balance) << " ";
+        return os << self.nonce;
+    }
 };
 
 
@@ -207,11 +257,16 @@ public:
         return is;
     }
 
+    friend std::ostream& operator<< (std::ostream& os, const SignedTransaction& self)
+    {
+        return os << self.tx << " " << self.nonce << " " << self.sig;
+    }
+
     /**
     * @return Message to be signed, as a bit vector
     */
-    const libff::bit_vector message()
-    {       
+    const libff::bit_vector message() const
+    {
         return ethsnarks::int_list_to_bits(
             {tx.from_idx, tx.to_idx,  tx.amount, nonce},
             {TREE_DEPTH,  TREE_DEPTH, AMOUNT_BITS,        TREE_DEPTH});
@@ -219,16 +274,124 @@ public:
 };
 
 
+/**
+* Transactions from one account with consecutive nonces, authorised by a
+* single signature over all of them, see `TxGroupCircuit`
+*/
+class SignedTransactionGroup
+{
+public:
+    Signature sig;
+
+    /**
+    * Every transaction has the same `from_idx`
+    */
+    std::vector<OnchainTransaction> txs;
+
+    /**
+    * Nonce of the first transaction, the i'th uses `nonce + i`
+    */
+    uint32_t nonce;
+
+    SignedTransactionGroup() {}
+
+    SignedTransactionGroup(const decltype(sig) in_sig, const decltype(txs) in_txs, const decltype(nonce) in_nonce
+    ) :
+        sig(in_sig), txs(in_txs), nonce(in_nonce)
+    {
+        assert( is_valid() );
+    }
+
+    bool is_valid()
+    {
+        if( txs.empty() || (nonce + txs.size()) > (size_t(1) << TREE_DEPTH) ) {
+            return false;
+        }
+
+        for( auto& tx : txs )
+        {
+            if( ! tx.is_valid() || tx.from_idx != txs[0].from_idx ) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+    * The i'th transaction, with the signature of the group
+    */
+    const SignedTransaction transaction( size_t i ) const
+    {
+        return SignedTransaction(sig, txs[i], uint32_t(nonce + i));
+    }
+
+    friend std::istream& operator>> (std::istream& is, SignedTransactionGroup& self)
+    {
+        size_t count = 0;
+        if ( ! (is >> count) || count == 0 || count > MAX_GROUP_SIZE ) {
+            std::cerr << "error read SignedTransactionGroup.count" << endl;
+            is.setstate(std::ios::failbit);
+            return is;
+        }
+
+        self.txs.resize(count);
+        for( auto& tx : self.txs )
+        {
+            if ( ! (is >> tx) ) {
+                std::cerr << "error read SignedTransactionGroup.tx" << endl;
+                return is;
+            }
+        }
+
+        if ( ! (is >> self.nonce) ) {
+            std::cerr << "error read SignedTransactionGroup.nonce" << endl;
+            return is;
+        }
+
+        if ( ! (is >> self.sig) ) {
+            std::cerr << "error read SignedTransactionGroup.sig" << endl;
+        }
+
+        return is;
+    }
+
+    friend std::ostream& operator<< (std::ostream& os, const SignedTransactionGroup& self)
+    {
+        os << self.txs.size();
+        for( const auto& tx : self.txs ) {
+            os << " " << tx;
+        }
+        return os << " " << self.nonce << " " << self.sig;
+    }
+
+    /**
+    * @return Message to be signed, the concatenated messages of each
+    *         transaction as a bit vector
+    */
+    const libff::bit_vector message() const
+    {
+        libff::bit_vector result;
+        for( size_t i = 0; i < txs.size(); i++ )
+        {
+            const auto bits = transaction(i).message();
+            result.insert(result.end(), bits.begin(), bits.end());
+        }
+        return result;
+    }
+};
+
+
 static std::istream& read_tree_path (std::istream& is, std::vector<ethsnarks::FieldT>& ov)
 {
-    std::string read_str;
+    ethsnarks::FieldT item;
     for( size_t i = 0; i < TREE_DEPTH; i++ )
-    {            
-        if ( ! (is >> read_str) ) {
+    {
+        if ( ! read_field(is, item) ) {
             std::cerr << "error read path " << i << endl;
             break;
         }
-        ov.emplace_back(read_str.c_str());
+        ov.emplace_back(item);
     }
 
     return is;
@@ -251,9 +414,18 @@ public:
     std::vector<ethsnarks::FieldT> before_from;
     std::vector<ethsnarks::FieldT> before_to;
 
+    /**
+    * Padding transaction, see `TxCircuit`
+    */
+    bool is_noop;
+
+    TxProof() :
+        is_noop(false)
+    { }
+
     bool is_valid()
     {
-        return stx.is_valid()
+        return (is_noop ? (stx.tx.amount == 0) : stx.is_valid())
             && state_from.is_valid()
             && state_to.is_valid()
             && before_from.size() == TREE_DEPTH
@@ -262,13 +434,9 @@ public:
 
     friend std::istream& operator>> (std::istream& is, TxProof& self)
     {
-        std::string read_str;
-        if ( ! (is >> read_str) ) {        
+        if ( ! read_field(is, self.merkle_root) ) {
             std::cerr << "error read merkle_root" << endl;
         }
-        else {
-            self.merkle_root = decltype(self.merkle_root)(read_str.c_str());
-        }
 
         if ( ! (is >> self.stx) ) {
             std::cerr << "error read TxProof.stx" << endl;
@@ -292,9 +460,911 @@ public:
 
         return is;
     }
+
+    /**
+    * Writes the proof as a single line, in the same format as `snasma.py`
+    */
+    friend std::ostream& operator<< (std::ostream& os, const TxProof& self)
+    {
+        write_field(os, self.merkle_root) << " " << self.stx << " " << self.state_from << " " << self.state_to;
+
+        for( const auto& item : self.before_from ) {
+            write_field(os << " ", item);
+        }
+
+        for( const auto& item : self.before_to ) {
+            write_field(os << " ", item);
+        }
+
+        return os;
+    }
+};
+
+
+/**
+* Proofs for a group of transactions from one sender, as recorded by
+* `AccountTree::apply`, with one signature over all of them, the witness for
+* `TxGroupCircuit`
+*
+* As text, on a single line: the number of transactions, each `TxProof`
+* (their own signatures are ignored), then the signature of the group.
+*/
+class TxGroupProof
+{
+public:
+    std::vector<TxProof> txs;
+    Signature sig;
+
+    /**
+    * @return Message signed by the group, the concatenated messages of each
+    *         transaction, as `SignedTransactionGroup::message`
+    */
+    const libff::bit_vector message() const
+    {
+        libff::bit_vector result;
+        for( const auto& item : txs )
+        {
+            const auto bits = item.stx.message();
+            result.insert(result.end(), bits.begin(), bits.end());
+        }
+        return result;
+    }
+
+    friend std::istream& operator>> (std::istream& is, TxGroupProof& self)
+    {
+        size_t count = 0;
+        if ( ! (is >> count) || count == 0 || count > MAX_GROUP_SIZE ) {
+            std::cerr << "error read TxGroupProof.count" << endl;
+            is.setstate(std::ios::failbit);
+            return is;
+        }
+
+        self.txs.resize(count);
+        for( auto& item : self.txs )
+        {
+            if ( ! (is >> item) ) {
+                std::cerr << "error read TxGroupProof.tx" << endl;
+                return is;
+            }
+        }
+
+        if ( ! (is >> self.sig) ) {
+            std::cerr << "error read TxGroupProof.sig" << endl;
+        }
+
+        return is;
+    }
+
+    friend std::ostream& operator<< (std::ostream& os, const TxGroupProof& self)
+    {
+        os << self.txs.size();
+        for( const auto& item : self.txs ) {
+            os << " " << item;
+        }
+        return os << " " << self.sig;
+    }
+};
+
+
+/**
+* Computes leaf and node hashes natively
+*
+* The LongsightL12p5_MP gadgets are instantiated once on a private protoboard,
+* and only their witness generation is used. This guarantees the values are
+* identical to those computed by `TxCircuit`, and avoids creating a new
+* protoboard for every hash.
+*
+* Instances are not thread-safe, use one per thread.
+*/
+class MerkleHasher
+{
+public:
+    typedef ethsnarks::FieldT FieldT;
+
+    ethsnarks::ProtoboardT m_pb;
+
+    // Per-level IVs, the same as used by the merkle path gadgets
+    const ethsnarks::VariableArrayT m_IVs;
+
+    // leaf = H(pubkey.x, pubkey.y, balance, nonce), with IV of 1
+    const ethsnarks::VariableArrayT m_leaf_inputs;
+    ethsnarks::LongsightL12p5_MP_gadget m_leaf;
+
+    // node = H(left, right), with IV of the level
+    const ethsnarks::VariableT m_node_IV;
+    const ethsnarks::VariableArrayT m_node_inputs;
+    ethsnarks::LongsightL12p5_MP_gadget m_node;
+
+    MerkleHasher() :
+        m_IVs(ethsnarks::merkle_tree_IVs(m_pb)),
+        m_leaf_inputs(ethsnarks::make_var_array(m_pb, 4, "leaf_inputs")),
+        m_leaf(m_pb, libsnark::ONE, m_leaf_inputs, "leaf"),
+        m_node_IV(ethsnarks::make_variable(m_pb, "node_IV")),
+        m_node_inputs(ethsnarks::make_var_array(m_pb, 2, "node_inputs")),
+        m_node(m_pb, m_node_IV, m_node_inputs, "node")
+    { }
+
+    // The gadgets hold a reference to `m_pb`
+    MerkleHasher( const MerkleHasher& ) = delete;
+    MerkleHasher& operator= ( const MerkleHasher& ) = delete;
+
+    const FieldT leaf( const AccountState& state )
+    {
+        m_pb.val(m_leaf_inputs[0]) = state.pubkey.x;
+        m_pb.val(m_leaf_inputs[1]) = state.pubkey.y;
+        m_pb.val(m_leaf_inputs[2]) = state.balance;
+        m_pb.val(m_leaf_inputs[3]) = state.nonce;
+        m_leaf.generate_r1cs_witness();
+        return m_pb.val(m_leaf.result());
+    }
+
+    const FieldT node( size_t level, const FieldT& left, const FieldT& right )
+    {
+        m_pb.val(m_node_IV) = m_pb.val(m_IVs[level]);
+        m_pb.val(m_node_inputs[0]) = left;
+        m_pb.val(m_node_inputs[1]) = right;
+        m_node.generate_r1cs_witness();
+        return m_pb.val(m_node.result());
+    }
+
+    /**
+    * Merkle root from a leaf, its index and the path of siblings
+    */
+    const FieldT root( const FieldT& leaf, size_t index, const std::vector<FieldT>& path )
+    {
+        FieldT current = leaf;
+        for( size_t level = 0; level < path.size(); level++ )
+        {
+            if( (index >> level) & 1 ) {
+                current = node(level, path[level], current);
+            }
+            else {
+                current = node(level, current, path[level]);
+            }
+        }
+        return current;
+    }
+};
+
+
+/**
+* Create a padding transaction which follows on from `last`
+*
+* The `to` account of `last`, with its balance after the transfer, is used
+* for both sides of the no-op. Its path doesn't change when its own leaf is
+* updated, so the proof needs nothing but `last`.
+*
+* The signature is (R = G, s = 1), which verifies against the identity
+* point that `TxCircuit` substitutes for the public key of no-ops.
+*/
+static const TxProof make_noop( const TxProof& last, MerkleHasher& hasher, const ethsnarks::jubjub::Params& params )
+{
+    TxProof noop;
+    noop.is_noop = true;
+
+    noop.state_from = last.state_to;
+    noop.state_from.balance += ethsnarks::FieldT(last.stx.tx.amount);
+    noop.state_to = noop.state_from;
+    noop.before_from = last.before_to;
+    noop.before_to = last.before_to;
+
+    noop.stx.tx.from_idx = last.stx.tx.to_idx;
+    noop.stx.tx.to_idx = last.stx.tx.to_idx;
+    noop.stx.tx.amount = 0;
+    noop.stx.nonce = noop.state_from.nonce;
+    noop.stx.sig = Signature(ethsnarks::jubjub::EdwardsPoint(params.Gx, params.Gy), ethsnarks::FieldT::one());
+
+    noop.merkle_root = hasher.root(hasher.leaf(noop.state_from), noop.stx.tx.from_idx, noop.before_from);
+
+    return noop;
+}
+
+
+/**
+* Per-level roots of empty subtrees
+*
+* Empty leaves have a value of zero, and the root of an empty subtree of
+* height `l+1` is `H_l(empty[l], empty[l])`, using the same per-level IVs as
+* `merkle_tree_IVs`. Any node which hasn't been written is one of these.
+*/
+static const std::vector<ethsnarks::FieldT> merkle_tree_empty( MerkleHasher& hasher )
+{
+    std::vector<ethsnarks::FieldT> result;
+    result.reserve(TREE_DEPTH + 1);
+    result.emplace_back(ethsnarks::FieldT::zero());
+    for( size_t level = 0; level < TREE_DEPTH; level++ )
+    {
+        result.emplace_back(hasher.node(level, result[level], result[level]));
+    }
+    return result;
+}
+
+
+/**
+* Dense node storage
+*
+* Only the left-most `2^k` leaves of the tree are stored, this is efficient
+* when accounts are allocated sequentially. All levels are kept in one flat
+* array, level by level, with `m_offsets[l]` being the start of level `l`.
+* Nodes to the right of the stored region are roots of empty subtrees.
+*
+* Storage grows by doubling `2^k` until it covers the highest leaf written.
+*/
+class DenseNodeStore
+{
+public:
+    typedef ethsnarks::FieldT FieldT;
+
+    // Number of leaves stored in `m_nodes` is `1 << m_capacity_depth`
+    size_t m_capacity_depth;
+
+    std::vector<size_t> m_offsets;
+    std::vector<FieldT> m_nodes;
+
+    DenseNodeStore() :
+        m_capacity_depth(0)
+    { }
+
+    const FieldT* find( size_t level, size_t index ) const
+    {
+        if( m_nodes.empty() || index >= level_width(m_capacity_depth, level) ) {
+            return nullptr;
+        }
+        return &m_nodes[m_offsets[level] + index];
+    }
+
+    void set( size_t level, size_t index, const FieldT& value )
+    {
+        m_nodes[m_offsets[level] + index] = value;
+    }
+
+    /**
+    * Ensure the leaf at `index` can be written
+    */
+    void reserve( size_t index, const std::vector<FieldT>& empty )
+    {
+        size_t depth = m_capacity_depth;
+        while( index >= (size_t(1) << depth) ) {
+            depth++;
+        }
+
+        if( m_nodes.empty() || depth != m_capacity_depth ) {
+            layout(depth, empty);
+        }
+    }
+
+    size_t num_nodes() const
+    {
+        return m_nodes.size();
+    }
+
+    size_t memory_usage() const
+    {
+        return m_nodes.capacity() * sizeof(FieldT) + m_offsets.capacity() * sizeof(size_t);
+    }
+
+protected:
+    static size_t level_width( size_t capacity_depth, size_t level )
+    {
+        return level < capacity_depth ? (size_t(1) << (capacity_depth - level)) : 1;
+    }
+
+    /**
+    * Re-allocate the node array to store `1<<capacity_depth` leaves,
+    * existing nodes are kept at the same (level, index)
+    */
+    void layout( size_t capacity_depth, const std::vector<FieldT>& empty )
+    {
+        std::vector<size_t> offsets(TREE_DEPTH + 2, 0);
+        for( size_t level = 0; level <= TREE_DEPTH; level++ )
+        {
+            offsets[level + 1] = offsets[level] + level_width(capacity_depth, level);
+        }
+
+        std::vector<FieldT> nodes;
+        nodes.reserve(offsets[TREE_DEPTH + 1]);
+        for( size_t level = 0; level <= TREE_DEPTH; level++ )
+        {
+            const auto width = level_width(capacity_depth, level);
+            for( size_t index = 0; index < width; index++ )
+            {
+                const auto existing = find(level, index);
+                nodes.emplace_back(existing ? *existing : empty[level]);
+            }
+        }
+
+        m_capacity_depth = capacity_depth;
+        m_offsets.swap(offsets);
+        m_nodes.swap(nodes);
+    }
+};
+
+
+/**
+* Sparse node storage
+*
+* Only nodes which have been written are stored, keyed by (level, index).
+* Memory grows with the number of occupied leaves rather than with the
+* size of the tree, at the cost of a hash table lookup per node.
+*/
+class SparseNodeStore
+{
+public:
+    typedef ethsnarks::FieldT FieldT;
+
+    std::unordered_map<uint64_t, FieldT> m_nodes;
+
+    static uint64_t key( size_t level, size_t index )
+    {
+        return (uint64_t(level) << 32) | uint64_t(index);
+    }
+
+    const FieldT* find( size_t level, size_t index ) const
+    {
+        const auto it = m_nodes.find(key(level, index));
+        if( it == m_nodes.end() ) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+
+    void set( size_t level, size_t index, const FieldT& value )
+    {
+        m_nodes[key(level, index)] = value;
+    }
+
+    void reserve( size_t /* index */, const std::vector<FieldT>& /* empty */ )
+    {
+        // Nodes are materialized as they're written
+    }
+
+    size_t num_nodes() const
+    {
+        return m_nodes.size();
+    }
+
+    size_t memory_usage() const
+    {
+        // Approximation of a node-based hash table: a bucket pointer, and one
+        // heap allocated node (next pointer, key, value, cached hash) per entry
+        return (m_nodes.bucket_count() * sizeof(void*))
+             + (m_nodes.size() * (sizeof(void*) + sizeof(uint64_t) + sizeof(FieldT) + sizeof(size_t)));
+    }
+};
+
+
+/**
+* What `AccountTreeT::apply_many` changed, so the proofs it skipped can be
+* produced afterwards by `AccountTreeT::bulk_proofs`
+*
+* Every node on the path of a modified leaf is recorded with its value
+* before the update, and every modified account with its state before the
+* update. Any other node is the same before and after, so it's read from the
+* tree, which is why the proofs must be taken before it's modified again.
+*/
+class BulkRecord
+{
+public:
+    typedef ethsnarks::FieldT FieldT;
+
+    FieldT merkle_root;
+    FieldT new_root;
+    std::vector<SignedTransaction> stxs;
+    std::unordered_map<size_t, AccountState> accounts;
+    std::unordered_map<uint64_t, FieldT> nodes;
+
+    static uint64_t node_key( size_t level, size_t index )
+    {
+        return (uint64_t(level) << 32) | uint64_t(index);
+    }
+
+    void clear()
+    {
+        stxs.clear();
+        accounts.clear();
+        nodes.clear();
+    }
 };
 
 
+/**
+* Native account state merkle tree
+*
+* Performs the same job as `AccountManager` in `snasma.py`, but computes all
+* hashes natively and emits `TxProof` objects which can be passed directly
+* to `TxCircuit::generate_r1cs_witness`.
+*
+* The layout of nodes in memory is determined by `NodeStoreT`, nodes which
+* aren't stored are the roots of empty subtrees, see `merkle_tree_empty`.
+* The roots and paths are identical regardless of which store is used.
+*/
+template<typename NodeStoreT>
+class AccountTreeT
+{
+public:
+    typedef ethsnarks::FieldT FieldT;
+
+    MerkleHasher m_hasher;
+
+    // m_empty[l] is the root of an empty subtree of height `l`
+    const std::vector<FieldT> m_empty;
+
+    NodeStoreT m_store;
+
+    std::unordered_map<size_t, AccountState> m_accounts;
+
+    // Index used by the next call to `append`
+    size_t m_next_index;
+
+    // Hashers for the extra threads of bulk updates, created on first use
+    std::vector<std::unique_ptr<MerkleHasher>> m_thread_hashers;
+
+    AccountTreeT( size_t capacity = 1 ) :
+        m_empty(merkle_tree_empty(m_hasher)),
+        m_next_index(0)
+    {
+        m_store.reserve(capacity > 0 ? capacity - 1 : 0, m_empty);
+    }
+
+    size_t size() const
+    {
+        return m_accounts.size();
+    }
+
+    bool exists( size_t index ) const
+    {
+        return m_accounts.count(index) != 0;
+    }
+
+    const AccountState& account( size_t index ) const
+    {
+        return m_accounts.at(index);
+    }
+
+    const FieldT& root() const
+    {
+        return node(TREE_DEPTH, 0);
+    }
+
+    const FieldT& node( size_t level, size_t index ) const
+    {
+        const auto result = m_store.find(level, index);
+        if( result ) {
+            return *result;
+        }
+        return m_empty[level];
+    }
+
+    /**
+    * Sibling of every node on the path from the leaf to the root
+    */
+    const std::vector<FieldT> path( size_t index ) const
+    {
+        std::vector<FieldT> result;
+        result.reserve(TREE_DEPTH);
+        for( size_t level = 0; level < TREE_DEPTH; level++ )
+        {
+            result.emplace_back(node(level, (index >> level) ^ 1));
+        }
+        return result;
+    }
+
+    /**
+    * Add a new account to the next free leaf
+    *
+    * @return index of the account
+    */
+    size_t append( const AccountState& state )
+    {
+        while( exists(m_next_index) ) {
+            m_next_index++;
+        }
+
+        const auto index = m_next_index++;
+        update(index, state);
+        return index;
+    }
+
+    /**
+    * Set the state of the account at `index`, creating it if necessary
+    */
+    void update( size_t index, const AccountState& state )
+    {
+        if( index >= (size_t(1) << TREE_DEPTH) ) {
+            throw std::out_of_range("AccountTree index out of range");
+        }
+
+        m_accounts[index] = state;
+        update_leaf(index, m_hasher.leaf(state));
+    }
+
+    /**
+    * Apply a signed transaction to the tree, recording the state of
+    * the `from` and `to` leaves before modification.
+    *
+    * The same steps are performed as `AccountManager.apply_transaction`,
+    * the `to` proof is taken after the `from` leaf has been updated.
+    *
+    * @return false if the transaction cannot be applied, the tree is unmodified
+    */
+    bool apply( const SignedTransaction& stx, TxProof& proof )
+    {
+        if( ! check_transfer(stx) ) {
+            return false;
+        }
+
+        const auto& tx = stx.tx;
+        const FieldT amount(tx.amount);
+        auto from = m_accounts[tx.from_idx];
+
+        proof.merkle_root = root();
+        proof.stx = stx;
+
+        // Update `from` leaf, recording its state before modification
+        proof.state_from = from;
+        proof.before_from = path(tx.from_idx);
+        from.nonce += 1;
+        from.balance -= amount;
+        update(tx.from_idx, from);
+
+        // Update `to` leaf, recording its state before modification
+        auto to = m_accounts[tx.to_idx];
+        proof.state_to = to;
+        proof.before_to = path(tx.to_idx);
+        to.balance += amount;
+        update(tx.to_idx, to);
+
+        return true;
+    }
+
+    /**
+    * Set the state of many accounts, then recompute each modified node once,
+    * level by level, rather than rehashing the whole path of every leaf.
+    * Leaves which share a subtree share the hashing above it.
+    *
+    * The hashes of each level are split across `n_threads`, or one thread
+    * per core if zero. If an index appears more than once the last state
+    * is used.
+    */
+    void update_many( const std::vector<std::pair<size_t, AccountState>>& updates, size_t n_threads = 0 )
+    {
+        std::vector<size_t> indices;
+        indices.reserve(updates.size());
+        for( const auto& it : updates )
+        {
+            if( it.first >= (size_t(1) << TREE_DEPTH) ) {
+                throw std::out_of_range("AccountTree index out of range");
+            }
+            m_accounts[it.first] = it.second;
+            indices.emplace_back(it.first);
+        }
+
+        update_leaves(indices, n_threads);
+    }
+
+    /**
+    * Apply transactions in order, as `apply`, but the tree is rehashed once
+    * afterwards, see `update_many`. No proofs are recorded, when they're
+    * needed pass a `BulkRecord` and use `bulk_proofs`.
+    *
+    * @return Number of transactions applied, stopping at the first which
+    *         cannot be
+    */
+    size_t apply_many( const std::vector<SignedTransaction>& stxs, size_t n_threads = 0 )
+    {
+        return apply_transfers(stxs, nullptr, n_threads);
+    }
+
+    /**
+    * Apply transactions as `apply_many`, recording what changed so their
+    * proofs can be produced later, on demand, by `bulk_proofs`
+    */
+    size_t apply_many( const std::vector<SignedTransaction>& stxs, BulkRecord& record, size_t n_threads = 0 )
+    {
+        return apply_transfers(stxs, &record, n_threads);
+    }
+
+    /**
+    * Produce the proof of each transaction applied by `apply_many`, the same
+    * as `apply` would have, by replaying them over the recorded nodes. This
+    * costs the path hashing `apply_many` saved, but only when it's needed.
+    *
+    * The tree mustn't have been modified since, and `record` is consumed.
+    *
+    * @return false if the tree has been modified since
+    */
+    bool bulk_proofs( BulkRecord& record, std::vector<TxProof>& proofs )
+    {
+        if( record.new_root != root() ) {
+            std::cerr << "error bulk_proofs: tree modified since apply_many" << endl;
+            return false;
+        }
+
+        auto& nodes = record.nodes;
+        const auto lookup = [&]( size_t level, size_t index ) -> const FieldT& {
+            const auto it = nodes.find(BulkRecord::node_key(level, index));
+            return it != nodes.end() ? it->second : node(level, index);
+        };
+
+        const auto sibling_path = [&]( size_t index ) {
+            std::vector<FieldT> result;
+            result.reserve(TREE_DEPTH);
+            for( size_t level = 0; level < TREE_DEPTH; level++ ) {
+                result.emplace_back(lookup(level, (index >> level) ^ 1));
+            }
+            return result;
+        };
+
+        const auto set_leaf = [&]( size_t index, const AccountState& state ) {
+            record.accounts[index] = state;
+            FieldT current = m_hasher.leaf(state);
+            nodes[BulkRecord::node_key(0, index)] = current;
+            for( size_t level = 0; level < TREE_DEPTH; level++ )
+            {
+                const auto& sibling = lookup(level, index ^ 1);
+                current = (index & 1) ? m_hasher.node(level, sibling, current) : m_hasher.node(level, current, sibling);
+                index >>= 1;
+                nodes[BulkRecord::node_key(level + 1, index)] = current;
+            }
+        };
+
+        proofs.resize(record.stxs.size());
+        for( size_t i = 0; i < record.stxs.size(); i++ )
+        {
+            const auto& stx = record.stxs[i];
+            const FieldT amount(stx.tx.amount);
+            auto& proof = proofs[i];
+            proof.is_noop = false;
+            proof.merkle_root = lookup(TREE_DEPTH, 0);
+            proof.stx = stx;
+
+            auto from = record.accounts.at(stx.tx.from_idx);
+            proof.state_from = from;
+            proof.before_from = sibling_path(stx.tx.from_idx);
+            from.nonce += 1;
+            from.balance -= amount;
+            set_leaf(stx.tx.from_idx, from);
+
+            auto to = record.accounts.at(stx.tx.to_idx);
+            proof.state_to = to;
+            proof.before_to = sibling_path(stx.tx.to_idx);
+            to.balance += amount;
+            set_leaf(stx.tx.to_idx, to);
+        }
+
+        const auto ok = lookup(TREE_DEPTH, 0) == record.new_root;
+        record.clear();
+        if( ! ok ) {
+            std::cerr << "error bulk_proofs: replay doesn't reach the root of apply_many" << endl;
+        }
+        return ok;
+    }
+
+protected:
+    // Not worth starting a thread for fewer hashes than this
+    static const size_t MIN_HASHES_PER_THREAD = 64;
+
+    size_t apply_transfers( const std::vector<SignedTransaction>& stxs, BulkRecord *record, size_t n_threads )
+    {
+        std::vector<size_t> indices;
+        indices.reserve(2 * stxs.size());
+
+        if( record )
+        {
+            record->clear();
+            record->merkle_root = root();
+        }
+
+        size_t n_applied = 0;
+        for( const auto& stx : stxs )
+        {
+            if( ! check_transfer(stx) ) {
+                break;
+            }
+
+            // Only the state before the first change is kept
+            if( record )
+            {
+                record->stxs.emplace_back(stx);
+                record->accounts.emplace(stx.tx.from_idx, m_accounts[stx.tx.from_idx]);
+                record->accounts.emplace(stx.tx.to_idx, m_accounts[stx.tx.to_idx]);
+            }
+
+            const FieldT amount(stx.tx.amount);
+            auto& from = m_accounts[stx.tx.from_idx];
+            from.nonce += 1;
+            from.balance -= amount;
+            m_accounts[stx.tx.to_idx].balance += amount;
+
+            indices.emplace_back(stx.tx.from_idx);
+            indices.emplace_back(stx.tx.to_idx);
+            n_applied++;
+        }
+
+        // Paths of the modified leaves, up to where they join one already recorded
+        if( record )
+        {
+            for( const auto index : indices )
+            {
+                for( size_t level = 0; level <= TREE_DEPTH; level++ )
+                {
+                    if( ! record->nodes.emplace(BulkRecord::node_key(level, index >> level), node(level, index >> level)).second ) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        update_leaves(indices, n_threads);
+
+        if( record ) {
+            record->new_root = root();
+        }
+        return n_applied;
+    }
+
+    /**
+    * @return false if the transaction cannot be applied to the current state
+    */
+    bool check_transfer( const SignedTransaction& stx ) const
+    {
+        const auto& tx = stx.tx;
+        if( ! exists(tx.from_idx) || ! exists(tx.to_idx) ) {
+            std::cerr << "error apply: unknown account" << endl;
+            return false;
+        }
+
+        const FieldT amount(tx.amount);
+        const auto& from = account(tx.from_idx);
+
+        if( stx.nonce != from.nonce ) {
+            std::cerr << "error apply: nonce mismatch, expected " << from.nonce << " got " << stx.nonce << endl;
+            return false;
+        }
+
+        // The circuit can never spend from an account past the last nonce
+        if( (size_t(from.nonce) + 1) >= (size_t(1) << TREE_DEPTH) ) {
+            std::cerr << "error apply: nonce of sender exhausted" << endl;
+            return false;
+        }
+
+        if( field_lt(from.balance, amount) ) {
+            std::cerr << "error apply: balance not sufficient to perform transfer" << endl;
+            return false;
+        }
+
+        // A transfer to itself leaves the balance unchanged, so can't overflow
+        if( tx.from_idx != tx.to_idx && (account(tx.to_idx).balance + amount).as_bigint().num_bits() > BALANCE_BITS ) {
+            std::cerr << "error apply: balance of receiver would overflow" << endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+    * Call `func(hasher, i)` for every `i` below `n`, split into contiguous
+    * ranges across threads, each with its own `MerkleHasher`
+    */
+    template<typename FuncT>
+    void parallel_hash( size_t n, size_t n_threads, const FuncT& func )
+    {
+        if( n_threads == 0 ) {
+            n_threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+        n_threads = std::max(size_t(1), std::min(n_threads, n / MIN_HASHES_PER_THREAD));
+
+        while( m_thread_hashers.size() + 1 < n_threads ) {
+            m_thread_hashers.emplace_back(new MerkleHasher);
+        }
+
+        std::vector<std::thread> threads;
+        threads.reserve(n_threads - 1);
+        for( size_t t = 1; t < n_threads; t++ )
+        {
+            threads.emplace_back([this, &func, n, n_threads, t]() {
+                auto& hasher = *m_thread_hashers[t - 1];
+                for( size_t i = (t * n) / n_threads; i < ((t + 1) * n) / n_threads; i++ ) {
+                    func(hasher, i);
+                }
+            });
+        }
+
+        for( size_t i = 0; i < n / n_threads; i++ ) {
+            func(m_hasher, i);
+        }
+
+        for( auto& thread : threads ) {
+            thread.join();
+        }
+    }
+
+    /**
+    * Rehash the leaves at `indices`, then every node above them once
+    *
+    * Nodes are only read while hashing and written between levels, so the
+    * node store needn't be thread-safe.
+    */
+    void update_leaves( std::vector<size_t> indices, size_t n_threads )
+    {
+        if( indices.empty() ) {
+            return;
+        }
+
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        m_store.reserve(indices.back(), m_empty);
+
+        const auto& accounts = m_accounts;
+        std::vector<FieldT> values(indices.size());
+        parallel_hash(indices.size(), n_threads, [&]( MerkleHasher& hasher, size_t i ) {
+            values[i] = hasher.leaf(accounts.at(indices[i]));
+        });
+
+        for( size_t i = 0; i < indices.size(); i++ ) {
+            m_store.set(0, indices[i], values[i]);
+        }
+
+        for( size_t level = 0; level < TREE_DEPTH; level++ )
+        {
+            // Parents of the modified nodes, still in order
+            size_t n = 0;
+            for( size_t i = 0; i < indices.size(); i++ )
+            {
+                const auto parent = indices[i] >> 1;
+                if( n == 0 || indices[n - 1] != parent ) {
+                    indices[n++] = parent;
+                }
+            }
+            indices.resize(n);
+            values.resize(n);
+
+            parallel_hash(n, n_threads, [&]( MerkleHasher& hasher, size_t i ) {
+                const auto parent = indices[i];
+                values[i] = hasher.node(level, node(level, parent << 1), node(level, (parent << 1) | 1));
+            });
+
+            for( size_t i = 0; i < n; i++ ) {
+                m_store.set(level + 1, indices[i], values[i]);
+            }
+        }
+    }
+
+    void update_leaf( size_t index, const FieldT& leaf )
+    {
+        m_store.reserve(index, m_empty);
+
+        FieldT current = leaf;
+        m_store.set(0, index, current);
+
+        for( size_t level = 0; level < TREE_DEPTH; level++ )
+        {
+            const auto& sibling = node(level, index ^ 1);
+            if( index & 1 ) {
+                current = m_hasher.node(level, sibling, current);
+            }
+            else {
+                current = m_hasher.node(level, current, sibling);
+            }
+            index >>= 1;
+            m_store.set(level + 1, index, current);
+        }
+    }
+};
+
+
+/**
+* Tree with a flat array of nodes, for sequentially allocated accounts
+*/
+typedef AccountTreeT<DenseNodeStore> AccountTree;
+
+
+/**
+* Tree which only stores occupied paths, for sparsely allocated accounts
+*/
+typedef AccountTreeT<SparseNodeStore> SparseAccountTree;
+
+
 // namespace snasma
 }
 
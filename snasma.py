@@ -19,6 +19,12 @@ from ethsnarks.longsight import LongsightL12p5_MP
 TREE_SIZE = 24
 AMOUNT_BITS = 32
 
+# Binary batch format, see `txfile.hpp`
+TXFILE_MAGIC = b'SNASMATX'
+TXFILE_VERSION = 1
+TXFILE_HEADER = '<8sIIIIQ'
+TXFILE_RECORD_SIZE = ((10 + (2 * TREE_SIZE)) * 32) + (8 * 4)
+
 
 def eprint(*args, **kwargs):
     print(*args, file=sys.stderr, **kwargs)
@@ -92,12 +98,44 @@ def path2str(path):
     return ' '.join([str(_) for _ in path])
 
 
+def field2bytes(value):
+    """
+    Field element as a 32 byte little-endian integer
+    """
+    value = int(value)
+    return struct.pack('<4Q', *[(value >> (64 * i)) & 0xFFFFFFFFFFFFFFFF for i in range(4)])
+
+
 class TransactionProof(namedtuple('_TransactionProof', ('merkle_root', 'stx', 'state_from', 'state_to', 'before_from', 'before_to'))):
     def __str__(self):
         subobjs = [str(_) for _ in [self.merkle_root, self.stx, self.state_from, self.state_to]]
         paths = [self.before_from, self.before_to]
         return ' '.join(subobjs + [path2str(_.path) for _ in paths])
 
+    def to_bytes(self):
+        """
+        Fixed-width binary record, as read by `decode_txproof` in `txfile.hpp`
+        """
+        stx = self.stx
+        fields = [self.merkle_root, stx.sig.R.x, stx.sig.R.y, stx.sig.s,
+                  self.state_from.pubkey.x, self.state_from.pubkey.y, self.state_from.balance,
+                  self.state_to.pubkey.x, self.state_to.pubkey.y, self.state_to.balance]
+        fields += self.before_from.path + self.before_to.path
+        ints = struct.pack('<8I', stx.tx.from_idx, stx.tx.to_idx, stx.tx.amount, stx.nonce,
+                           self.state_from.nonce, self.state_to.nonce, 0, 0)
+        return b''.join([field2bytes(_) for _ in fields]) + ints
+
+
+def write_txfile(handle, tx_proofs):
+    """
+    Write a binary batch file containing all of the transaction proofs
+    """
+    handle.write(struct.pack(TXFILE_HEADER, TXFILE_MAGIC, TXFILE_VERSION, TREE_SIZE, TXFILE_RECORD_SIZE, 0, len(tx_proofs)))
+    for tx_proof in tx_proofs:
+        record = tx_proof.to_bytes()
+        assert len(record) == TXFILE_RECORD_SIZE
+        handle.write(record)
+
 
 class AccountManager(object):
     def __init__(self, tree_size):
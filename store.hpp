@@ -0,0 +1,707 @@
+#ifndef STORE_HPP_
+#define STORE_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "txfile.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace snasma {
+
+
+/**
+* Persistent account tree
+*
+* A directory holds a snapshot of the tree and a write-ahead log of every
+* change made since the snapshot. Changes are buffered in memory and written
+* to the log, followed by a commit record holding the merkle root, by
+* `commit()`, which is called once a batch has been proven. After a crash the
+* state is recovered from the snapshot, then the log is replayed up to the
+* last commit record, each commit must reproduce its merkle root. Anything
+* after the last commit, including a partially written record, is discarded.
+*
+* Snapshot, `snapshot`:
+*
+*   offset  size
+*   0       8       magic "SNASMASS"
+*   8       4       version
+*   12      4       tree depth
+*   16      8       sequence number of the last log record included
+*   24      8       number of accounts
+*   32      8       next index used by `append`
+*   40      4       capacity depth of the node array
+*   44      4       size of a raw node
+*   48      8       number of nodes
+*   56      8       checksum of everything after the header
+*   64      32      merkle root
+*
+* Followed by the accounts, 128 bytes each, then the nodes of the dense
+* node array, level by level, as raw field elements in Montgomery form, so
+* they are copied rather than converted. As with the proving key, the raw
+* node size in the header makes sure the file is only used by a build with
+* the same representation.
+*
+* Account:
+*
+*   0       8       index
+*   8       4       nonce
+*   12      20      reserved, zero
+*   32      96      pubkey.x, pubkey.y, balance
+*
+* Log record, `log`, all 128 bytes:
+*
+*   0       8       sequence number, incremented by one for each record
+*   8       4       type
+*   12      4       checksum of the record, computed with this field zero
+*   16      4       index, or from_idx
+*   20      4       to_idx
+*   24      4       amount
+*   28      4       nonce
+*   32      96      pubkey.x, pubkey.y, balance, or the merkle root
+*
+* The snapshot is written to a temporary file then renamed, after which the
+* log is truncated. Log records already included in the snapshot are skipped
+* if the log wasn't truncated before a crash.
+*
+* If a commit can't be written, the log is truncated back to the end of the
+* last commit, so a partial write can't leave a gap in the sequence numbers
+* which would stop the replay of later commits. `m_tree` still holds the
+* changes which weren't written, so the store fails every further change,
+* commit and snapshot; it must be closed and opened again to recover the
+* committed state.
+*/
+static const char SNAPSHOT_MAGIC[8] = {'S', 'N', 'A', 'S', 'M', 'A', 'S', 'S'};
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const size_t SNAPSHOT_HEADER_SIZE = 96;
+static const size_t SNAPSHOT_ACCOUNT_SIZE = 128;
+static const size_t SNAPSHOT_NODE_SIZE = sizeof(ethsnarks::FieldT::mont_repr);
+
+static const size_t WAL_RECORD_SIZE = 128;
+static const uint32_t WAL_APPEND = 1;
+static const uint32_t WAL_UPDATE = 2;
+static const uint32_t WAL_TRANSFER = 3;
+static const uint32_t WAL_COMMIT = 4;
+
+
+static bool write_all( int fd, const uint8_t *data, size_t length )
+{
+    while( length > 0 )
+    {
+        const auto n = ::write(fd, data, length);
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+        data += n;
+        length -= size_t(n);
+    }
+    return true;
+}
+
+
+/**
+* Make a rename or file creation in `dir` durable
+*/
+static bool sync_directory( const std::string& dir )
+{
+    const int fd = ::open(dir.c_str(), O_RDONLY);
+    if( fd < 0 ) {
+        return false;
+    }
+    const bool ok = fsync(fd) == 0;
+    ::close(fd);
+    return ok;
+}
+
+
+static void seal_wal_record( uint8_t *p )
+{
+    store_le32(p + 12, 0);
+    const auto checksum = checksum_update(CHECKSUM_INIT, p, WAL_RECORD_SIZE);
+    store_le32(p + 12, uint32_t(checksum ^ (checksum >> 32)));
+}
+
+
+static bool check_wal_record( const uint8_t *p )
+{
+    uint8_t copy[WAL_RECORD_SIZE];
+    memcpy(copy, p, WAL_RECORD_SIZE);
+    seal_wal_record(copy);
+    return memcmp(copy, p, WAL_RECORD_SIZE) == 0;
+}
+
+
+class PersistentAccountStore
+{
+public:
+    typedef ethsnarks::FieldT FieldT;
+
+    AccountTree m_tree;
+
+    std::string m_dir;
+    int m_log_fd;
+
+    // Sequence number of the last record, including those not yet committed
+    uint64_t m_seq;
+
+    // Records written by the next `commit`
+    std::vector<uint8_t> m_pending;
+
+    // Size of the log and sequence number as of the last commit
+    uint64_t m_committed_size;
+    uint64_t m_committed_seq;
+
+    // A commit failed, `m_tree` no longer matches the log
+    bool m_failed;
+
+    PersistentAccountStore() :
+        m_log_fd(-1),
+        m_seq(0),
+        m_committed_size(0),
+        m_committed_seq(0),
+        m_failed(false)
+    { }
+
+    ~PersistentAccountStore()
+    {
+        close();
+    }
+
+    PersistentAccountStore( const PersistentAccountStore& ) = delete;
+    PersistentAccountStore& operator= ( const PersistentAccountStore& ) = delete;
+
+    const std::string snapshot_path() const
+    {
+        return m_dir + "/snapshot";
+    }
+
+    const std::string log_path() const
+    {
+        return m_dir + "/log";
+    }
+
+    /**
+    * Open the store in an existing directory, recovering the state as of
+    * the last commit. An empty directory is an empty tree.
+    *
+    * Must only be called once, on a new instance.
+    */
+    bool open( const std::string& dir )
+    {
+        m_dir = dir;
+
+        if( ! load_snapshot() ) {
+            return false;
+        }
+
+        m_log_fd = ::open(log_path().c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if( m_log_fd < 0 ) {
+            std::cerr << "error store: cannot open " << log_path() << endl;
+            return false;
+        }
+
+        return replay_log();
+    }
+
+    /**
+    * Drops any changes which haven't been committed from the log, they are
+    * still applied to `m_tree`
+    */
+    void close()
+    {
+        if( m_log_fd >= 0 ) {
+            ::close(m_log_fd);
+        }
+        m_log_fd = -1;
+        m_pending.clear();
+    }
+
+    const FieldT& root() const
+    {
+        return m_tree.root();
+    }
+
+    bool failed() const
+    {
+        return m_failed;
+    }
+
+    size_t append( const AccountState& state )
+    {
+        check_not_failed();
+        const auto index = m_tree.append(state);
+        log_account(WAL_APPEND, index, state);
+        return index;
+    }
+
+    void update( size_t index, const AccountState& state )
+    {
+        check_not_failed();
+        m_tree.update(index, state);
+        log_account(WAL_UPDATE, index, state);
+    }
+
+    /**
+    * Apply a transaction to the tree, see `AccountTreeT::apply`
+    */
+    bool apply( const SignedTransaction& stx, TxProof& proof )
+    {
+        if( m_failed ) {
+            std::cerr << "error store: apply after a failed commit" << endl;
+            return false;
+        }
+
+        if( ! m_tree.apply(stx, proof) ) {
+            return false;
+        }
+
+        uint8_t *p = next_record(WAL_TRANSFER);
+        store_le32(p + 16, stx.tx.from_idx);
+        store_le32(p + 20, stx.tx.to_idx);
+        store_le32(p + 24, stx.tx.amount);
+        store_le32(p + 28, stx.nonce);
+        seal_wal_record(p);
+        return true;
+    }
+
+    /**
+    * Durably write every change since the last commit, with the current root
+    *
+    * On failure the log is truncated to the last commit and the store fails
+    * from then on, see above.
+    */
+    bool commit()
+    {
+        if( m_failed ) {
+            std::cerr << "error store: commit after a failed commit" << endl;
+            return false;
+        }
+
+        uint8_t *p = next_record(WAL_COMMIT);
+        encode_field(p + 32, root());
+        seal_wal_record(p);
+
+        const bool ok = write_all(m_log_fd, m_pending.data(), m_pending.size())
+                     && fdatasync(m_log_fd) == 0;
+
+        if( ok ) {
+            m_committed_size += m_pending.size();
+            m_committed_seq = m_seq;
+        }
+        else {
+            std::cerr << "error store: cannot write " << log_path() << endl;
+            fail();
+        }
+
+        m_pending.clear();
+        return ok;
+    }
+
+    /**
+    * Write a snapshot of the committed state, then truncate the log
+    */
+    bool snapshot()
+    {
+        if( m_failed || ! m_pending.empty() ) {
+            std::cerr << "error store: snapshot with uncommitted changes" << endl;
+            return false;
+        }
+
+        const auto tmp_path = snapshot_path() + ".tmp";
+        const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if( fd < 0 ) {
+            std::cerr << "error store: cannot create " << tmp_path << endl;
+            return false;
+        }
+
+        bool ok = write_snapshot(fd) && fsync(fd) == 0;
+        ok = (::close(fd) == 0) && ok;
+        ok = ok
+          && rename(tmp_path.c_str(), snapshot_path().c_str()) == 0
+          && sync_directory(m_dir)
+          && ftruncate(m_log_fd, 0) == 0
+          && fsync(m_log_fd) == 0;
+
+        if( ok ) {
+            m_committed_size = 0;
+        }
+        else {
+            std::cerr << "error store: cannot write snapshot " << snapshot_path() << endl;
+        }
+        return ok;
+    }
+
+protected:
+    void check_not_failed() const
+    {
+        if( m_failed ) {
+            throw std::runtime_error("PersistentAccountStore changed after a failed commit");
+        }
+    }
+
+    /**
+    * Remove anything written since the last commit, so records appended
+    * after reopening follow on from it
+    */
+    void fail()
+    {
+        m_failed = true;
+        m_seq = m_committed_seq;
+        if( ftruncate(m_log_fd, off_t(m_committed_size)) != 0 || fdatasync(m_log_fd) != 0 ) {
+            std::cerr << "error store: cannot truncate " << log_path() << " after a failed commit" << endl;
+        }
+    }
+
+    uint8_t *next_record( uint32_t type )
+    {
+        const auto offset = m_pending.size();
+        m_pending.resize(offset + WAL_RECORD_SIZE, 0);
+
+        uint8_t *p = m_pending.data() + offset;
+        store_le64(p, ++m_seq);
+        store_le32(p + 8, type);
+        return p;
+    }
+
+    void log_account( uint32_t type, size_t index, const AccountState& state )
+    {
+        uint8_t *p = next_record(type);
+        store_le32(p + 16, uint32_t(index));
+        store_le32(p + 28, state.nonce);
+        encode_field(p + 32, state.pubkey.x);
+        encode_field(p + 64, state.pubkey.y);
+        encode_field(p + 96, state.balance);
+        seal_wal_record(p);
+    }
+
+    bool write_snapshot( int fd )
+    {
+        const auto& store = m_tree.m_store;
+
+        std::vector<size_t> indices;
+        indices.reserve(m_tree.m_accounts.size());
+        for( const auto& it : m_tree.m_accounts ) {
+            indices.emplace_back(it.first);
+        }
+        std::sort(indices.begin(), indices.end());
+
+        uint8_t header[SNAPSHOT_HEADER_SIZE] = {0};
+        if( ! write_all(fd, header, sizeof(header)) ) {
+            return false;
+        }
+
+        // Written in chunks, the checksum is updated as each is written
+        const size_t chunk_records = 4096;
+        std::vector<uint8_t> buf(chunk_records * SNAPSHOT_ACCOUNT_SIZE);
+        uint64_t checksum = CHECKSUM_INIT;
+
+        for( size_t begin = 0; begin < indices.size(); begin += chunk_records )
+        {
+            const auto end = std::min(begin + chunk_records, indices.size());
+            std::fill(buf.begin(), buf.end(), 0);
+            for( size_t i = begin; i < end; i++ )
+            {
+                const auto& state = m_tree.m_accounts.at(indices[i]);
+                uint8_t *p = buf.data() + ((i - begin) * SNAPSHOT_ACCOUNT_SIZE);
+                store_le64(p, indices[i]);
+                store_le32(p + 8, state.nonce);
+                encode_field(p + 32, state.pubkey.x);
+                encode_field(p + 64, state.pubkey.y);
+                encode_field(p + 96, state.balance);
+            }
+
+            const auto length = (end - begin) * SNAPSHOT_ACCOUNT_SIZE;
+            checksum = checksum_update(checksum, buf.data(), length);
+            if( ! write_all(fd, buf.data(), length) ) {
+                return false;
+            }
+        }
+
+        for( size_t begin = 0; begin < store.m_nodes.size(); begin += chunk_records )
+        {
+            const auto end = std::min(begin + chunk_records, store.m_nodes.size());
+            for( size_t i = begin; i < end; i++ ) {
+                memcpy(buf.data() + ((i - begin) * SNAPSHOT_NODE_SIZE), store.m_nodes[i].mont_repr.data, SNAPSHOT_NODE_SIZE);
+            }
+
+            const auto length = (end - begin) * SNAPSHOT_NODE_SIZE;
+            checksum = checksum_update(checksum, buf.data(), length);
+            if( ! write_all(fd, buf.data(), length) ) {
+                return false;
+            }
+        }
+
+        memcpy(header, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+        store_le32(header + 8, SNAPSHOT_VERSION);
+        store_le32(header + 12, TREE_DEPTH);
+        store_le64(header + 16, m_seq);
+        store_le64(header + 24, indices.size());
+        store_le64(header + 32, m_tree.m_next_index);
+        store_le32(header + 40, uint32_t(store.m_capacity_depth));
+        store_le32(header + 44, SNAPSHOT_NODE_SIZE);
+        store_le64(header + 48, store.m_nodes.size());
+        store_le64(header + 56, checksum);
+        encode_field(header + 64, root());
+
+        return pwrite(fd, header, sizeof(header), 0) == ssize_t(sizeof(header));
+    }
+
+    /**
+    * @return true if the snapshot was loaded, or there isn't one
+    */
+    bool load_snapshot()
+    {
+        const auto path = snapshot_path();
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if( fd < 0 ) {
+            if( errno == ENOENT ) {
+                return true;
+            }
+            std::cerr << "error store: cannot open " << path << endl;
+            return false;
+        }
+
+        struct stat st;
+        if( fstat(fd, &st) != 0 || size_t(st.st_size) < SNAPSHOT_HEADER_SIZE ) {
+            std::cerr << "error store: cannot stat, or too small " << path << endl;
+            ::close(fd);
+            return false;
+        }
+
+        const auto length = size_t(st.st_size);
+        void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if( addr == MAP_FAILED ) {
+            std::cerr << "error store: cannot mmap " << path << endl;
+            return false;
+        }
+
+        madvise(addr, length, MADV_SEQUENTIAL);
+        const bool ok = decode_snapshot((const uint8_t*)addr, length);
+        munmap(addr, length);
+
+        if( ! ok ) {
+            std::cerr << "error store: invalid snapshot " << path << endl;
+        }
+        return ok;
+    }
+
+    bool decode_snapshot( const uint8_t *data, size_t length )
+    {
+        if( memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+         || load_le32(data + 8) != SNAPSHOT_VERSION
+         || load_le32(data + 12) != TREE_DEPTH
+         || load_le32(data + 44) != SNAPSHOT_NODE_SIZE ) {
+            std::cerr << "error store: bad magic, version, tree depth or node size" << endl;
+            return false;
+        }
+
+        const auto seq = load_le64(data + 16);
+        const auto n_accounts = load_le64(data + 24);
+        const auto next_index = load_le64(data + 32);
+        const auto capacity_depth = load_le32(data + 40);
+        const auto n_nodes = load_le64(data + 48);
+
+        if( capacity_depth > TREE_DEPTH
+         || n_accounts > (length - SNAPSHOT_HEADER_SIZE) / SNAPSHOT_ACCOUNT_SIZE
+         || n_nodes > (length - SNAPSHOT_HEADER_SIZE - (n_accounts * SNAPSHOT_ACCOUNT_SIZE)) / SNAPSHOT_NODE_SIZE ) {
+            std::cerr << "error store: truncated snapshot" << endl;
+            return false;
+        }
+
+        const uint8_t *accounts = data + SNAPSHOT_HEADER_SIZE;
+        const uint8_t *nodes = accounts + (n_accounts * SNAPSHOT_ACCOUNT_SIZE);
+        const auto body_length = size_t(nodes + (n_nodes * SNAPSHOT_NODE_SIZE) - accounts);
+
+        if( checksum_update(CHECKSUM_INIT, accounts, body_length) != load_le64(data + 56) ) {
+            std::cerr << "error store: snapshot checksum mismatch" << endl;
+            return false;
+        }
+
+        auto& tree = m_tree;
+        tree.m_accounts.reserve(n_accounts);
+        for( size_t i = 0; i < n_accounts; i++ )
+        {
+            const uint8_t *p = accounts + (i * SNAPSHOT_ACCOUNT_SIZE);
+            AccountState state;
+            state.nonce = load_le32(p + 8);
+            if( ! decode_field(p + 32, state.pubkey.x)
+             || ! decode_field(p + 64, state.pubkey.y)
+             || ! decode_field(p + 96, state.balance) ) {
+                return false;
+            }
+            tree.m_accounts[load_le64(p)] = state;
+        }
+
+        // Lay out the node array for the same capacity, then overwrite it
+        tree.m_store.reserve((size_t(1) << capacity_depth) - 1, tree.m_empty);
+        if( tree.m_store.m_capacity_depth != capacity_depth || tree.m_store.m_nodes.size() != n_nodes ) {
+            std::cerr << "error store: node array size mismatch" << endl;
+            return false;
+        }
+        for( size_t i = 0; i < n_nodes; i++ ) {
+            memcpy(tree.m_store.m_nodes[i].mont_repr.data, nodes + (i * SNAPSHOT_NODE_SIZE), SNAPSHOT_NODE_SIZE);
+        }
+
+        FieldT expected_root;
+        if( ! decode_field(data + 64, expected_root) || tree.root() != expected_root ) {
+            std::cerr << "error store: snapshot root mismatch" << endl;
+            return false;
+        }
+
+        tree.m_next_index = next_index;
+        m_seq = seq;
+        return true;
+    }
+
+    /**
+    * Apply the log records following the snapshot, up to the last commit,
+    * then truncate the log after that commit
+    */
+    bool replay_log()
+    {
+        struct stat st;
+        if( fstat(m_log_fd, &st) != 0 ) {
+            std::cerr << "error store: cannot stat " << log_path() << endl;
+            return false;
+        }
+
+        std::vector<uint8_t> data(size_t(st.st_size));
+        if( ! data.empty() && pread(m_log_fd, data.data(), data.size(), 0) != ssize_t(data.size()) ) {
+            std::cerr << "error store: cannot read " << log_path() << endl;
+            return false;
+        }
+
+        // Find the end of the last commit, stopping at the first invalid record
+        size_t committed_end = 0;
+        for( size_t offset = 0; offset + WAL_RECORD_SIZE <= data.size(); offset += WAL_RECORD_SIZE )
+        {
+            const uint8_t *p = data.data() + offset;
+            if( ! check_wal_record(p) ) {
+                break;
+            }
+            if( offset > 0 && load_le64(p) != load_le64(p - WAL_RECORD_SIZE) + 1 ) {
+                break;
+            }
+            if( load_le32(p + 8) == WAL_COMMIT ) {
+                committed_end = offset + WAL_RECORD_SIZE;
+            }
+        }
+
+        // The last record replayed is a commit, so no transfers are left over
+        std::vector<SignedTransaction> transfers;
+        for( size_t offset = 0; offset < committed_end; offset += WAL_RECORD_SIZE )
+        {
+            const uint8_t *p = data.data() + offset;
+            const auto seq = load_le64(p);
+            if( seq <= m_seq ) {
+                // Already included in the snapshot
+                continue;
+            }
+
+            if( seq != m_seq + 1 ) {
+                std::cerr << "error store: log starts at " << seq << ", expected " << (m_seq + 1) << endl;
+                return false;
+            }
+
+            // Consecutive transfers are applied together, rehashing once
+            if( load_le32(p + 8) == WAL_TRANSFER ) {
+                transfers.emplace_back(decode_wal_transfer(p));
+            }
+            else {
+                if( m_tree.apply_many(transfers) != transfers.size() || ! replay_record(p) ) {
+                    std::cerr << "error store: cannot replay log up to record " << seq << endl;
+                    return false;
+                }
+                transfers.clear();
+            }
+
+            m_seq = seq;
+        }
+
+        m_committed_size = committed_end;
+        m_committed_seq = m_seq;
+
+        if( committed_end != data.size() ) {
+            std::cerr << "warning store: discarding " << (data.size() - committed_end) << " uncommitted bytes from " << log_path() << endl;
+            if( ftruncate(m_log_fd, off_t(committed_end)) != 0 || fsync(m_log_fd) != 0 ) {
+                std::cerr << "error store: cannot truncate " << log_path() << endl;
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    static const SignedTransaction decode_wal_transfer( const uint8_t *p )
+    {
+        SignedTransaction stx;
+        stx.tx.from_idx = load_le32(p + 16);
+        stx.tx.to_idx = load_le32(p + 20);
+        stx.tx.amount = load_le32(p + 24);
+        stx.nonce = load_le32(p + 28);
+        return stx;
+    }
+
+    /**
+    * Replay an account or commit record, transfers are replayed by `apply_many`
+    */
+    bool replay_record( const uint8_t *p )
+    {
+        const auto type = load_le32(p + 8);
+        const auto index = load_le32(p + 16);
+
+        if( type == WAL_APPEND || type == WAL_UPDATE )
+        {
+            AccountState state;
+            state.nonce = load_le32(p + 28);
+            if( ! decode_field(p + 32, state.pubkey.x)
+             || ! decode_field(p + 64, state.pubkey.y)
+             || ! decode_field(p + 96, state.balance) ) {
+                return false;
+            }
+
+            if( type == WAL_APPEND ) {
+                return m_tree.append(state) == index;
+            }
+
+            m_tree.update(index, state);
+            return true;
+        }
+
+        if( type == WAL_COMMIT )
+        {
+            FieldT expected_root;
+            if( ! decode_field(p + 32, expected_root) || root() != expected_root ) {
+                std::cerr << "error store: root mismatch at commit " << load_le64(p) << endl;
+                return false;
+            }
+            return true;
+        }
+
+        return false;
+    }
+};
+
+
+// namespace snasma
+}
+
+// STORE_HPP_
+#endif
@@ -0,0 +1,262 @@
+#ifndef STREAM_HPP_
+#define STREAM_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+
+namespace snasma {
+
+
+/**
+* Fixed capacity queue connecting two pipeline stages
+*
+* `push` blocks while the queue is full, which stalls the producing stage
+* until the consumer catches up (back-pressure). After `close` is called
+* the consumer drains the remaining items, then `pop` returns false.
+*/
+template<typename T>
+class BoundedQueue
+{
+public:
+    std::mutex m_mutex;
+    std::condition_variable m_not_empty;
+    std::condition_variable m_not_full;
+    std::deque<T> m_items;
+    const size_t m_capacity;
+    bool m_closed;
+
+    BoundedQueue( size_t capacity ) :
+        m_capacity(capacity),
+        m_closed(false)
+    { }
+
+    /**
+    * @return false if the queue has been closed
+    */
+    bool push( T item )
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [this]{ return m_closed || m_items.size() < m_capacity; });
+        if( m_closed ) {
+            return false;
+        }
+        m_items.emplace_back(std::move(item));
+        m_not_empty.notify_one();
+        return true;
+    }
+
+    /**
+    * @return false if the queue is closed and empty
+    */
+    bool pop( T& item )
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [this]{ return m_closed || ! m_items.empty(); });
+        if( m_items.empty() ) {
+            return false;
+        }
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+        m_not_full.notify_all();
+    }
+};
+
+
+/**
+* Reads lines from stdin, or from clients of a Unix domain socket,
+* waiting no longer than a timeout for each line.
+*
+* When listening on a socket, clients are accepted one at a time and the
+* stream continues across connections. With stdin the stream ends at EOF.
+*/
+class StreamSource
+{
+public:
+    enum Status {
+        LINE,
+        TIMEOUT,
+        END
+    };
+
+    int m_listen_fd;
+    int m_fd;
+    std::string m_buffer;
+
+    StreamSource() :
+        m_listen_fd(-1),
+        m_fd(-1)
+    { }
+
+    ~StreamSource()
+    {
+        if( m_fd > STDIN_FILENO ) {
+            ::close(m_fd);
+        }
+        if( m_listen_fd >= 0 ) {
+            ::close(m_listen_fd);
+        }
+    }
+
+    StreamSource( const StreamSource& ) = delete;
+    StreamSource& operator= ( const StreamSource& ) = delete;
+
+    bool open_stdin()
+    {
+        m_fd = STDIN_FILENO;
+        return true;
+    }
+
+    bool open_socket( const char *path )
+    {
+        struct sockaddr_un addr;
+        if( strlen(path) >= sizeof(addr.sun_path) ) {
+            std::cerr << "error stream: socket path too long" << std::endl;
+            return false;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+        m_listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if( m_listen_fd < 0 ) {
+            std::cerr << "error stream: socket() " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        unlink(path);
+        if( bind(m_listen_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+         || listen(m_listen_fd, 1) != 0 )
+        {
+            std::cerr << "error stream: cannot listen on " << path << ", " << strerror(errno) << std::endl;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+    * Wait for the next complete line
+    *
+    * The timeout bounds the whole call, however many partial reads it takes
+    * to complete the line.
+    *
+    * @param timeout_ms Maximum time to wait, or -1 to wait indefinitely
+    */
+    Status next_line( std::string& line, int timeout_ms )
+    {
+        char chunk[1 << 16];
+        const auto deadline = ClockT::now() + std::chrono::milliseconds(std::max(timeout_ms, 0));
+
+        while( true )
+        {
+            const auto newline = m_buffer.find('\n');
+            if( newline != std::string::npos ) {
+                line.assign(m_buffer, 0, newline);
+                m_buffer.erase(0, newline + 1);
+                return LINE;
+            }
+
+            // Wait for the next client
+            if( m_fd < 0 )
+            {
+                if( m_listen_fd < 0 ) {
+                    return END;
+                }
+
+                struct pollfd pfd = {m_listen_fd, POLLIN, 0};
+                const auto ready = poll(&pfd, 1, remaining_ms(deadline, timeout_ms));
+                if( ready == 0 ) {
+                    return TIMEOUT;
+                }
+                if( ready < 0 ) {
+                    if( errno == EINTR ) {
+                        continue;
+                    }
+                    return END;
+                }
+
+                m_fd = accept(m_listen_fd, nullptr, nullptr);
+                continue;
+            }
+
+            struct pollfd pfd = {m_fd, POLLIN, 0};
+            const auto ready = poll(&pfd, 1, remaining_ms(deadline, timeout_ms));
+            if( ready == 0 ) {
+                return TIMEOUT;
+            }
+            if( ready < 0 && errno == EINTR ) {
+                continue;
+            }
+
+            const auto n = ready < 0 ? -1 : read(m_fd, chunk, sizeof(chunk));
+            if( n > 0 ) {
+                m_buffer.append(chunk, size_t(n));
+                continue;
+            }
+            if( n < 0 && errno == EINTR ) {
+                continue;
+            }
+
+            // End of the current connection, a trailing partial line is still returned
+            if( m_fd != STDIN_FILENO ) {
+                ::close(m_fd);
+            }
+            m_fd = -1;
+
+            if( ! m_buffer.empty() ) {
+                line.swap(m_buffer);
+                m_buffer.clear();
+                return LINE;
+            }
+        }
+    }
+
+protected:
+    typedef std::chrono::steady_clock ClockT;
+
+    /**
+    * Milliseconds left until `deadline`, or -1 to wait indefinitely
+    */
+    static int remaining_ms( const ClockT::time_point& deadline, int timeout_ms )
+    {
+        if( timeout_ms < 0 ) {
+            return -1;
+        }
+
+        const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - ClockT::now()).count();
+        return int(std::max(decltype(remaining)(0), remaining));
+    }
+};
+
+
+// namespace snasma
+}
+
+// STREAM_HPP_
+#endif
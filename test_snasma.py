@@ -3,7 +3,7 @@ import random
 from snasma import *
 
 
-def main():
+def main(binary_file=None):
 	mgr = AccountManager(1<<24)
 
 	accts = list()
@@ -29,6 +29,10 @@ def main():
 			handle.write("\t%d -> %d;\n" % (tx_proof.stx.tx.from_idx, tx_proof.stx.tx.to_idx))
 		handle.write("}\n")
 
+	if binary_file is not None:
+		with open(binary_file, 'wb') as handle:
+			write_txfile(handle, all_transactions)
+
 
 if __name__ == "__main__":
 	sys.exit(main(*sys.argv[1:]))
@@ -0,0 +1,390 @@
+#ifndef TXFILE_HPP_
+#define TXFILE_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "snasma.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+namespace snasma {
+
+
+/**
+* Binary batch format for `TxProof`
+*
+* The file begins with a 32 byte header, followed by `count` fixed-width
+* records. All integers are little-endian, field elements are 32 byte
+* little-endian integers (not in Montgomery form).
+*
+* Header:
+*
+*   offset  size
+*   0       8       magic "SNASMATX"
+*   8       4       version
+*   12      4       tree depth
+*   16      4       record size
+*   20      4       reserved, zero
+*   24      8       count
+*
+* Record:
+*
+*   0       32      merkle_root
+*   32      96      stx.sig (R.x, R.y, s)
+*   128     96      state_from (pubkey.x, pubkey.y, balance)
+*   224     96      state_to (pubkey.x, pubkey.y, balance)
+*   320     768     before_from[TREE_DEPTH]
+*   1088    768     before_to[TREE_DEPTH]
+*   1856    4       stx.tx.from_idx
+*   1860    4       stx.tx.to_idx
+*   1864    4       stx.tx.amount
+*   1868    4       stx.nonce
+*   1872    4       state_from.nonce
+*   1876    4       state_to.nonce
+*   1880    4       flags
+*   1884    4       reserved, zero
+*
+* Records are a multiple of 32 bytes, so field elements stay aligned.
+*
+* Flags:
+*
+*   bit 0   no-op (padding) transaction
+*/
+static const char TXFILE_MAGIC[8] = {'S', 'N', 'A', 'S', 'M', 'A', 'T', 'X'};
+static const uint32_t TXFILE_VERSION = 1;
+static const size_t TXFILE_HEADER_SIZE = 32;
+static const size_t TXFILE_FIELD_SIZE = 32;
+static const size_t TXFILE_INTS_OFFSET = (10 + (2 * TREE_DEPTH)) * TXFILE_FIELD_SIZE;
+static const size_t TXFILE_RECORD_SIZE = TXFILE_INTS_OFFSET + (8 * 4);
+static const uint32_t TXFILE_FLAG_NOOP = 1;
+
+
+static inline uint32_t load_le32( const uint8_t *p )
+{
+    return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+
+static inline uint64_t load_le64( const uint8_t *p )
+{
+    return uint64_t(load_le32(p)) | (uint64_t(load_le32(p + 4)) << 32);
+}
+
+
+static inline void store_le32( uint8_t *p, uint32_t x )
+{
+    p[0] = uint8_t(x);
+    p[1] = uint8_t(x >> 8);
+    p[2] = uint8_t(x >> 16);
+    p[3] = uint8_t(x >> 24);
+}
+
+
+static inline void store_le64( uint8_t *p, uint64_t x )
+{
+    store_le32(p, uint32_t(x));
+    store_le32(p + 4, uint32_t(x >> 32));
+}
+
+
+/**
+* 64bit FNV-1a variant which mixes a whole word at a time, it is only used
+* to detect truncated or corrupted files, not tampering.
+*/
+static uint64_t checksum_update( uint64_t h, const uint8_t *data, size_t length )
+{
+    size_t i = 0;
+    for( ; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t) ) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        h = (h ^ word) * 0x100000001b3ULL;
+    }
+    for( ; i < length; i++ ) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static const uint64_t CHECKSUM_INIT = 0xcbf29ce484222325ULL;
+
+
+/**
+* Decode a 32 byte little-endian integer into a field element
+*
+* @return false if the integer isn't less than the field modulus
+*/
+static bool decode_field( const uint8_t *p, ethsnarks::FieldT& out )
+{
+    static_assert(sizeof(mp_limb_t) == 8, "64bit limbs required");
+    static_assert(ethsnarks::FieldT::num_limbs * sizeof(mp_limb_t) == TXFILE_FIELD_SIZE, "field elements must be 32 bytes");
+
+    libff::bigint<ethsnarks::FieldT::num_limbs> value;
+    for( size_t i = 0; i < ethsnarks::FieldT::num_limbs; i++ )
+    {
+        value.data[i] = load_le64(p + (i * sizeof(mp_limb_t)));
+    }
+
+    if( ! below_modulus(value) ) {
+        return false;
+    }
+
+    out = ethsnarks::FieldT(value);
+    return true;
+}
+
+
+static void encode_field( uint8_t *p, const ethsnarks::FieldT& x )
+{
+    const auto value = x.as_bigint();
+    for( size_t i = 0; i < ethsnarks::FieldT::num_limbs; i++ )
+    {
+        store_le64(p + (i * sizeof(mp_limb_t)), value.data[i]);
+    }
+}
+
+
+static void encode_txfile_header( uint8_t *p, uint64_t count )
+{
+    memset(p, 0, TXFILE_HEADER_SIZE);
+    memcpy(p, TXFILE_MAGIC, sizeof(TXFILE_MAGIC));
+    store_le32(p + 8, TXFILE_VERSION);
+    store_le32(p + 12, TREE_DEPTH);
+    store_le32(p + 16, TXFILE_RECORD_SIZE);
+    store_le64(p + 24, count);
+}
+
+
+/**
+* @return number of records, or -1 if the header is invalid
+*/
+static int64_t decode_txfile_header( const uint8_t *p, size_t length )
+{
+    if( length < TXFILE_HEADER_SIZE || memcmp(p, TXFILE_MAGIC, sizeof(TXFILE_MAGIC)) != 0 ) {
+        std::cerr << "error txfile: bad magic" << endl;
+        return -1;
+    }
+
+    if( load_le32(p + 8) != TXFILE_VERSION ) {
+        std::cerr << "error txfile: unsupported version " << load_le32(p + 8) << endl;
+        return -1;
+    }
+
+    if( load_le32(p + 12) != TREE_DEPTH || load_le32(p + 16) != TXFILE_RECORD_SIZE ) {
+        std::cerr << "error txfile: tree depth or record size mismatch" << endl;
+        return -1;
+    }
+
+    const auto count = load_le64(p + 24);
+    if( count > (length - TXFILE_HEADER_SIZE) / TXFILE_RECORD_SIZE ) {
+        std::cerr << "error txfile: truncated, expected " << count << " records" << endl;
+        return -1;
+    }
+
+    return int64_t(count);
+}
+
+
+static void encode_txproof( uint8_t *p, const TxProof& self )
+{
+    encode_field(p, self.merkle_root);
+    encode_field(p + 32, self.stx.sig.R.x);
+    encode_field(p + 64, self.stx.sig.R.y);
+    encode_field(p + 96, self.stx.sig.s);
+    encode_field(p + 128, self.state_from.pubkey.x);
+    encode_field(p + 160, self.state_from.pubkey.y);
+    encode_field(p + 192, self.state_from.balance);
+    encode_field(p + 224, self.state_to.pubkey.x);
+    encode_field(p + 256, self.state_to.pubkey.y);
+    encode_field(p + 288, self.state_to.balance);
+
+    for( size_t i = 0; i < TREE_DEPTH; i++ )
+    {
+        encode_field(p + ((10 + i) * TXFILE_FIELD_SIZE), self.before_from[i]);
+        encode_field(p + ((10 + TREE_DEPTH + i) * TXFILE_FIELD_SIZE), self.before_to[i]);
+    }
+
+    uint8_t *ints = p + TXFILE_INTS_OFFSET;
+    store_le32(ints, self.stx.tx.from_idx);
+    store_le32(ints + 4, self.stx.tx.to_idx);
+    store_le32(ints + 8, self.stx.tx.amount);
+    store_le32(ints + 12, self.stx.nonce);
+    store_le32(ints + 16, self.state_from.nonce);
+    store_le32(ints + 20, self.state_to.nonce);
+    store_le32(ints + 24, self.is_noop ? TXFILE_FLAG_NOOP : 0);
+    store_le32(ints + 28, 0);
+}
+
+
+/**
+* Decode a record into an existing `TxProof`
+*
+* When `out` is re-used its path vectors are overwritten in-place,
+* so no memory is allocated.
+*
+* @return false if any field element is out of range
+*/
+static bool decode_txproof( const uint8_t *p, TxProof& out )
+{
+    bool ok = decode_field(p, out.merkle_root)
+           && decode_field(p + 32, out.stx.sig.R.x)
+           && decode_field(p + 64, out.stx.sig.R.y)
+           && decode_field(p + 96, out.stx.sig.s)
+           && decode_field(p + 128, out.state_from.pubkey.x)
+           && decode_field(p + 160, out.state_from.pubkey.y)
+           && decode_field(p + 192, out.state_from.balance)
+           && decode_field(p + 224, out.state_to.pubkey.x)
+           && decode_field(p + 256, out.state_to.pubkey.y)
+           && decode_field(p + 288, out.state_to.balance);
+
+    out.before_from.resize(TREE_DEPTH);
+    out.before_to.resize(TREE_DEPTH);
+    for( size_t i = 0; ok && i < TREE_DEPTH; i++ )
+    {
+        ok = decode_field(p + ((10 + i) * TXFILE_FIELD_SIZE), out.before_from[i])
+          && decode_field(p + ((10 + TREE_DEPTH + i) * TXFILE_FIELD_SIZE), out.before_to[i]);
+    }
+
+    const uint8_t *ints = p + TXFILE_INTS_OFFSET;
+    out.stx.tx.from_idx = load_le32(ints);
+    out.stx.tx.to_idx = load_le32(ints + 4);
+    out.stx.tx.amount = load_le32(ints + 8);
+    out.stx.nonce = load_le32(ints + 12);
+    out.state_from.nonce = load_le32(ints + 16);
+    out.state_to.nonce = load_le32(ints + 20);
+    out.is_noop = (load_le32(ints + 24) & TXFILE_FLAG_NOOP) != 0;
+
+    return ok;
+}
+
+
+/**
+* Write a complete binary batch file
+*/
+static bool write_txfile( std::ostream& os, const std::vector<TxProof>& items )
+{
+    std::vector<uint8_t> buf(std::max(TXFILE_HEADER_SIZE, TXFILE_RECORD_SIZE));
+
+    encode_txfile_header(buf.data(), items.size());
+    os.write((const char*)buf.data(), TXFILE_HEADER_SIZE);
+
+    for( const auto& item : items )
+    {
+        encode_txproof(buf.data(), item);
+        os.write((const char*)buf.data(), TXFILE_RECORD_SIZE);
+    }
+
+    return bool(os);
+}
+
+
+/**
+* Read-only memory mapping of a binary batch file
+*
+* Records are decoded directly from the mapping.
+*/
+class MappedTxFile
+{
+public:
+    const uint8_t *m_data;
+    size_t m_length;
+    size_t m_count;
+
+    MappedTxFile() :
+        m_data(nullptr), m_length(0), m_count(0)
+    { }
+
+    ~MappedTxFile()
+    {
+        close();
+    }
+
+    MappedTxFile( const MappedTxFile& ) = delete;
+    MappedTxFile& operator= ( const MappedTxFile& ) = delete;
+
+    /**
+    * @return true if the file at `path` starts with the binary magic
+    */
+    static bool is_binary( const char *path )
+    {
+        char magic[sizeof(TXFILE_MAGIC)];
+        std::ifstream infile(path, std::ios::binary);
+        return infile.read(magic, sizeof(magic))
+            && memcmp(magic, TXFILE_MAGIC, sizeof(magic)) == 0;
+    }
+
+    bool open( const char *path )
+    {
+        close();
+
+        const int fd = ::open(path, O_RDONLY);
+        if( fd < 0 ) {
+            std::cerr << "error txfile: cannot open " << path << endl;
+            return false;
+        }
+
+        struct stat st;
+        if( fstat(fd, &st) != 0 || size_t(st.st_size) < TXFILE_HEADER_SIZE ) {
+            std::cerr << "error txfile: cannot stat, or too small " << path << endl;
+            ::close(fd);
+            return false;
+        }
+
+        void *addr = mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if( addr == MAP_FAILED ) {
+            std::cerr << "error txfile: cannot mmap " << path << endl;
+            return false;
+        }
+
+        madvise(addr, size_t(st.st_size), MADV_SEQUENTIAL);
+        m_data = (const uint8_t*)addr;
+        m_length = size_t(st.st_size);
+
+        const auto count = decode_txfile_header(m_data, m_length);
+        if( count < 0 ) {
+            close();
+            return false;
+        }
+        m_count = size_t(count);
+
+        return true;
+    }
+
+    void close()
+    {
+        if( m_data != nullptr ) {
+            munmap((void*)m_data, m_length);
+        }
+        m_data = nullptr;
+        m_length = 0;
+        m_count = 0;
+    }
+
+    size_t size() const
+    {
+        return m_count;
+    }
+
+    bool decode( size_t index, TxProof& out ) const
+    {
+        if( index >= m_count ) {
+            return false;
+        }
+        return decode_txproof(m_data + TXFILE_HEADER_SIZE + (index * TXFILE_RECORD_SIZE), out);
+    }
+};
+
+
+// namespace snasma
+}
+
+// TXFILE_HPP_
+#endif
@@ -0,0 +1,164 @@
+#ifndef TXGROUP_HPP_
+#define TXGROUP_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "circuit.hpp"
+
+
+namespace snasma {
+
+
+/**
+* Applies a group of `k` transactions from the same sender, authorised by
+* one signature over all of them (see `SignedTransactionGroup`).
+*
+* Each transaction is a `TxTransferCircuit`, chained by merkle root as the
+* transactions of a batch are. The signature is verified once, over the
+* concatenation of the messages each transaction would have signed:
+*
+*   M = M_0 || M_1 || ... || M_k-1
+*   M_i = (from_idx, to_idx_i, amount_i, nonce + i)
+*
+* The group must have the same `from_idx` and `from_pubkey` throughout, the
+* nonce of each transaction follows on from the previous, and either all or
+* none of the transactions are no-ops. A sender with fewer than `k`
+* transactions in a batch uses `TxCircuit` instead.
+*/
+class TxGroupCircuit : public GadgetT
+{
+public:
+    std::vector<TxTransferCircuit> m_txs;
+
+    // Checks the signature for the whole group, against the `from` account
+    TxSignatureGadget m_signature;
+
+    TxGroupCircuit(
+        ProtoboardT& pb,
+        const jubjub::Params& params,
+        const VariableArrayT& in_IVs,
+        const VariableT& in_merkle_root,
+        const size_t in_size,
+        const std::string& annotation_prefix
+    ) :
+        GadgetT(pb, annotation_prefix),
+        m_txs(make_transfers(pb, in_IVs, in_merkle_root, in_size, annotation_prefix)),
+        m_signature(pb, params, m_txs[0].from_pubkey, m_txs[0].is_noop, group_message(m_txs), annotation_prefix)
+    {
+
+    }
+
+
+    size_t size() const
+    {
+        return m_txs.size();
+    }
+
+
+    const VariableT result() const
+    {
+        return m_txs.back().result();
+    }
+
+
+    /**
+    * @param proofs One proof for each transaction of the group, in order
+    * @param sig Signature over the whole group
+    */
+    void generate_r1cs_witness( const std::vector<TxProof>& proofs, const Signature& sig )
+    {
+        assert( proofs.size() == m_txs.size() );
+
+        this->pb.val(m_txs[0].merkle_root) = proofs[0].merkle_root;
+
+        generate_r1cs_witness_local(proofs, sig);
+    }
+
+
+    /**
+    * Generate the witness for everything except the input merkle root,
+    * see `TxCircuit::generate_r1cs_witness_local`.
+    */
+    void generate_r1cs_witness_local( const std::vector<TxProof>& proofs, const Signature& sig )
+    {
+        for( size_t i = 0; i < m_txs.size(); i++ ) {
+            m_txs[i].generate_r1cs_witness_local(proofs[i]);
+        }
+
+        m_signature.generate_r1cs_witness(sig);
+    }
+
+
+    void generate_r1cs_constraints()
+    {
+        for( auto& tx : m_txs ) {
+            tx.generate_r1cs_constraints();
+        }
+
+        const auto& first = m_txs[0];
+        for( size_t i = 1; i < m_txs.size(); i++ )
+        {
+            const auto& tx = m_txs[i];
+
+            this->pb.add_r1cs_constraint(
+                ConstraintT(libsnark::pb_packing_sum<FieldT>(tx.tx_from_idx), 1, libsnark::pb_packing_sum<FieldT>(first.tx_from_idx)),
+                FMT(this->annotation_prefix, ".tx[%zu].from_idx == from_idx", i));
+
+            this->pb.add_r1cs_constraint(
+                ConstraintT(tx.from_pubkey.x, 1, first.from_pubkey.x),
+                FMT(this->annotation_prefix, ".tx[%zu].from_pubkey.x == from_pubkey.x", i));
+
+            this->pb.add_r1cs_constraint(
+                ConstraintT(tx.from_pubkey.y, 1, first.from_pubkey.y),
+                FMT(this->annotation_prefix, ".tx[%zu].from_pubkey.y == from_pubkey.y", i));
+
+            this->pb.add_r1cs_constraint(
+                ConstraintT(tx.sig_nonce.packed, 1, m_txs[i - 1].next_nonce),
+                FMT(this->annotation_prefix, ".tx[%zu].nonce == tx[%zu].next_nonce", i, i - 1));
+
+            this->pb.add_r1cs_constraint(
+                ConstraintT(tx.is_noop, 1, first.is_noop),
+                FMT(this->annotation_prefix, ".tx[%zu].is_noop == is_noop", i));
+        }
+
+        m_signature.generate_r1cs_constraints();
+    }
+
+protected:
+    static std::vector<TxTransferCircuit> make_transfers(
+        ProtoboardT& pb,
+        const VariableArrayT& in_IVs,
+        const VariableT& in_merkle_root,
+        const size_t in_size,
+        const std::string& annotation_prefix
+    ) {
+        assert( in_size > 0 );
+
+        std::vector<TxTransferCircuit> result;
+        result.reserve(in_size);
+        for( size_t i = 0; i < in_size; i++ )
+        {
+            const auto root = i ? result.back().result() : in_merkle_root;
+            result.emplace_back(pb, in_IVs, root, FMT(annotation_prefix, ".tx[%zu]", i), nullptr);
+        }
+        return result;
+    }
+
+    static const VariableArrayT group_message( const std::vector<TxTransferCircuit>& txs )
+    {
+        std::vector<VariableArrayT> messages;
+        messages.reserve(txs.size());
+        for( const auto& tx : txs ) {
+            messages.emplace_back(tx.sig_m);
+        }
+        return flatten(messages);
+    }
+};
+
+
+// namespace snasma
+}
+
+// TXGROUP_HPP_
+#endif
@@ -0,0 +1,357 @@
+#ifndef VERIFY_HPP_
+#define VERIFY_HPP_
+
+// Copyright (c) 2018 HarryR
+// License: GPL-3.0+
+
+#include "ethsnarks.hpp"
+#include "utils.hpp"
+#include "jubjub/eddsa.hpp"
+#include "snasma.hpp"
+#include "edwards.hpp"
+
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+
+namespace snasma {
+
+
+/**
+* Computes the challenge `H(R,A,M)` of `jubjub::PureEdDSA_Verify` natively,
+* for messages of `n_bits`, using the hash gadget of a private instance so
+* the result is the same as the circuit.
+*/
+class EdDSAChallenge
+{
+public:
+    ethsnarks::ProtoboardT m_pb;
+    const ethsnarks::jubjub::VariablePointT m_A;
+    const ethsnarks::jubjub::VariablePointT m_R;
+    const ethsnarks::VariableArrayT m_s;
+    const ethsnarks::VariableArrayT m_msg;
+    ethsnarks::jubjub::PureEdDSA_Verify m_sig;
+
+    EdDSAChallenge( const ethsnarks::jubjub::Params& params, size_t n_bits ) :
+        m_A(m_pb, "A"),
+        m_R(m_pb, "R"),
+        m_s(ethsnarks::make_var_array(m_pb, ethsnarks::FieldT::size_in_bits(), "s")),
+        m_msg(ethsnarks::make_var_array(m_pb, n_bits, "msg")),
+        m_sig(m_pb, params, ethsnarks::jubjub::EdwardsPoint(params.Gx, params.Gy), m_A, m_R, m_s, m_msg, "sig")
+    { }
+
+    EdDSAChallenge( const EdDSAChallenge& ) = delete;
+    EdDSAChallenge& operator= ( const EdDSAChallenge& ) = delete;
+
+    const ethsnarks::FieldT hash( const ethsnarks::jubjub::EdwardsPoint& R, const ethsnarks::jubjub::EdwardsPoint& A, const libff::bit_vector& msg )
+    {
+        assert( msg.size() == m_msg.size() );
+
+        m_pb.val(m_A.x) = A.x;
+        m_pb.val(m_A.y) = A.y;
+        m_pb.val(m_R.x) = R.x;
+        m_pb.val(m_R.y) = R.y;
+        m_msg.fill_with_bits(m_pb, msg);
+        m_sig.m_hash_RAM.generate_r1cs_witness();
+        return m_sig.m_hash_RAM.result().get_field_element_from_bits(m_pb);
+    }
+};
+
+
+/**
+* Verifies the signatures of a batch of transactions natively, before any
+* work is done on the circuit, and finds which transaction is invalid.
+*
+* Each signature must satisfy the same equation as `jubjub::PureEdDSA_Verify`:
+*
+*   s*B = R + H(R,A,M)*A
+*
+* Where M is `SignedTransaction::message()`, or the concatenated messages of
+* a `TxGroupProof`, and H is computed by an `EdDSAChallenge` for each message
+* length. A is the `from` public key, or the identity for no-ops.
+*
+* The batch is checked with a random linear combination, using random 128
+* bit `z_i`, with one multi-scalar multiplication (the base point uses the
+* precomputed `eddsa_base_table`):
+*
+*   (sum(z_i*s_i))*B - sum(z_i*R_i) - sum((z_i*h_i)*A_i) = 0
+*
+* The scalars are not reduced, as R and A aren't necessarily in the prime
+* order subgroup. A batch where every signature is valid always passes, an
+* invalid batch passes with negligible probability, unless the error is a
+* small order point, in which case it is rejected by the circuit instead.
+*
+* If the batch fails it is bisected, with the same check, to find the first
+* invalid signature.
+*/
+class BatchVerifier
+{
+public:
+    struct Entry
+    {
+        ExtendedPoint A;
+        ExtendedPoint R;
+        ethsnarks::FieldT s;
+        ethsnarks::FieldT h;
+        bool on_curve;
+    };
+
+    const ethsnarks::jubjub::Params& m_params;
+    const FixedBaseTable& m_base_table;
+
+    // Keyed by message length, a transaction or a group of `k`
+    std::map<size_t, std::unique_ptr<EdDSAChallenge>> m_challenges;
+
+    std::vector<Entry> m_entries;
+    std::random_device m_random;
+
+    BatchVerifier( const ethsnarks::jubjub::Params& params ) :
+        m_params(params),
+        m_base_table(eddsa_base_table(params))
+    { }
+
+    BatchVerifier( const BatchVerifier& ) = delete;
+    BatchVerifier& operator= ( const BatchVerifier& ) = delete;
+
+    void clear()
+    {
+        m_entries.clear();
+    }
+
+    size_t size() const
+    {
+        return m_entries.size();
+    }
+
+    EdDSAChallenge& challenge( size_t n_bits )
+    {
+        auto& result = m_challenges[n_bits];
+        if( ! result ) {
+            result.reset(new EdDSAChallenge(m_params, n_bits));
+        }
+        return *result;
+    }
+
+    void add( const Signature& sig, const ethsnarks::jubjub::EdwardsPoint& A, const libff::bit_vector& msg )
+    {
+        Entry entry;
+        entry.A = ExtendedPoint(A);
+        entry.R = ExtendedPoint(sig.R);
+        entry.s = sig.s;
+        entry.h = challenge(msg.size()).hash(sig.R, A, msg);
+        entry.on_curve = is_on_curve(A, m_params) && is_on_curve(sig.R, m_params);
+
+        m_entries.emplace_back(entry);
+    }
+
+    void add( const SignedTransaction& stx, const ethsnarks::jubjub::EdwardsPoint& A )
+    {
+        add(stx.sig, A, stx.message());
+    }
+
+    void add( const TxProof& proof )
+    {
+        add(proof.stx, proof.is_noop ? identity() : proof.state_from.pubkey);
+    }
+
+    /**
+    * The signature of a group, the public key of the first transaction
+    */
+    void add( const TxGroupProof& group )
+    {
+        const auto& first = group.txs[0];
+        add(group.sig, first.is_noop ? identity() : first.state_from.pubkey, group.message());
+    }
+
+    /**
+    * @param bad_index Set to the index of the first invalid signature
+    * @return true if all signatures are valid
+    */
+    bool verify( size_t& bad_index )
+    {
+        for( size_t i = 0; i < m_entries.size(); i++ )
+        {
+            if( ! m_entries[i].on_curve ) {
+                bad_index = i;
+                return false;
+            }
+        }
+
+        return find_invalid(0, m_entries.size(), bad_index);
+    }
+
+    /**
+    * Find every invalid signature, rather than only the first, bisecting
+    * each range which fails
+    *
+    * @param bad Set to the indices of the invalid signatures, in order
+    * @return true if all signatures are valid
+    */
+    bool verify_all( std::vector<size_t>& bad )
+    {
+        bad.clear();
+        collect_invalid(0, m_entries.size(), bad);
+        return bad.empty();
+    }
+
+    /**
+    * Check a single signature, without the random linear combination
+    */
+    bool verify_one( size_t index ) const
+    {
+        const auto& e = m_entries[index];
+        const auto lhs = m_base_table.mul(e.s.as_bigint(), m_params);
+        const auto rhs = e.R.add(scalar_mul(e.A, e.h.as_bigint(), m_params), m_params);
+        return e.on_curve && lhs == rhs;
+    }
+
+protected:
+    static const ethsnarks::jubjub::EdwardsPoint& identity()
+    {
+        static const ethsnarks::jubjub::EdwardsPoint result(ethsnarks::FieldT::zero(), ethsnarks::FieldT::one());
+        return result;
+    }
+
+    static const size_t RANDOM_LIMBS = 128 / GMP_NUMB_BITS;
+
+    const WideScalarT random_scalar()
+    {
+        WideScalarT z;
+        for( size_t i = 0; i < RANDOM_LIMBS; i++ ) {
+            z.data[i] = (mp_limb_t(m_random()) << 32) | mp_limb_t(m_random());
+        }
+        return z;
+    }
+
+    bool check_range( size_t begin, size_t end )
+    {
+        for( size_t i = begin; i < end; i++ )
+        {
+            if( ! m_entries[i].on_curve ) {
+                return false;
+            }
+        }
+
+        std::vector<ExtendedPoint> points;
+        std::vector<WideScalarT> scalars;
+        points.reserve(2 * (end - begin));
+        scalars.reserve(points.capacity());
+
+        // sum(z_i * s_i), multiplied by the base point separately
+        WideScalarT base_scalar;
+
+        for( size_t i = begin; i < end; i++ )
+        {
+            const auto& e = m_entries[i];
+            const auto z = random_scalar();
+
+            WideScalarT zs;
+            mpn_mul(zs.data, e.s.as_bigint().data, ethsnarks::FieldT::num_limbs, z.data, RANDOM_LIMBS);
+            wide_add(base_scalar, zs);
+
+            points.emplace_back(e.R.neg());
+            scalars.emplace_back(z);
+
+            WideScalarT zh;
+            mpn_mul(zh.data, e.h.as_bigint().data, ethsnarks::FieldT::num_limbs, z.data, RANDOM_LIMBS);
+            points.emplace_back(e.A.neg());
+            scalars.emplace_back(zh);
+        }
+
+        const auto rhs = multi_scalar_mul(points, scalars, m_params);
+        return m_base_table.mul(base_scalar, m_params).add(rhs, m_params).is_zero();
+    }
+
+    bool find_invalid( size_t begin, size_t end, size_t& bad_index )
+    {
+        if( begin == end || check_range(begin, end) ) {
+            return true;
+        }
+
+        if( end - begin == 1 ) {
+            bad_index = begin;
+            return false;
+        }
+
+        const auto middle = begin + ((end - begin) / 2);
+        return find_invalid(begin, middle, bad_index)
+            && find_invalid(middle, end, bad_index);
+    }
+
+    void collect_invalid( size_t begin, size_t end, std::vector<size_t>& bad )
+    {
+        if( begin == end || check_range(begin, end) ) {
+            return;
+        }
+
+        if( end - begin == 1 ) {
+            bad.emplace_back(begin);
+            return;
+        }
+
+        const auto middle = begin + ((end - begin) / 2);
+        collect_invalid(begin, middle, bad);
+        collect_invalid(middle, end, bad);
+    }
+};
+
+
+
+/**
+* Order of the curve, every point's order divides it (it is 8 times the
+* prime order subgroup)
+*/
+static const libff::bigint<ethsnarks::FieldT::num_limbs>& jubjub_curve_order()
+{
+    static const libff::bigint<ethsnarks::FieldT::num_limbs> result("21888242871839275222246405745257275088614511777268538073601725287587578984328");
+    return result;
+}
+
+
+static const ethsnarks::jubjub::EdwardsPoint eddsa_public_key( const ethsnarks::jubjub::Params& params, const ethsnarks::FieldT& secret )
+{
+    return eddsa_base_table(params).mul(secret.as_bigint(), params).to_affine();
+}
+
+
+/**
+* Sign `msg` with the secret scalar `k`, so it satisfies `PureEdDSA_Verify`
+* for the public key `k*B`
+*
+* This is for creating test transactions, not for holding keys: the nonce
+* `r` is random rather than derived from the message. `s = r + h*k` is
+* reduced by the order of the curve, and `r` is drawn again in the rare
+* case the result isn't below the field modulus.
+*/
+static const Signature eddsa_sign( EdDSAChallenge& challenge, const ethsnarks::jubjub::Params& params, const ethsnarks::FieldT& k, const libff::bit_vector& msg )
+{
+    const auto& table = eddsa_base_table(params);
+    const auto& order = jubjub_curve_order();
+    const auto A = table.mul(k.as_bigint(), params).to_affine();
+
+    while( true )
+    {
+        const auto r = ethsnarks::FieldT::random_element();
+        const auto R = table.mul(r.as_bigint(), params).to_affine();
+
+        auto sum = wide_mul(challenge.hash(R, A, msg), k);
+        wide_add(sum, to_wide(r));
+
+        mp_limb_t quotient[WideScalarT::N - ethsnarks::FieldT::num_limbs + 1];
+        FieldBigintT s;
+        mpn_tdiv_qr(quotient, s.data, 0, sum.data, WideScalarT::N, order.data, ethsnarks::FieldT::num_limbs);
+
+        if( below_modulus(s) ) {
+            return Signature(R, ethsnarks::FieldT(s));
+        }
+    }
+}
+
+
+// namespace snasma
+}
+
+// VERIFY_HPP_
+#endif